@@ -0,0 +1,50 @@
+#include "admission.hxx"
+
+tg::AdmissionControl::AdmissionControl(const AdmissionSettings& settings) : _settings(settings) { }
+
+const tg::AdmissionSettings& tg::AdmissionControl::settings() const
+{
+    return _settings;
+}
+
+bool tg::AdmissionControl::try_enter()
+{
+    auto current = _inFlight.load(std::memory_order_relaxed);
+
+    do {
+        if(current >= _settings.maxInFlight) {
+            count(AdmissionEvent::Overloaded);
+            return false;
+        }
+    } while(!_inFlight.compare_exchange_weak(current, current + 1, std::memory_order_relaxed));
+
+    count(AdmissionEvent::Admitted);
+    return true;
+}
+
+void tg::AdmissionControl::enter_replacing()
+{
+    count(AdmissionEvent::Admitted);
+}
+
+void tg::AdmissionControl::leave()
+{
+    _inFlight.fetch_sub(1, std::memory_order_relaxed);
+}
+
+void tg::AdmissionControl::count(AdmissionEvent event)
+{
+    _events[static_cast<std::size_t>(event)].fetch_add(1, std::memory_order_relaxed);
+}
+
+tg::AdmissionStats tg::AdmissionControl::stats() const
+{
+    AdmissionStats result;
+
+    for(std::size_t i = 0; i < result.events.size(); i++) {
+        result.events[i] = _events[i].load(std::memory_order_relaxed);
+    }
+
+    result.inFlight = _inFlight.load(std::memory_order_relaxed);
+    return result;
+}
@@ -0,0 +1,85 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+
+namespace tg {
+
+enum class OverflowPolicy
+{
+    // a full chat queue loses its oldest update
+    DropOldest,
+    // a repeated update replaces the pending one with the same content, otherwise the oldest is dropped
+    Coalesce,
+    // a full chat queue refuses new updates
+    Reject
+};
+
+struct AdmissionSettings
+{
+    std::size_t chatQueueLimit { 32 };
+    OverflowPolicy overflow { OverflowPolicy::DropOldest };
+
+    // updates admitted but not handled yet, over all chats
+    std::size_t maxInFlight { 4096 };
+
+    // older updates are dropped, both when they arrive and when their turn comes
+    std::chrono::seconds maxAge { 60 };
+};
+
+enum class AdmissionEvent
+{
+    Admitted,
+    Rejected,
+    DroppedOldest,
+    Coalesced,
+    Stale,
+    Overloaded,
+    // admitted, but the chat had no session to handle it
+    Unhandled,
+    Count
+};
+
+struct AdmissionStats
+{
+    std::array<std::uint64_t, static_cast<std::size_t>(AdmissionEvent::Count)> events {};
+    std::size_t inFlight { 0 };
+
+    std::uint64_t operator[](AdmissionEvent event) const
+    {
+        return events[static_cast<std::size_t>(event)];
+    }
+};
+
+// global part of the backpressure: the in-flight cap and the counters, chat queues live in the sessions
+class AdmissionControl
+{
+public:
+    explicit AdmissionControl(const AdmissionSettings& settings = {});
+
+    AdmissionControl(const AdmissionControl&) = delete;
+    AdmissionControl& operator=(const AdmissionControl&) = delete;
+
+    const AdmissionSettings& settings() const;
+
+    // takes an in-flight slot, counts the update as overloaded if there is none
+    bool try_enter();
+
+    // an update replacing a dropped one keeps the slot of that one
+    void enter_replacing();
+    void leave();
+
+    void count(AdmissionEvent event);
+
+    AdmissionStats stats() const;
+
+private:
+    AdmissionSettings _settings;
+
+    std::atomic<std::size_t> _inFlight { 0 };
+    std::array<std::atomic<std::uint64_t>, static_cast<std::size_t>(AdmissionEvent::Count)> _events {};
+};
+
+}
@@ -1,23 +1,62 @@
 #include "bot_runtime.hxx"
 
+#include <format>
 #include <ranges>
 
 #include "lua_load.hxx"
+#include "lua_runtime.hxx"
 
 #include "logdef.hxx"
 #include "security.hxx"
 
 constexpr static std::chrono::seconds ActivityTimeout { 60 };
+constexpr static std::chrono::seconds VerificationInterval { 10 };
 
-std::unique_ptr<tg::BotRuntime> tg::BotRuntime::create(const std::string& apiKey, const std::string& commandsPath)
+// how long the runtime thread serves webhook connections before it checks for stop and idle sessions
+constexpr static std::chrono::milliseconds WebhookRunSlice { 500 };
+
+namespace tg::internal {
+
+TgBot::HttpClient& http_client()
+{
+    static TgBot::BoostHttpOnlySslClient client;
+    return client;
+}
+
+// a cap that can not be enforced is a configuration error, not something to find out from a runaway chat
+ExpectedErr<> check_memory_limit(const lua::StateOptions& options)
 {
-    auto context = std::make_unique<BotRuntime>(apiKey);
+    if(options.memoryLimit == 0 || lua::custom_allocators_supported()) {
+        return std::monostate {};
+    }
+
+    return errors::Error(std::format("{} does not accept custom allocators, the memory limit of {} MiB can not be enforced. "
+        "Build LuaJIT with GC64 or set memory_limit_mb to 0", lua::runtime::name(), options.memoryLimit / sizes::megabytes<std::size_t>(1)));
+}
+
+}
+
+std::unique_ptr<tg::BotRuntime> tg::BotRuntime::create(const std::string& apiKey, const std::string& commandsPath, const std::string& apiUrl)
+{
+    auto context = std::make_unique<BotRuntime>(apiKey, apiUrl);
     auto commandsBytecodeMap = lua::load_bytecode_map(commandsPath);
 
-    if(commandsBytecodeMap) {
-        context->_bytecode = commandsBytecodeMap.value();
-    } else {
+    if(!commandsBytecodeMap) {
         luabot_logFatal("Bytecode map loading failed: {}", commandsBytecodeMap.error().message());
+        return context;
+    }
+
+    if(auto memory = internal::check_memory_limit(context->_settings.states); !memory) {
+        luabot_logFatal("Invalid runtime configuration: {}", memory.error().message());
+        return context;
+    }
+
+    auto scripts = lua::check_scripts(std::move(commandsBytecodeMap.value()), context->_settings.states);
+
+    if(scripts) {
+        context->_bytecode = scripts.value();
+    } else {
+        luabot_logFatal("Scripts check failed: {}", scripts.error().message());
     }
 
     return context;
@@ -31,17 +70,39 @@ std::unique_ptr<tg::BotRuntime> tg::BotRuntime::create_from_project(const std::s
         throw std::runtime_error("Virtual FS exception occured!");
     }
 
-    auto commands = lua::load_bytecode_map(filesystem.value());
+    lua::ArchiveBytecodeCache cache(filesystem.value());
+    auto commands = lua::load_bytecode_map(filesystem.value(), cache);
 
     if(!commands) {
         luabot_logErr("Unable to load scripts: {}", commands.error().message());
         return nullptr;
     }
 
+    auto settings = load_runtime_settings(filesystem.value());
+
+    if(auto memory = internal::check_memory_limit(settings.states); !memory) {
+        luabot_logErr("Invalid runtime configuration: {}", memory.error().message());
+        return nullptr;
+    }
+
+    auto scripts = lua::check_scripts(std::move(commands.value()), settings.states);
+
+    if(!scripts) {
+        luabot_logErr("Unable to load scripts: {}", scripts.error().message());
+        return nullptr;
+    }
+
+    // the archive is only open in memory, without saving it the next start would compile everything again
+    if(cache.changed() && files::save_to_zip(zip, filesystem.value()) != errors::OK) {
+        luabot_logWarn("Unable to save the bytecode cache into {}", zip);
+    }
+
     std::unique_ptr<BotRuntime> bot = { nullptr };
 
     if(!external_api_key.empty()) {
         bot = std::make_unique<BotRuntime>(external_api_key);
+        bot->_bytecode = scripts.value();
+        bot->_settings = settings;
     } else {
         auto key = files::read_bytes(filesystem.value(), "credentials.bin");
 
@@ -60,33 +121,289 @@ std::unique_ptr<tg::BotRuntime> tg::BotRuntime::create_from_project(const std::s
         auto decrypted_key = decrypted.value();
 
         bot = std::make_unique<BotRuntime>(std::string(decrypted_key.begin(), decrypted_key.end()));
-
-        return bot;
+        bot->_bytecode = scripts.value();
+        bot->_settings = settings;
     }
 
     return bot;
 }
 
-tg::BotRuntime::BotRuntime(const std::string& apiKey)
+tg::BotRuntime::BotRuntime(const std::string& apiKey, const std::string& apiUrl)
+{
+    _bot = std::make_shared<TgBot::Bot>(apiKey, internal::http_client(), apiUrl);
+    _poller = std::make_unique<UpdatePoller>(_bot);
+    _sendQueue = std::make_unique<SendQueue>(_bot);
+    _executor = std::make_unique<SessionExecutor>(globals::MaxThreadedSession);
+}
+
+tg::BotRuntime::~BotRuntime()
+{
+    stop();
+}
+
+void tg::BotRuntime::start()
+{
+    if(running()) {
+        return;
+    }
+
+    luabot_logInfo("Running commands on {}", lua::runtime::name());
+
+    if(_settings.states.gc.generational && !lua::runtime::HasGenerationalGc) {
+        luabot_logWarn("{} has no generational collector, the incremental one is used", lua::runtime::name());
+    }
+
+    if(_settings.states.jit && _settings.states.budget.enabled() && lua::runtime::HasJit) {
+        luabot_logWarn("Instruction budgets are enabled, the JIT compiler is turned off for every command state");
+    }
+
+    if(!_admission) {
+        _admission = std::make_unique<AdmissionControl>(_settings.admission);
+    }
+
+    if(!_sessionContext) {
+        _sessionContext.reset(new SessionContext { *_executor, _bot, *_sendQueue, *_admission, _settings.states });
+    }
+
+    if(_settings.isolation == StateIsolation::Shared) {
+        if(_sharedGroups.empty()) {
+            for(std::size_t i = 0; i < globals::MaxThreadedSession; i++) {
+                auto state = lua::make_shared_state(_bytecode, _settings.states);
+
+                if(!state) {
+                    luabot_logErr("Unable to create a shared Lua state: {}", state.error().message());
+                    _sharedGroups.clear();
+                    return;
+                }
+
+                _sharedGroups.push_back({ std::make_unique<Strand>(static_cast<std::int64_t>(i)), std::unique_ptr<lua::SharedState>(state.value()) });
+            }
+        }
+    } else if(!_statePool) {
+        _statePool = std::make_unique<lua::StatePool>(_bytecode, _settings.prewarmedStates, _settings.states);
+    }
+
+    if(_settings.updates == UpdateSource::Webhook && !start_webhook()) {
+        return;
+    }
+
+    _pollerThread = std::jthread([this](const std::stop_token& token) {
+        luabot_logInfo("Update poller started");
+
+        while(!token.stop_requested()) {
+            poll_and_dispatch();
+        }
+
+        luabot_logInfo("Update poller stopped");
+    });
+}
+
+void tg::BotRuntime::stop()
+{
+    if(!_pollerThread.joinable()) {
+        return;
+    }
+
+    _pollerThread.request_stop();
+    _pollerThread.join();
+
+    // a webhook left registered fails every getUpdates with 409 once the project goes back to polling.
+    // pending updates are kept, the next start picks them up either way
+    if(_webhook && !_settings.webhook.url.empty()) {
+        try {
+            _bot->getApi().deleteWebhook(false);
+        } catch(const std::exception& e) {
+            luabot_logWarn("Unable to remove the webhook {}: {}", _settings.webhook.url, e.what());
+        }
+    }
+
+    // frees the port
+    _webhook.reset();
+}
+
+bool tg::BotRuntime::running() const
 {
-    _bot = std::make_unique<TgBot::Bot>(apiKey);
+    return _pollerThread.joinable();
+}
+
+ExpectedErr<> tg::BotRuntime::reload(BytecodeMap bytecode)
+{
+    // loads and instantiates every command once, whatever would fail in a session fails here
+    auto checked = lua::check_scripts(std::move(bytecode), _settings.states);
+
+    if(!checked) {
+        return checked.error();
+    }
+
+    auto scripts = checked.value();
+    _bytecode = scripts;
+
+    if(_statePool) {
+        _statePool->reload(scripts);
+    }
+
+    // a shared state is only touched on its strand, the chunks are swapped between two tasks of its chats
+    for(auto& group : _sharedGroups) {
+        _executor->submit(*group.strand, [state = group.state.get(), scripts]() {
+            auto reloaded = state->reload(scripts);
+
+            if(!reloaded) {
+                luabot_logErr("Unable to reload scripts of a shared Lua state: {}", reloaded.error().message());
+            }
+        });
+    }
+
+    luabot_logInfo("Scripts reloaded, {} commands", scripts->bytecode.size());
+
+    return std::monostate {};
 }
 
 void tg::BotRuntime::poll_and_dispatch()
 {
+    if(_webhook) {
+        // connections are served on this very thread, updates come back through handle_update
+        _webhook->run_for(WebhookRunSlice);
+    } else {
+        for(const auto& update : _poller->poll()) {
+            handle_update(update);
+        }
+    }
+
+    auto clock_now = std::chrono::steady_clock::now();
+
+    if(clock_now - _lastVerification > VerificationInterval) {
+        verify_sessions();
+        report_admission();
+        _lastVerification = clock_now;
+    }
+}
+
+void tg::BotRuntime::handle_update(const TgBot::Update::Ptr& update)
+{
+    try {
+        dispatch(update);
+    } catch(const std::exception& e) {
+        luabot_logErr("Unable to dispatch update #{}: {}", update->updateId, e.what());
+    }
+}
+
+void tg::BotRuntime::dispatch(const TgBot::Update::Ptr& update)
+{
+    auto chatId = chat_of(update);
+
+    if(!chatId) {
+        luabot_logWarn("Update #{} has no chat to route to, skipped", update->updateId);
+        return;
+    }
+
+    // sessions only enqueue to their strand here, so a chat stuck in a slow handler never blocks the intake
+    auto& session = session_for(chatId.value());
+
+    if(update->message) {
+        session.manage_message(update->message);
+    } else if(update->callbackQuery) {
+        session.manage_message(update->callbackQuery);
+    }
+}
+
+bool tg::BotRuntime::start_webhook()
+{
+    const auto& settings = _settings.webhook;
+
+    try {
+        _webhook = std::make_unique<WebhookListener>(settings, [this](const TgBot::Update::Ptr& update) {
+            handle_update(update);
+        });
+    } catch(const std::exception& e) {
+        luabot_logErr("Unable to start the webhook listener on port {}: {}", settings.port, e.what());
+        return false;
+    }
+
+    if(settings.url.empty()) {
+        luabot_logInfo("No webhook url configured, expecting it to be registered already");
+        return true;
+    }
+
+    try {
+        _bot->getApi().setWebhook(settings.url, nullptr, 40, allowed_updates(), "", false, settings.secret);
+    } catch(const std::exception& e) {
+        luabot_logErr("Unable to register the webhook {}: {}", settings.url, e.what());
+        _webhook.reset();
+        return false;
+    }
+
+    return true;
 }
 
-void tg::BotRuntime::init_new_session(std::uint64_t chatId)
+tg::UserSessionThread& tg::BotRuntime::init_new_session(std::int64_t chatId)
 {
+    std::unique_ptr<UserSessionThread> session;
+
+    if(_settings.isolation == StateIsolation::Shared) {
+        auto& group = group_of(chatId);
+        session = std::make_unique<UserSessionThread>(*_sessionContext, chatId, *group.state, group.strand.get());
+    } else {
+        session = std::make_unique<UserSessionThread>(*_sessionContext, chatId, *_statePool);
+    }
+
+    auto [it, inserted] = _activeSessions.insert_or_assign(chatId, std::move(session));
+
+    return *it->second;
+}
+
+tg::BotRuntime::SharedGroup& tg::BotRuntime::group_of(std::int64_t chatId)
+{
+    return _sharedGroups[std::hash<std::int64_t> {}(chatId) % _sharedGroups.size()];
+}
+
+tg::UserSessionThread& tg::BotRuntime::session_for(std::int64_t chatId)
+{
+    auto it = _activeSessions.find(chatId);
+
+    if(it != _activeSessions.end()) {
+        return *it->second;
+    }
+
+    return init_new_session(chatId);
 }
 
 void tg::BotRuntime::verify_sessions()
 {
-    auto clock_now = std::chrono::high_resolution_clock::now();
+    auto clock_now = std::chrono::steady_clock::now();
+    auto memoryLimit = _settings.states.memoryLimit;
 
-    for(auto &sessionPtr : _activeSessions | std::views::values) {
-        if(sessionPtr->last_activity() - clock_now > ActivityTimeout) {
+    for(auto& [chatId, sessionPtr] : _activeSessions) {
+        if(!sessionPtr->closing() && clock_now - sessionPtr->last_activity() > ActivityTimeout) {
             sessionPtr->force_close();
         }
+
+        // chats close to their cap are the ones to look at when the process grows
+        if(memoryLimit > 0 && sessionPtr->memory_used() > memoryLimit / 4 * 3) {
+            luabot_logWarn("Chat {} holds {} KiB of Lua memory out of {} KiB", chatId, sessionPtr->memory_used() / 1024, memoryLimit / 1024);
+        }
+    }
+}
+
+void tg::BotRuntime::report_admission()
+{
+    auto stats = _admission->stats();
+    auto lost = [&](const AdmissionStats& from) {
+        return from[AdmissionEvent::Rejected] + from[AdmissionEvent::DroppedOldest] + from[AdmissionEvent::Coalesced] + from[AdmissionEvent::Stale]
+            + from[AdmissionEvent::Overloaded] + from[AdmissionEvent::Unhandled];
+    };
+
+    // quiet as long as nothing is lost, a spike is reported once per verification interval
+    if(lost(stats) != lost(_reportedAdmission)) {
+        luabot_logWarn("Updates admitted: {}, rejected: {}, dropped: {}, coalesced: {}, stale: {}, overloaded: {}, unhandled: {}, in flight: {}",
+            stats[AdmissionEvent::Admitted] - _reportedAdmission[AdmissionEvent::Admitted],
+            stats[AdmissionEvent::Rejected] - _reportedAdmission[AdmissionEvent::Rejected],
+            stats[AdmissionEvent::DroppedOldest] - _reportedAdmission[AdmissionEvent::DroppedOldest],
+            stats[AdmissionEvent::Coalesced] - _reportedAdmission[AdmissionEvent::Coalesced],
+            stats[AdmissionEvent::Stale] - _reportedAdmission[AdmissionEvent::Stale],
+            stats[AdmissionEvent::Overloaded] - _reportedAdmission[AdmissionEvent::Overloaded],
+            stats[AdmissionEvent::Unhandled] - _reportedAdmission[AdmissionEvent::Unhandled],
+            stats.inFlight);
     }
+
+    _reportedAdmission = stats;
 }
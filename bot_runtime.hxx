@@ -1,37 +1,96 @@
 #pragma once
 
-#include <queue>
+#include <thread>
 
 #include <tgbot/tgbot.h>
 
+#include "lua_shared.hxx"
+#include "runtime_settings.hxx"
+#include "send_queue.hxx"
+#include "session_executor.hxx"
+#include "update_poller.hxx"
 #include "user_session.hxx"
+#include "webhook_listener.hxx"
 
 #include "globals.hxx"
 
 namespace tg {
 
+constexpr const char* DefaultApiUrl = "https://api.telegram.org";
+
 class BotRuntime
 {
 public:
-    static std::unique_ptr<BotRuntime> create(const std::string& apiKey, const std::string& commandsPath);
+    static std::unique_ptr<BotRuntime> create(const std::string& apiKey, const std::string& commandsPath, const std::string& apiUrl = DefaultApiUrl);
     static std::unique_ptr<BotRuntime> create_from_project(const std::string& zip, const std::string& external_api_key = {});
 
-    BotRuntime(const std::string& apiKey);
+    BotRuntime(const std::string& apiKey, const std::string& apiUrl = DefaultApiUrl);
+    ~BotRuntime();
+
+    void start();
+    void stop();
+    bool running() const;
 
     void poll_and_dispatch();
 
+    // swaps the scripts of a running bot. the new ones are checked by building a state first, a broken version is
+    // rejected as a whole. new chats get the new scripts right away, the others switch on their next update
+    ExpectedErr<> reload(BytecodeMap bytecode);
+
 private:
-    void init_new_session(std::uint64_t chatId);
+    void handle_update(const TgBot::Update::Ptr& update);
+    void dispatch(const TgBot::Update::Ptr& update);
+
+    bool start_webhook();
+
+    UserSessionThread& init_new_session(std::int64_t chatId);
+    UserSessionThread& session_for(std::int64_t chatId);
 
     void verify_sessions();
+    void report_admission();
+
+    // chats of one group share an interpreter and the strand that serializes access to it
+    struct SharedGroup
+    {
+        std::unique_ptr<Strand> strand;
+        std::unique_ptr<lua::SharedState> state;
+    };
+
+    SharedGroup& group_of(std::int64_t chatId);
+
+    std::shared_ptr<TgBot::Bot> _bot { nullptr };
+    std::unique_ptr<UpdatePoller> _poller { nullptr };
+
+    // replaces the poller while running in webhook mode
+    std::unique_ptr<WebhookListener> _webhook { nullptr };
 
-    std::unique_ptr<TgBot::Bot> _bot { nullptr };
-    std::unordered_map<std::uint64_t, std::unique_ptr<UserSession>> _activeSessions;
-    std::queue<std::uint64_t> _enqueuedClients;
+    // outlives the sessions and the executor, tasks enqueue messages until the very last one
+    std::unique_ptr<SendQueue> _sendQueue { nullptr };
+
+    RuntimeSettings _settings;
+
+    lua::SharedBytecode _bytecode { std::make_shared<const ScriptVersion>() };
+
+    // created on start, once the bytecode is in place. only one of them is used, depending on the settings
+    std::unique_ptr<lua::StatePool> _statePool { nullptr };
+    std::vector<SharedGroup> _sharedGroups;
+
+    // created on start with the project settings, sessions hold on to it
+    std::unique_ptr<AdmissionControl> _admission { nullptr };
+    AdmissionStats _reportedAdmission;
+
+    std::unique_ptr<SessionContext> _sessionContext { nullptr };
+
+    std::unordered_map<std::int64_t, std::unique_ptr<UserSessionThread>> _activeSessions;
 
     std::vector<uint64_t> _trustedUsers;
 
-    BytecodeMap _bytecode;
+    std::chrono::steady_clock::time_point _lastVerification { std::chrono::steady_clock::now() };
+
+    // declared after the sessions, bytecode and states so it is joined before anything its tasks touch is gone
+    std::unique_ptr<SessionExecutor> _executor { nullptr };
+
+    std::jthread _pollerThread;
 };
 
 }
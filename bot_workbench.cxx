@@ -1,6 +1,7 @@
 #include <string>
 
 #include "bot_runtime.hxx"
+#include "lua_bytecode_cache.hxx"
 #include "zip2memvfs.hxx"
 
 #include "bot_workbench.hxx"
@@ -76,8 +77,6 @@ namespace editor::workbench::internal {
 
 void bot_runtime_thread(const std::stop_token &token) {
     while(!token.stop_requested()) {
-        data::bot_runtime->poll_and_dispatch();
-
         data::Task task;
         {
             std::unique_lock lock(data::mutex);
@@ -142,6 +141,7 @@ void editor::workbench::init() {
 }
 
 void editor::workbench::shutdown() {
+    stop_bot();
 }
 
 void editor::workbench::open_project_file(const std::string& file)
@@ -198,7 +198,8 @@ void editor::workbench::refresh_scripts()
         const auto& file_info = file->GetFileInfo();
         std::string abs_path = file_info.AbsolutePath();
 
-        if(file_info.IsDir()) {
+        // compiled chunks are bookkeeping of the loader, not something to edit
+        if(file_info.IsDir() || abs_path.starts_with(lua::BytecodeCacheArchiveFolder)) {
             continue;
         }
 
@@ -250,10 +251,53 @@ void editor::workbench::save()
 
 void editor::workbench::start_bot()
 {
+    if(data::bot_runtime) {
+        return;
+    }
+
+    if(data::project_file.empty()) {
+        modals::inform("Unable to start bot", "To start a bot, create or open a project", false);
+        return;
+    }
+
+    data::bot_runtime = tg::BotRuntime::create_from_project(data::project_file.string(), data::api_key);
+
+    if(!data::bot_runtime) {
+        modals::inform("Unable to start bot", "Bot runtime creation failed, see log for details", false);
+        return;
+    }
+
+    data::bot_runtime->start();
 }
 
 void editor::workbench::stop_bot()
 {
+    if(!data::bot_runtime) {
+        return;
+    }
+
+    data::bot_runtime->stop();
+    data::bot_runtime.reset();
+}
+
+void editor::workbench::reload_bot()
+{
+    if(!data::bot_runtime || !data::project_files) {
+        return;
+    }
+
+    auto commands = lua::load_bytecode_map(data::project_files);
+
+    if(!commands) {
+        modals::inform("Unable to reload scripts", commands.error().message(), false);
+        return;
+    }
+
+    auto reloaded = data::bot_runtime->reload(commands.value());
+
+    if(!reloaded) {
+        modals::inform("Unable to reload scripts", reloaded.error().message(), false);
+    }
 }
 
 void editor::workbench::render()
@@ -362,6 +406,11 @@ void editor::workbench::render()
         if(ImGui::Button("Stop Bot")) {
             stop_bot();
         }
+
+        ImGui::SameLine();
+        if(ImGui::Button("Reload scripts")) {
+            reload_bot();
+        }
     }
 
     if(ImGui::GetIO().KeyCtrl && ImGui::IsKeyPressed(ImGuiKey_S)) {
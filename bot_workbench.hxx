@@ -13,6 +13,9 @@ void save();
 void start_bot();
 void stop_bot();
 
+// pushes the scripts of the opened project into the running bot without restarting it
+void reload_bot();
+
 void render();
 
 }
\ No newline at end of file
@@ -0,0 +1,116 @@
+#pragma once
+
+#include <cstddef>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+namespace tg {
+
+// move-only void() callable stored in place, so queueing a task never touches the heap
+class InlineTask
+{
+public:
+    static constexpr std::size_t Capacity = 64;
+
+    InlineTask() = default;
+
+    template<typename F>
+        requires (!std::is_same_v<std::decay_t<F>, InlineTask> && std::is_invocable_v<std::decay_t<F>&>)
+    InlineTask(F&& func);
+
+    InlineTask(InlineTask&& other) noexcept;
+    InlineTask& operator=(InlineTask&& other) noexcept;
+
+    InlineTask(const InlineTask&) = delete;
+    InlineTask& operator=(const InlineTask&) = delete;
+
+    ~InlineTask();
+
+    explicit operator bool() const noexcept;
+    void operator()();
+
+    void reset() noexcept;
+
+private:
+    struct Ops
+    {
+        void (*invoke)(void* storage);
+        void (*move)(void* from, void* to) noexcept;
+        void (*destroy)(void* storage) noexcept;
+    };
+
+    template<typename F>
+    static constexpr Ops ops_for = {
+        [](void* storage) { (*static_cast<F*>(storage))(); },
+        [](void* from, void* to) noexcept {
+            new (to) F(std::move(*static_cast<F*>(from)));
+            static_cast<F*>(from)->~F();
+        },
+        [](void* storage) noexcept { static_cast<F*>(storage)->~F(); }
+    };
+
+    alignas(std::max_align_t) unsigned char _storage[Capacity];
+    const Ops* _ops { nullptr };
+};
+
+template<typename F>
+    requires (!std::is_same_v<std::decay_t<F>, InlineTask> && std::is_invocable_v<std::decay_t<F>&>)
+InlineTask::InlineTask(F&& func)
+{
+    using Func = std::decay_t<F>;
+
+    static_assert(sizeof(Func) <= Capacity, "task captures too much to be stored inline, capture a pointer instead");
+    static_assert(alignof(Func) <= alignof(std::max_align_t), "task is over-aligned");
+    static_assert(std::is_nothrow_move_constructible_v<Func>, "task must be nothrow movable");
+
+    new (_storage) Func(std::forward<F>(func));
+    _ops = &ops_for<Func>;
+}
+
+inline InlineTask::InlineTask(InlineTask&& other) noexcept
+{
+    if(other._ops) {
+        other._ops->move(other._storage, _storage);
+        _ops = std::exchange(other._ops, nullptr);
+    }
+}
+
+inline InlineTask& InlineTask::operator=(InlineTask&& other) noexcept
+{
+    if(this != &other) {
+        reset();
+
+        if(other._ops) {
+            other._ops->move(other._storage, _storage);
+            _ops = std::exchange(other._ops, nullptr);
+        }
+    }
+
+    return *this;
+}
+
+inline InlineTask::~InlineTask()
+{
+    reset();
+}
+
+inline InlineTask::operator bool() const noexcept
+{
+    return _ops != nullptr;
+}
+
+inline void InlineTask::operator()()
+{
+    _ops->invoke(_storage);
+}
+
+inline void InlineTask::reset() noexcept
+{
+    if(_ops) {
+        _ops->destroy(_storage);
+        _ops = nullptr;
+    }
+}
+
+}
@@ -0,0 +1,176 @@
+#include "lua_allocator.hxx"
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+
+#include <sol/sol.hpp>
+
+#include "logdef.hxx"
+
+namespace lua::internal {
+
+void* system_allocate(void*, void* block, std::size_t, std::size_t newSize)
+{
+    if(newSize == 0) {
+        std::free(block);
+        return nullptr;
+    }
+
+    return std::realloc(block, newSize);
+}
+
+}
+
+lua::StateAllocator::StateAllocator(std::size_t limit) : _limit(limit) { }
+
+lua::StateAllocator::~StateAllocator() = default;
+
+void* lua::StateAllocator::allocate(void* self, void* block, std::size_t oldSize, std::size_t newSize)
+{
+    return static_cast<StateAllocator*>(self)->reallocate(block, oldSize, newSize);
+}
+
+std::size_t lua::StateAllocator::used() const
+{
+    return _used.load(std::memory_order_relaxed);
+}
+
+std::size_t lua::StateAllocator::limit() const
+{
+    return _limit;
+}
+
+std::size_t lua::StateAllocator::refused() const
+{
+    return _refused.load(std::memory_order_relaxed);
+}
+
+std::size_t lua::StateAllocator::class_of(std::size_t size)
+{
+    return (size + Granularity - 1) / Granularity - 1;
+}
+
+bool lua::StateAllocator::pooled(std::size_t size)
+{
+    return size > 0 && size <= MaxPooledSize;
+}
+
+void* lua::StateAllocator::reallocate(void* block, std::size_t oldSize, std::size_t newSize)
+{
+    // lua passes the exact size of every live block, so where a block came from follows from its size
+    if(!block) {
+        oldSize = 0;
+    }
+
+    auto used = _used.load(std::memory_order_relaxed);
+
+    if(newSize == 0) {
+        give_back(block, oldSize);
+        _used.store(used - oldSize, std::memory_order_relaxed);
+        return nullptr;
+    }
+
+    // shrinking must never fail, lua does not expect it to
+    if(_limit > 0 && newSize > oldSize && used - oldSize + newSize > _limit) {
+        _refused.fetch_add(1, std::memory_order_relaxed);
+        return nullptr;
+    }
+
+    if(block && pooled(oldSize) && pooled(newSize) && class_of(oldSize) == class_of(newSize)) {
+        _used.store(used - oldSize + newSize, std::memory_order_relaxed);
+        return block;
+    }
+
+    if(block && !pooled(oldSize) && !pooled(newSize)) {
+        auto moved = std::realloc(block, newSize);
+
+        if(moved) {
+            _used.store(used - oldSize + newSize, std::memory_order_relaxed);
+        }
+
+        return moved;
+    }
+
+    auto moved = take(newSize);
+
+    if(!moved) {
+        return nullptr;
+    }
+
+    if(block) {
+        std::memcpy(moved, block, std::min(oldSize, newSize));
+        give_back(block, oldSize);
+    }
+
+    _used.store(used - oldSize + newSize, std::memory_order_relaxed);
+    return moved;
+}
+
+void* lua::StateAllocator::take(std::size_t size)
+{
+    if(!pooled(size)) {
+        return std::malloc(size);
+    }
+
+    auto sizeClass = class_of(size);
+
+    if(auto block = _free[sizeClass]) {
+        _free[sizeClass] = block->next;
+        return block;
+    }
+
+    auto blockSize = (sizeClass + 1) * Granularity;
+
+    // the rest of the current chunk is too small, it is left unused
+    if(static_cast<std::size_t>(_end - _cursor) < blockSize) {
+        auto chunk = std::unique_ptr<std::byte[]>(new(std::nothrow) std::byte[ChunkSize]);
+
+        if(!chunk) {
+            return nullptr;
+        }
+
+        _cursor = chunk.get();
+        _end = _cursor + ChunkSize;
+        _chunks.push_back(std::move(chunk));
+    }
+
+    auto block = _cursor;
+    _cursor += blockSize;
+
+    return block;
+}
+
+void lua::StateAllocator::give_back(void* block, std::size_t size)
+{
+    if(!block) {
+        return;
+    }
+
+    if(!pooled(size)) {
+        std::free(block);
+        return;
+    }
+
+    auto sizeClass = class_of(size);
+
+    _free[sizeClass] = new(block) FreeBlock { _free[sizeClass] };
+}
+
+bool lua::custom_allocators_supported()
+{
+    static const bool supported = [] {
+        auto probe = lua_newstate(&internal::system_allocate, nullptr);
+
+        if(!probe) {
+            luabot_logWarn("The Lua runtime does not accept custom allocators, Lua memory of the states is not counted");
+            return false;
+        }
+
+        lua_close(probe);
+        return true;
+    }();
+
+    return supported;
+}
@@ -0,0 +1,74 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <memory>
+#include <vector>
+
+#include "fsizes.hxx"
+
+namespace lua {
+
+constexpr std::size_t DefaultMemoryLimit = sizes::megabytes<std::size_t>(64);
+
+// lua_Alloc of a single state. small blocks come from per size class free lists carved out of larger chunks,
+// bigger ones go to malloc. growing past the limit fails the allocation, which the script sees as "not enough memory".
+// one state runs on one thread at a time, only the counters may be read from elsewhere
+class StateAllocator
+{
+public:
+    // zero limit means no cap, the allocator still pools and counts
+    explicit StateAllocator(std::size_t limit);
+    ~StateAllocator();
+
+    StateAllocator(const StateAllocator&) = delete;
+    StateAllocator& operator=(const StateAllocator&) = delete;
+
+    // the lua_Alloc entry point, `self` is the allocator
+    static void* allocate(void* self, void* block, std::size_t oldSize, std::size_t newSize);
+
+    // bytes the state holds right now
+    std::size_t used() const;
+    std::size_t limit() const;
+
+    // allocations refused because of the limit
+    std::size_t refused() const;
+
+private:
+    static constexpr std::size_t Granularity = 16;
+    static constexpr std::size_t MaxPooledSize = 512;
+    static constexpr std::size_t ClassCount = MaxPooledSize / Granularity;
+    static constexpr std::size_t ChunkSize = sizes::kilobytes<std::size_t>(64);
+
+    struct FreeBlock
+    {
+        FreeBlock* next;
+    };
+
+    static std::size_t class_of(std::size_t size);
+    static bool pooled(std::size_t size);
+
+    void* reallocate(void* block, std::size_t oldSize, std::size_t newSize);
+
+    void* take(std::size_t size);
+    void give_back(void* block, std::size_t size);
+
+    std::size_t _limit;
+
+    std::atomic<std::size_t> _used { 0 };
+    std::atomic<std::size_t> _refused { 0 };
+
+    std::array<FreeBlock*, ClassCount> _free {};
+
+    // never given back before the state is gone, freed blocks are reused through the free lists
+    std::vector<std::unique_ptr<std::byte[]>> _chunks;
+    std::byte* _cursor { nullptr };
+    std::byte* _end { nullptr };
+};
+
+// LuaJIT on x64 refuses custom allocators unless it was built with GC64, states use the default one then.
+// BotRuntime refuses to start with a memory limit in that case
+bool custom_allocators_supported();
+
+}
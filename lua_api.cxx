@@ -1 +1,10 @@
-#include "lua_api.hxx"
\ No newline at end of file
+#include "lua_api.hxx"
+
+#include "lua_api_functions.hxx"
+#include "lua_api_types.hxx"
+
+void lua::api::register_api(sol::state_view state)
+{
+    types::register_types(state);
+    functions::register_functions(state);
+}
@@ -1,11 +1,43 @@
 #include "lua_api_functions.hxx"
 
+#include <algorithm>
+
 lua::api::types::routines::Coroutine lua::api::functions::make_coroutine(const sol::function& func, types::routines::CoroutinePolicy policy)
 {
-    return { sol::coroutine(func.lua_state(), func), policy };
+    // a coroutine can not run on the stack that creates it, it gets a thread of its own
+    return make_coroutine_on(sol::thread::create(func.lua_state()), func, policy);
+}
+
+lua::api::types::routines::Coroutine lua::api::functions::make_coroutine_on(sol::thread thread, const sol::function& func, types::routines::CoroutinePolicy policy)
+{
+    sol::coroutine coroutine(thread.state(), func);
+
+    return { std::move(thread), std::move(coroutine), policy };
+}
+
+lua::api::types::routines::SleepRequest lua::api::functions::sleep(std::int64_t milliseconds)
+{
+    return { std::chrono::milliseconds { std::max<std::int64_t>(milliseconds, 0) } };
+}
+
+lua::api::types::routines::InputRequest lua::api::functions::wait_message(sol::optional<std::int64_t> timeout)
+{
+    return { types::routines::InputKind::Message, std::chrono::milliseconds { std::max<std::int64_t>(timeout.value_or(0), 0) } };
+}
+
+lua::api::types::routines::InputRequest lua::api::functions::wait_callback(sol::optional<std::int64_t> timeout)
+{
+    return { types::routines::InputKind::Callback, std::chrono::milliseconds { std::max<std::int64_t>(timeout.value_or(0), 0) } };
 }
 
 void lua::api::functions::register_functions(sol::state_view state)
 {
     state.set_function("MakeCoroutine", &make_coroutine);
+
+    // yields the request itself, only usable inside a coroutine
+    state.set_function("Sleep", sol::yielding(&sleep));
+
+    // conversation steps: `local answer = WaitMessage(30000)` gets the next text of the chat, or nil after 30 seconds
+    state.set_function("WaitMessage", sol::yielding(&wait_message));
+    state.set_function("WaitCallback", sol::yielding(&wait_callback));
 }
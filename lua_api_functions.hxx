@@ -8,6 +8,14 @@ namespace lua::api::functions {
 
 types::routines::Coroutine make_coroutine(const sol::function& func, types::routines::CoroutinePolicy policy);
 
+// same, on an idle thread of the same state instead of a new one
+types::routines::Coroutine make_coroutine_on(sol::thread thread, const sol::function& func, types::routines::CoroutinePolicy policy);
+
+types::routines::SleepRequest sleep(std::int64_t milliseconds);
+
+types::routines::InputRequest wait_message(sol::optional<std::int64_t> timeout);
+types::routines::InputRequest wait_callback(sol::optional<std::int64_t> timeout);
+
 void register_functions(sol::state_view state);
 
 }
@@ -7,7 +7,22 @@ void lua::api::types::register_types(sol::state_view state)
     state.new_usertype<ui::ReplyKeyboardButton>("ReplyKeyboardButton");
     state.new_usertype<ui::ReplyKeyboard>("ReplyKeyboard");
 
+    state.new_usertype<routines::Coroutine>("Coroutine", sol::no_constructor);
+    state.new_usertype<routines::SleepRequest>("SleepRequest", sol::no_constructor);
+    state.new_usertype<routines::InputRequest>("InputRequest", sol::no_constructor);
+
     state.new_enum("CoroutineStep",
         "Step", routines::CoroutineStep::Step,
-        "Done", routines::CoroutineStep::Done);
+        "Done", routines::CoroutineStep::Done,
+        "Wait", routines::CoroutineStep::Wait);
+
+    state.new_enum("CoroutinePolicy",
+        "EnqueueNext", routines::CoroutinePolicy::EnqueueNext,
+        "RejectNext", routines::CoroutinePolicy::RejectNext,
+        "SyncExecute", routines::CoroutinePolicy::SyncExecute);
+
+    state.new_enum("SendPriority",
+        "Interactive", messages::SendPriority::Interactive,
+        "Normal", messages::SendPriority::Normal,
+        "Bulk", messages::SendPriority::Bulk);
 }
@@ -1,5 +1,7 @@
 #pragma once
 
+#include <chrono>
+#include <memory>
 #include <string>
 #include <vector>
 
@@ -38,8 +40,11 @@ namespace lua::api::types::routines {
 
 enum class CoroutineStep
 {
+    // resume me again after the other work queued for this chat
     Step,
-    Done
+    Done,
+    // park me until the chat receives new input
+    Wait
 };
 
 enum class CoroutinePolicy
@@ -49,11 +54,37 @@ enum class CoroutinePolicy
     SyncExecute
 };
 
+// yielded by Sleep, parks the coroutine on the session timers
+struct SleepRequest
+{
+    std::chrono::milliseconds delay;
+};
+
+enum class InputKind
+{
+    Message,
+    Callback
+};
+
+// yielded by WaitMessage / WaitCallback, the coroutine is resumed with the input or with nil on timeout
+struct InputRequest
+{
+    InputKind kind;
+
+    // zero waits forever
+    std::chrono::milliseconds timeout;
+};
+
 struct Coroutine
 {
+    // the coroutine stack, kept alive as long as the coroutine is
+    sol::thread thread;
     sol::coroutine coroutine;
     CoroutinePolicy policy;
 
+    // shared by every copy a script holds: a coroutine runs once, afterwards its thread may be running another one
+    std::shared_ptr<bool> started { std::make_shared<bool>(false) };
+
     template<typename ...Args>
     sol::protected_function_result operator()(Args&&... args);
 };
@@ -66,6 +97,18 @@ sol::protected_function_result Coroutine::operator()(Args&&... args)
 
 }
 
+namespace lua::api::types::messages {
+
+// optional second argument of SendMessage, the send queue serves the classes in this order
+enum class SendPriority
+{
+    Interactive,
+    Normal,
+    Bulk
+};
+
+}
+
 namespace lua::api::types {
 
 void register_types(sol::state_view state);
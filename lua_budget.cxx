@@ -0,0 +1,67 @@
+#include "lua_budget.hxx"
+
+#include "lua_runtime.hxx"
+
+namespace lua::internal {
+
+thread_local BudgetScope* current_budget = nullptr;
+
+}
+
+namespace lua {
+
+void budget_hook(lua_State* L, lua_Debug*)
+{
+    auto scope = internal::current_budget;
+
+    if(!scope || !scope->_settings.enabled()) {
+        return;
+    }
+
+    scope->_used += HookInterval;
+
+    auto total = scope->_inherited + scope->_used;
+
+    if(total >= scope->_settings.hardCap) {
+        luaL_error(L, "instruction budget exceeded (%llu instructions)", static_cast<unsigned long long>(total));
+        return;
+    }
+
+    // only the coroutine being resumed is preempted, a nested one yielding would just confuse the script
+    if(L == scope->_yieldable && scope->_used >= scope->_settings.slice) {
+        scope->_preempted = true;
+        lua_yield(L, 0);
+    }
+}
+
+}
+
+void lua::install_budget_hook(sol::state_view state)
+{
+    runtime::set_jit(state, false);
+    lua_sethook(state.lua_state(), &budget_hook, LUA_MASKCOUNT, HookInterval);
+}
+
+lua::BudgetScope::BudgetScope(const BudgetSettings& settings, lua_State* yieldable)
+    : _settings(settings), _yieldable(yieldable), _previous(internal::current_budget)
+{
+    if(_previous) {
+        _inherited = _previous->_inherited + _previous->_used;
+    }
+
+    internal::current_budget = this;
+}
+
+lua::BudgetScope::~BudgetScope()
+{
+    if(_previous) {
+        _previous->_used += _used;
+    }
+
+    internal::current_budget = _previous;
+}
+
+bool lua::BudgetScope::preempted() const
+{
+    return _preempted;
+}
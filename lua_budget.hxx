@@ -0,0 +1,61 @@
+#pragma once
+
+#include <cstdint>
+
+#include <sol/sol.hpp>
+
+namespace lua {
+
+// the hook fires every HookInterval VM instructions, budgets are counted in these steps
+constexpr std::uint32_t HookInterval = 1000;
+
+struct BudgetSettings
+{
+    // instructions a coroutine runs before it is yielded back to the scheduler, zero turns budgets off.
+    // off unless the project asks for it: the hook costs LuaJIT its compiler
+    std::uint64_t slice { 0 };
+
+    // instructions after which a single call is aborted, whether it could yield or not
+    std::uint64_t hardCap { 200'000'000 };
+
+    bool enabled() const
+    {
+        return slice > 0;
+    }
+};
+
+// counts instructions of every call into the state. count hooks only fire in the interpreter,
+// so with LuaJIT the compiler is switched off for budgeted states
+void install_budget_hook(sol::state_view state);
+
+// accounts the Lua code run on this OS thread while alive. `yieldable` is the coroutine thread that may be
+// preempted when its slice is used up, nullptr for plain calls which can only hit the hard cap.
+// a nested scope starts its slice over but not the hard cap, and hands what it used back to the enclosing one
+class BudgetScope
+{
+public:
+    BudgetScope(const BudgetSettings& settings, lua_State* yieldable);
+    ~BudgetScope();
+
+    BudgetScope(const BudgetScope&) = delete;
+    BudgetScope& operator=(const BudgetScope&) = delete;
+
+    // the coroutine was yielded by the hook, not by itself
+    bool preempted() const;
+
+private:
+    friend void budget_hook(lua_State* L, lua_Debug* debug);
+
+    const BudgetSettings& _settings;
+    lua_State* _yieldable;
+
+    std::uint64_t _used { 0 };
+
+    // used by the enclosing scopes when this one was opened, counts against the hard cap
+    std::uint64_t _inherited { 0 };
+    bool _preempted { false };
+
+    BudgetScope* _previous;
+};
+
+}
@@ -0,0 +1,223 @@
+#include "lua_bytecode_cache.hxx"
+
+#include <charconv>
+#include <cstring>
+#include <format>
+#include <fstream>
+#include <vector>
+
+#include "lua_runtime.hxx"
+
+#include "logdef.hxx"
+
+namespace fs = std::filesystem;
+
+namespace lua::internal {
+
+constexpr std::uint64_t FnvOffset = 14695981039346656037ull;
+constexpr std::uint64_t FnvPrime = 1099511628211ull;
+
+constexpr std::string_view EntryExtension = ".luac";
+
+std::uint64_t fnv1a(std::string_view bytes, std::uint64_t hash = FnvOffset)
+{
+    for(auto byte : bytes) {
+        hash ^= static_cast<std::uint8_t>(byte);
+        hash *= FnvPrime;
+    }
+
+    return hash;
+}
+
+std::uint64_t fnv1a(std::uint64_t value, std::uint64_t hash)
+{
+    char bytes[sizeof(value)];
+    std::memcpy(bytes, &value, sizeof(value));
+
+    return fnv1a(std::string_view(bytes, sizeof(bytes)), hash);
+}
+
+// an entry is the chunk followed by its checksum, so a write cut short reads as a miss instead of a broken command
+std::uint64_t checksum(std::uint64_t key, std::string_view bytecode)
+{
+    return fnv1a(bytecode, fnv1a(key, FnvOffset));
+}
+
+}
+
+std::uint64_t lua::bytecode_key(std::string_view chunkName, std::string_view text)
+{
+    // separators keep ("ab", "c") and ("a", "bc") apart
+    auto hash = internal::fnv1a(BytecodeCacheFormat, internal::FnvOffset);
+    hash = internal::fnv1a(runtime::name(), hash);
+    hash = internal::fnv1a(std::string_view("\0", 1), hash);
+    hash = internal::fnv1a(chunkName, hash);
+    hash = internal::fnv1a(std::string_view("\0", 1), hash);
+
+    return internal::fnv1a(text, hash);
+}
+
+std::optional<std::string> lua::BytecodeCache::find(std::uint64_t key) const
+{
+    auto entry = read(entry_name(key));
+
+    if(!entry || entry->size() <= sizeof(std::uint64_t)) {
+        return std::nullopt;
+    }
+
+    auto size = entry->size() - sizeof(std::uint64_t);
+    std::uint64_t stored = 0;
+    std::memcpy(&stored, entry->data() + size, sizeof(stored));
+
+    entry->resize(size);
+
+    if(stored != internal::checksum(key, entry.value())) {
+        return std::nullopt;
+    }
+
+    return entry;
+}
+
+void lua::BytecodeCache::store(std::uint64_t key, const std::string& bytecode)
+{
+    auto sum = internal::checksum(key, bytecode);
+
+    std::string entry = bytecode;
+    entry.append(reinterpret_cast<const char*>(&sum), sizeof(sum));
+
+    if(!write(entry_name(key), entry)) {
+        luabot_logWarn("Unable to store compiled chunk {:016x} in the bytecode cache", key);
+        return;
+    }
+
+    _changed = true;
+}
+
+bool lua::BytecodeCache::changed() const
+{
+    return _changed;
+}
+
+std::string lua::BytecodeCache::entry_name(std::uint64_t key)
+{
+    return std::format("{:016x}{}", key, internal::EntryExtension);
+}
+
+std::optional<std::uint64_t> lua::BytecodeCache::key_of(std::string_view entryName)
+{
+    if(!entryName.ends_with(internal::EntryExtension)) {
+        return std::nullopt;
+    }
+
+    entryName.remove_suffix(internal::EntryExtension.size());
+
+    std::uint64_t key = 0;
+    auto [end, error] = std::from_chars(entryName.data(), entryName.data() + entryName.size(), key, 16);
+
+    if(error != std::errc() || end != entryName.data() + entryName.size()) {
+        return std::nullopt;
+    }
+
+    return key;
+}
+
+lua::FolderBytecodeCache::FolderBytecodeCache(fs::path folder) : _folder(std::move(folder)) { }
+
+void lua::FolderBytecodeCache::retain(const std::unordered_set<std::uint64_t>& live)
+{
+    std::error_code error;
+
+    if(!fs::is_directory(_folder, error)) {
+        return;
+    }
+
+    for(const auto& entry : fs::directory_iterator(_folder, error)) {
+        auto key = key_of(entry.path().filename().string());
+
+        if(key && !live.contains(key.value())) {
+            _changed = fs::remove(entry.path(), error) || _changed;
+        }
+    }
+}
+
+std::optional<std::string> lua::FolderBytecodeCache::read(const std::string& entryName) const
+{
+    std::ifstream file(_folder / entryName, std::ios::binary);
+
+    if(!file.is_open()) {
+        return std::nullopt;
+    }
+
+    return std::string(std::istreambuf_iterator<char>(file), {});
+}
+
+bool lua::FolderBytecodeCache::write(const std::string& entryName, const std::string& data)
+{
+    std::error_code error;
+    fs::create_directories(_folder, error);
+
+    std::ofstream file(_folder / entryName, std::ios::binary | std::ios::trunc);
+
+    if(!file.is_open()) {
+        return false;
+    }
+
+    file.write(data.data(), static_cast<std::streamsize>(data.size()));
+
+    return file.good();
+}
+
+lua::ArchiveBytecodeCache::ArchiveBytecodeCache(files::IFileSystem archive) : _archive(std::move(archive)) { }
+
+void lua::ArchiveBytecodeCache::retain(const std::unordered_set<std::uint64_t>& live)
+{
+    if(_archive->IsReadOnly()) {
+        return;
+    }
+
+    std::vector<std::string> stale;
+
+    for(const auto& [path, file] : _archive->FileList()) {
+        if(!path.starts_with(BytecodeCacheArchiveFolder)) {
+            continue;
+        }
+
+        auto key = key_of(file->GetFileInfo().Name());
+
+        if(key && !live.contains(key.value())) {
+            stale.push_back(path);
+        }
+    }
+
+    for(const auto& path : stale) {
+        _changed = _archive->RemoveFile(vfspp::FileInfo(path)) || _changed;
+    }
+}
+
+std::optional<std::string> lua::ArchiveBytecodeCache::read(const std::string& entryName) const
+{
+    auto path = BytecodeCacheArchiveFolder + entryName;
+
+    if(!_archive->IsFileExists(vfspp::FileInfo(path))) {
+        return std::nullopt;
+    }
+
+    auto text = files::read_text(_archive, path);
+
+    if(!text) {
+        return std::nullopt;
+    }
+
+    return std::move(text.value());
+}
+
+bool lua::ArchiveBytecodeCache::write(const std::string& entryName, const std::string& data)
+{
+    if(_archive->IsReadOnly()) {
+        return false;
+    }
+
+    files::ByteArray bytes(data.begin(), data.end());
+
+    return files::write_bytes(_archive, BytecodeCacheArchiveFolder + entryName, bytes) == errors::OK;
+}
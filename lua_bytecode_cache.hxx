@@ -0,0 +1,81 @@
+#pragma once
+
+#include <cstdint>
+#include <filesystem>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <unordered_set>
+
+#include "zip2memvfs.hxx"
+
+namespace lua {
+
+// next to a scripts folder, and inside a project archive so it travels with the saved project
+constexpr const char* BytecodeCacheFolder = ".bytecode";
+constexpr const char* BytecodeCacheArchiveFolder = "/cache/bytecode/";
+
+// bumped whenever the entry layout changes, older entries stop matching
+constexpr std::uint64_t BytecodeCacheFormat = 1;
+
+// FNV-1a over the runtime name, the chunk name and the source. bytecode of one runtime is useless to the other,
+// and the chunk name is baked into debug info: it is relative to the project, so a moved project keeps its cache
+std::uint64_t bytecode_key(std::string_view chunkName, std::string_view text);
+
+// compiled chunks by content key. a broken or foreign entry reads as a miss, a failed write only costs a recompile
+class BytecodeCache
+{
+public:
+    virtual ~BytecodeCache() = default;
+
+    std::optional<std::string> find(std::uint64_t key) const;
+    void store(std::uint64_t key, const std::string& bytecode);
+
+    // drops every entry not in `live`, otherwise each edit would leave its old chunk behind
+    virtual void retain(const std::unordered_set<std::uint64_t>& live) = 0;
+
+    // an entry was stored or dropped since the cache was opened
+    bool changed() const;
+
+protected:
+    static std::string entry_name(std::uint64_t key);
+    static std::optional<std::uint64_t> key_of(std::string_view entryName);
+
+    virtual std::optional<std::string> read(const std::string& entryName) const = 0;
+    virtual bool write(const std::string& entryName, const std::string& data) = 0;
+
+    bool _changed { false };
+};
+
+class FolderBytecodeCache : public BytecodeCache
+{
+public:
+    explicit FolderBytecodeCache(std::filesystem::path folder);
+
+    void retain(const std::unordered_set<std::uint64_t>& live) override;
+
+protected:
+    std::optional<std::string> read(const std::string& entryName) const override;
+    bool write(const std::string& entryName, const std::string& data) override;
+
+private:
+    std::filesystem::path _folder;
+};
+
+// lives in the opened archive only, whoever opened it saves the archive to keep what was stored
+class ArchiveBytecodeCache : public BytecodeCache
+{
+public:
+    explicit ArchiveBytecodeCache(files::IFileSystem archive);
+
+    void retain(const std::unordered_set<std::uint64_t>& live) override;
+
+protected:
+    std::optional<std::string> read(const std::string& entryName) const override;
+    bool write(const std::string& entryName, const std::string& data) override;
+
+private:
+    files::IFileSystem _archive;
+};
+
+}
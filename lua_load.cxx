@@ -1,14 +1,578 @@
 #include "lua_load.hxx"
 
+#include <algorithm>
+#include <fstream>
+#include <optional>
+#include <ranges>
+#include <unordered_set>
+#include <vector>
+
+#include "lua_api.hxx"
+#include "lua_bytecode_cache.hxx"
+#include "lua_persist.hxx"
+#include "lua_runtime.hxx"
+
 #include "logdef.hxx"
+#include "workers.hxx"
 
 namespace fs = std::filesystem;
 
-lua::CommandBox::CommandBox(sol::state&& state, std::string prefix) : _state(std::move(state)), _prefix(std::move(prefix)) { }
+namespace lua::internal {
+
+struct ScriptSource
+{
+    std::string name;
+    std::string text;
+    // shows up in error messages and tracebacks
+    std::string chunkName;
+};
+
+// libraries, api and runtime settings every command state starts with
+sol::state prepare_state(StateAllocator* allocator, const StateOptions& options)
+{
+    sol::state state = allocator ? sol::state(sol::default_at_panic, &StateAllocator::allocate, allocator) : sol::state();
+
+    state.open_libraries(sol::lib::base);
+    api::register_api(state);
+
+    configure_gc(state, options.gc);
+    runtime::set_jit(state, options.jit);
+
+    if(options.budget.enabled()) {
+        install_budget_hook(state);
+    }
+
+    return state;
+}
+
+// "text/format.lua" -> "text.format"
+std::string module_name(std::string_view relative)
+{
+    std::string name(relative.substr(0, relative.size() - std::string_view(".lua").size()));
+    std::ranges::replace(name, '/', '.');
+
+    return name;
+}
+
+// module name of a file under /scripts/lib/ of a project archive, empty for anything else
+std::string module_in_archive(std::string_view path)
+{
+    std::string_view prefix = ModuleArchiveFolder;
+
+    if(!path.starts_with(prefix)) {
+        return {};
+    }
+
+    return module_name(path.substr(prefix.size()));
+}
+
+// registry entry of the modules a state has required
+constexpr const char* LoadedModules = "luabot.modules";
+
+// values a module leads to are permanents named after the module, `|` keeps dotted module names apart from the path
+std::string permanent_of_module(std::string_view module)
+{
+    return std::format("require:{}|", module);
+}
+
+std::string module_of_permanent(std::string_view path)
+{
+    constexpr std::string_view Prefix = "require:";
+
+    auto end = path.find('|');
+
+    if(!path.starts_with(Prefix) || end == std::string_view::npos) {
+        return {};
+    }
+
+    return std::string(path.substr(Prefix.size(), end - Prefix.size()));
+}
+
+// builds commands from their chunks in `pending`, a chunk is dropped once used
+CommandBuilder chunk_builder(sol::table pending)
+{
+    return [pending](sol::state_view caller, const std::string& name) -> Expected<sol::object> {
+        sol::optional<std::string> bytecode = pending[name];
+
+        if(!bytecode) {
+            return sol::make_object(caller, sol::lua_nil);
+        }
+
+        // built or not, the chunk is not needed anymore
+        pending[name] = sol::lua_nil;
+
+        sol::load_result initializer_load_result = caller.load(bytecode.value());
+        if(!initializer_load_result.valid()) {
+            sol::error err = initializer_load_result;
+            return errors::Error("Unable to load bytecode from command [" + name + "]: " + err.what());
+        }
+
+        auto instance = instantiate_command(initializer_load_result.get<sol::protected_function>(), name);
+        if(!instance) {
+            return instance.error();
+        }
+
+        return sol::object(instance.value());
+    };
+}
+
+// isolated states keep the chunks of unbuilt commands as strings, undumping is part of what laziness saves
+sol::table make_commands(sol::state_view state, const SharedBytecode& scripts, const BudgetSettings& budget, std::vector<std::string>& names)
+{
+    sol::table pending = state.create_table();
+    install_require(state, scripts, budget);
+
+    names.clear();
+
+    for(const auto& [name, bytecode] : scripts->bytecode) {
+        if(is_module_key(name)) {
+            continue;
+        }
+
+        pending[name] = bytecode;
+        names.push_back(name);
+    }
 
-sol::global_table& lua::CommandBox::commands()
+    auto commands = make_lazy_commands(state, chunk_builder(pending), budget);
+
+    for(const auto& name : scripts->eager) {
+        commands.get<sol::object>(name);
+    }
+
+    return commands;
+}
+
+// sets the table as `prefix` itself: it is one of the permanents, instances holding it get the one of their state
+sol::table image_commands(sol::state_view state, const SharedImage& image, const std::string& prefix, const BudgetSettings& budget, std::vector<std::string>& names)
 {
-    return _state[_prefix].tbl;
+    sol::table permanents = state.create_table();
+
+    install_require(state, image->bytecode, budget);
+
+    // the hook holds the table from the registry and the table leads back to the commands, weak values let
+    // a table replaced by a reset be collected
+    sol::table meta = state.create_table_with("__mode", "v");
+
+    // modules the instances refer to are required on first mention, see capture_image
+    meta.set_function("__index", [](sol::table self, const std::string& path, sol::this_state caller) -> sol::object {
+        auto module = module_of_permanent(path);
+
+        if(module.empty()) {
+            return sol::make_object(caller, sol::lua_nil);
+        }
+
+        sol::protected_function require = sol::state_view(caller).globals()["require"];
+        sol::protected_function_result value = require(module);
+
+        if(!value.valid()) {
+            sol::error err = value;
+            luabot_logErr("Unable to require module {} for a heap image: {}", module, err.what());
+            return sol::make_object(caller, sol::lua_nil);
+        }
+
+        persist::add_permanent_values(self, value.get<sol::object>(), permanent_of_module(module));
+        return self.raw_get<sol::object>(path);
+    });
+
+    permanents[sol::metatable_key] = meta;
+
+    names.clear();
+
+    for(const auto& name : image->instances | std::views::keys) {
+        names.push_back(name);
+    }
+
+    auto commands = make_lazy_commands(state, [image, permanents](sol::state_view caller, const std::string& name) -> Expected<sol::object> {
+        auto instance = image->instances.find(name);
+
+        if(instance == image->instances.end()) {
+            return sol::make_object(caller, sol::lua_nil);
+        }
+
+        auto restored = persist::restore_instance(caller, instance->second, permanents);
+        if(!restored) {
+            return restored.error();
+        }
+
+        return sol::object(restored.value());
+    }, budget);
+
+    state[prefix] = commands;
+    persist::permanent_values(state, permanents);
+
+    for(const auto& name : image->bytecode->eager) {
+        commands.get<sol::object>(name);
+    }
+
+    return commands;
+}
+
+bool same_value(const sol::object& left, const sol::object& right)
+{
+    auto L = left.lua_state();
+
+    left.push();
+    right.push();
+
+    bool same = lua_rawequal(L, -1, -2);
+    lua_pop(L, 2);
+
+    return same;
+}
+
+Expected<BytecodeMap> compile_scripts(const std::vector<ScriptSource>& sources, BytecodeCache& cache)
+{
+    std::vector<std::optional<std::string>> bytecode(sources.size());
+    std::vector<std::optional<std::string>> failures(sources.size());
+
+    std::vector<std::uint64_t> keys;
+    std::vector<std::size_t> changed;
+
+    keys.reserve(sources.size());
+
+    for(std::size_t index = 0; index < sources.size(); index++) {
+        keys.push_back(bytecode_key(sources[index].chunkName, sources[index].text));
+        bytecode[index] = cache.find(keys.back());
+
+        if(!bytecode[index]) {
+            changed.push_back(index);
+        }
+    }
+
+    // a state per thread, created by the first script the thread takes
+    std::vector<std::optional<sol::state>> states(workers::parallelism());
+
+    workers::parallel_for(changed.size(), [&](std::size_t position, std::size_t worker) {
+        auto index = changed[position];
+        const auto& source = sources[index];
+        auto& state = states[worker];
+
+        if(!state) {
+            state.emplace();
+            state->open_libraries(sol::lib::base);
+        }
+
+        sol::load_result lua = state->load(source.text, source.chunkName);
+        if(!lua.valid()) {
+            sol::error err = lua;
+            failures[index] = err.what();
+            return;
+        }
+
+        auto dumped = runtime::dump(lua.get<sol::function>());
+        if(!dumped) {
+            failures[index] = dumped.error().message();
+            return;
+        }
+
+        bytecode[index] = std::move(dumped.value());
+    });
+
+    // sources come sorted, the first broken one is reported whichever thread got to it first
+    for(const auto& failure : failures) {
+        if(failure) {
+            return errors::Error(failure.value());
+        }
+    }
+
+    for(auto index : changed) {
+        cache.store(keys[index], bytecode[index].value());
+    }
+
+    cache.retain({ keys.begin(), keys.end() });
+
+    if(!changed.empty()) {
+        luabot_logInfo("Compiled {} of {} scripts, the rest came from the bytecode cache", changed.size(), sources.size());
+    }
+
+    BytecodeMap result;
+
+    for(std::size_t index = 0; index < sources.size(); index++) {
+        result.insert_or_assign(sources[index].name, std::move(bytecode[index].value()));
+    }
+
+    return result;
+}
+
+}
+
+Expected<sol::table, errors::Error> lua::instantiate_command(const sol::protected_function& initializer, const std::string& name)
+{
+    sol::protected_function_result initializer_result = initializer();
+    if(!initializer_result.valid()) {
+        sol::error err = initializer_result;
+        return errors::Error("Unable to call initializer for command [" + name + "]: " + err.what());
+    }
+
+    sol::object instance = initializer_result.get<sol::object>();
+
+    // command scripts return a factory function building the instance, see the command template
+    if(instance.get_type() == sol::type::function) {
+        auto factory = instance.as<sol::protected_function>();
+        sol::protected_function_result factory_result = factory();
+        if(!factory_result.valid()) {
+            sol::error err = factory_result;
+            return errors::Error("Unable to instantiate command [" + name + "]: " + err.what());
+        }
+
+        instance = factory_result.get<sol::object>();
+    }
+
+    if(instance.get_type() != sol::type::table) {
+        return errors::Error("Command [" + name + "] did not produce a table");
+    }
+
+    return instance.as<sol::table>();
+}
+
+sol::table lua::make_lazy_commands(sol::state_view state, CommandBuilder build, const BudgetSettings& budget)
+{
+    sol::table commands = state.create_table();
+    sol::table meta = state.create_table();
+
+    meta.set_function("__index", [build = std::move(build), budget](sol::table self, sol::object key, sol::this_state caller) -> sol::object {
+        if(key.get_type() != sol::type::string) {
+            return sol::make_object(caller, sol::lua_nil);
+        }
+
+        auto name = key.as<std::string>();
+
+        // initializers can not be preempted, the lookup that started them is not a yield point
+        BudgetScope scope(budget, nullptr);
+        auto instance = build(caller, name);
+
+        if(!instance) {
+            luabot_logErr("Unable to build command {}: {}", name, instance.error().message());
+            return sol::make_object(caller, sol::lua_nil);
+        }
+
+        // a raw entry, the hook does not fire for this command again
+        self.raw_set(name, instance.value());
+        return instance.value();
+    });
+
+    commands[sol::metatable_key] = meta;
+
+    return commands;
+}
+
+bool lua::is_module_key(std::string_view key)
+{
+    return key.starts_with(ModuleKeyPrefix);
+}
+
+std::string lua::module_key(std::string_view module)
+{
+    return std::string(ModuleKeyPrefix).append(module);
+}
+
+void lua::install_require(sol::state_view state, const SharedBytecode& bytecode, const BudgetSettings& budget)
+{
+    // looked up on every call instead of captured: modules keep the function around, a captured table would never be freed
+    state.registry()[internal::LoadedModules] = state.create_table();
+
+    // modules in the middle of loading, requiring one of them again is a cycle
+    auto loading = std::make_shared<std::unordered_set<std::string>>();
+
+    state.set_function("require", [bytecode, budget, loading](const std::string& module, sol::this_state caller) -> sol::object {
+        sol::state_view lua(caller);
+        sol::table loaded = lua.registry()[internal::LoadedModules];
+        sol::object cached = loaded.raw_get<sol::object>(module);
+
+        if(cached.get_type() != sol::type::lua_nil) {
+            return cached;
+        }
+
+        if(loading->contains(module)) {
+            throw sol::error(std::format("module '{}' requires itself", module));
+        }
+
+        auto chunk = bytecode->bytecode.find(module_key(module));
+
+        if(chunk == bytecode->bytecode.end()) {
+            throw sol::error(std::format("module '{}' not found in {}/", module, ModuleFolder));
+        }
+
+        sol::load_result loaded_chunk = lua.load(chunk->second);
+
+        if(!loaded_chunk.valid()) {
+            sol::error err = loaded_chunk;
+            throw sol::error(std::format("module '{}' can not be loaded: {}", module, err.what()));
+        }
+
+        // a module runs to its end, it can not be preempted from inside require
+        BudgetScope scope(budget, nullptr);
+
+        loading->insert(module);
+        sol::protected_function_result result = loaded_chunk.get<sol::protected_function>()(module);
+        loading->erase(module);
+
+        if(!result.valid()) {
+            sol::error err = result;
+            throw sol::error(std::format("module '{}' failed: {}", module, err.what()));
+        }
+
+        sol::object value = result;
+
+        // like the stock require, a module returning nothing is recorded as true
+        if(value.get_type() == sol::type::lua_nil) {
+            value = sol::make_object(lua, true);
+        }
+
+        loaded.raw_set(module, value);
+        return value;
+    });
+}
+
+lua::CommandBox::CommandBox(sol::state&& state, std::string prefix, std::unique_ptr<StateAllocator> allocator)
+    : _allocator(std::move(allocator)), _state(std::make_unique<sol::state>(std::move(state))), _lua(_state->lua_state()), _prefix(std::move(prefix))
+{
+    _commands = (*_state)[_prefix];
+
+    snapshot_globals();
+}
+
+lua::CommandBox::CommandBox(sol::state_view state, sol::environment environment, sol::thread thread, sol::table commands)
+    : _lua(state.lua_state()), _prefix("commands"), _commands(std::move(commands)), _environment(std::move(environment)), _thread(std::move(thread))
+{
+}
+
+sol::state_view lua::CommandBox::state()
+{
+    return sol::state_view(_lua);
+}
+
+sol::table& lua::CommandBox::commands()
+{
+    return _commands;
+}
+
+sol::table lua::CommandBox::globals()
+{
+    if(shared()) {
+        return _environment;
+    }
+
+    return _state->globals();
+}
+
+sol::thread& lua::CommandBox::thread()
+{
+    return _thread;
+}
+
+bool lua::CommandBox::shared() const
+{
+    return _state == nullptr;
+}
+
+std::uint64_t lua::CommandBox::generation() const
+{
+    return _generation;
+}
+
+void lua::CommandBox::set_generation(std::uint64_t generation)
+{
+    _generation = generation;
+}
+
+const lua::StateAllocator* lua::CommandBox::allocator() const
+{
+    return _allocator.get();
+}
+
+sol::table lua::CommandBox::script_globals()
+{
+    sol::table result = state().create_table();
+
+    // an environment only holds what the chat defined, next to its commands table
+    for(const auto& [key, value] : globals()) {
+        if(key.get_type() == sol::type::string) {
+            auto name = key.as<std::string>();
+
+            if(name == _prefix || (!shared() && _baseline.contains(name))) {
+                continue;
+            }
+        }
+
+        result.raw_set(key, value);
+    }
+
+    return result;
+}
+
+void lua::CommandBox::snapshot_globals()
+{
+    auto globals = _state->globals();
+
+    _baseline.clear();
+    _baselineValues = _state->create_table();
+    _baselineFields = _state->create_table();
+
+    for(const auto& [key, value] : globals) {
+        if(key.get_type() == sol::type::string) {
+            _baseline.insert(key.as<std::string>());
+        }
+
+        _baselineValues.raw_set(key, value);
+
+        if(value.get_type() != sol::type::table || value.pointer() == globals.pointer()) {
+            continue;
+        }
+
+        sol::table fields = _state->create_table();
+        for(const auto& [field, fieldValue] : value.as<sol::table>()) {
+            fields.raw_set(field, fieldValue);
+        }
+
+        _baselineFields.raw_set(value, fields);
+    }
+}
+
+void lua::CommandBox::restore_globals()
+{
+    auto restore = [](sol::table target, const sol::table& snapshot) {
+        std::vector<sol::object> added;
+        for(const auto& [key, value] : target) {
+            if(snapshot.raw_get<sol::object>(key).get_type() == sol::type::lua_nil) {
+                added.push_back(key);
+            }
+        }
+
+        for(const auto& key : added) {
+            target.raw_set(key, sol::lua_nil);
+        }
+
+        for(const auto& [key, value] : snapshot) {
+            target.raw_set(key, value);
+        }
+    };
+
+    restore(_state->globals(), _baselineValues);
+
+    // config.x = ... of one chat must not reach the next one either
+    for(const auto& [table, fields] : _baselineFields) {
+        restore(table.as<sol::table>(), fields.as<sol::table>());
+    }
+}
+
+const std::vector<std::string>& lua::CommandBox::command_names() const
+{
+    return _commandNames;
+}
+
+void lua::CommandBox::set_command_names(std::vector<std::string> names)
+{
+    _commandNames = std::move(names);
+}
+
+void lua::configure_gc(sol::state_view state, const GcSettings& settings)
+{
+    if(settings.generational && runtime::set_generational_gc(state)) {
+        return;
+    }
+
+    runtime::set_incremental_gc(state, settings.pause, settings.stepMultiplier);
 }
 
 Expected<BytecodeMap, errors::Error> lua::load_bytecode_map(const std::string& folder) {
@@ -22,38 +586,78 @@ Expected<BytecodeMap, errors::Error> lua::load_bytecode_map(const std::string& f
         return errors::Error("Given path should be a root directory!");
     }
 
-    BytecodeMap result;
+    std::vector<fs::path> scripts;
 
     for(const auto& entry: fs::directory_iterator(folder)) {
         if(entry.is_regular_file() && fs::path(entry).extension() == ".lua") {
-            sol::state temp_state;
-            temp_state.open_libraries(sol::lib::base);
-            sol::load_result lua = temp_state.load_file(entry.path().string());
-            if(!lua.valid()) {
-                sol::error err = lua;
-                return errors::Error("Unable to load script: " + std::string(err.what()));
-            }
+            scripts.push_back(entry.path());
+        }
+    }
 
-            auto func = lua.get<sol::function>();
-            auto bytecode = temp_state["string"]["dump"](func);
+    std::vector<std::pair<fs::path, std::string>> modules;
+    auto modulesPath = path / ModuleFolder;
 
-            if(!bytecode.valid()) {
-                sol::error err = bytecode;
-                return errors::Error("Unable to compile script: " + std::string(err.what()));
+    if(is_directory(modulesPath)) {
+        for(const auto& entry: fs::recursive_directory_iterator(modulesPath)) {
+            if(entry.is_regular_file() && entry.path().extension() == ".lua") {
+                modules.emplace_back(entry.path(), internal::module_name(entry.path().lexically_relative(modulesPath).generic_string()));
             }
+        }
+    }
+
+    // directory order is unspecified, sorting keeps the reported error the same between runs
+    std::ranges::sort(scripts);
+    std::ranges::sort(modules);
 
-            result.insert_or_assign(entry.path().stem().string(), bytecode.get<std::string>());
+    std::vector<internal::ScriptSource> sources;
+    sources.reserve(scripts.size() + modules.size());
+
+    auto read = [&](const fs::path& script, std::string name) -> ExpectedErr<> {
+        std::ifstream file(script, std::ios::binary);
+        if(!file.is_open()) {
+            return errors::Error("Unable to load script: " + script.string());
+        }
+
+        // relative to the project, the chunk name is part of the cache key
+        sources.push_back({ std::move(name), { std::istreambuf_iterator<char>(file), {} }, "@" + script.lexically_relative(path).generic_string() });
+        return std::monostate {};
+    };
+
+    for(const auto& script : scripts) {
+        auto result = read(script, script.stem().string());
+        if(!result) {
+            return result.error();
         }
     }
 
-    return result;
+    for(const auto& [script, module] : modules) {
+        auto result = read(script, module_key(module));
+        if(!result) {
+            return result.error();
+        }
+    }
+
+    FolderBytecodeCache cache(path / BytecodeCacheFolder);
+    auto compiled = internal::compile_scripts(sources, cache);
+
+    if(!compiled) {
+        return errors::Error("Unable to load script: " + compiled.error().message());
+    }
+
+    return compiled.value();
 }
 
 Expected<BytecodeMap, errors::Error> lua::load_bytecode_map(const files::IFileSystem& zip_fs)
+{
+    ArchiveBytecodeCache cache(zip_fs);
+    return load_bytecode_map(zip_fs, cache);
+}
+
+Expected<BytecodeMap, errors::Error> lua::load_bytecode_map(const files::IFileSystem& zip_fs, BytecodeCache& cache)
 {
     auto files = zip_fs->FileList();
 
-    BytecodeMap result;
+    std::vector<internal::ScriptSource> sources;
 
     for(auto& [name, file] : files) {
         if(file->GetFileInfo().Extension() == ".lua") {
@@ -63,60 +667,240 @@ Expected<BytecodeMap, errors::Error> lua::load_bytecode_map(const files::IFileSy
                 continue;
             }
 
+            // files under /scripts/lib/ are modules, not commands
+            auto module = internal::module_in_archive(name);
+            auto key = module.empty() ? file->GetFileInfo().BaseName() : module_key(module);
+
+            sources.push_back({ std::move(key), std::move(script_text.value()), "=" + name });
+        }
+    }
+
+    std::ranges::sort(sources, {}, &internal::ScriptSource::chunkName);
+
+    auto compiled = internal::compile_scripts(sources, cache);
+
+    if(!compiled) {
+        luabot_logErr("Unable to load script: {}", compiled.error().message());
+        return errors::Error(std::format("Fatal error during loading script: {}", compiled.error().message()));
+    }
+
+    return compiled.value();
+}
+
+Expected<lua::CommandBox*, errors::Error> lua::make_state_from_cached_bytecode(const SharedBytecode& bytecode, const StateOptions& options) {
+    std::unique_ptr<StateAllocator> allocator;
+
+    if(custom_allocators_supported()) {
+        allocator = std::make_unique<StateAllocator>(options.memoryLimit);
+    }
+
+    auto state = internal::prepare_state(allocator.get(), options);
+
+    std::vector<std::string> names;
+    state["commands"] = internal::make_commands(state, bytecode, options.budget, names);
+
+    auto box = new CommandBox(std::move(state), "commands", std::move(allocator));
+    box->set_command_names(std::move(names));
+
+    return box;
+}
+
+Expected<lua::SharedImage, errors::Error> lua::capture_image(const SharedBytecode& scripts, const StateOptions& options)
+{
+    auto state = internal::prepare_state(nullptr, options);
+    install_require(state, scripts, options.budget);
+
+    sol::table commands = state.create_table();
+    state["commands"] = commands;
+
+    auto permanents = persist::permanent_names(state);
+
+    sol::table baseline = state.create_table();
+    std::size_t globalCount = 0;
+
+    for(const auto& [key, value] : state.globals()) {
+        baseline.raw_set(key, value);
+        globalCount++;
+    }
 
-            sol::state temp_state;
-            temp_state.open_libraries(sol::lib::base);
-            sol::load_result lua = temp_state.load(script_text.value());
+    auto image = std::make_shared<StateImage>();
+    image->bytecode = scripts;
 
-            if(!lua.valid()) {
-                sol::error err = lua;
-                luabot_logErr("Unable to load script: {}", err.what());
-                return errors::Error(std::format("Fatal error during loading script: {}", err.what()));
+    std::unordered_set<const void*> instances;
+
+    {
+        BudgetScope budget(options.budget, nullptr);
+
+        for(const auto& [name, bytecode] : scripts->bytecode) {
+            if(is_module_key(name)) {
+                continue;
             }
 
-            auto func = lua.get<sol::function>();
-            auto bytecode = temp_state["string"]["dump"](func);
+            sol::load_result initializer_load_result = state.load(bytecode);
+            if(!initializer_load_result.valid()) {
+                sol::error err = initializer_load_result;
+                return errors::Error("Unable to load bytecode from command [" + name + "]: " + err.what());
+            }
 
-            if(!bytecode.valid()) {
-                sol::error err = bytecode;
-                luabot_logErr("Unable to load script: {}", err.what());
-                return errors::Error(std::format("Unable to compile script: {}", err.what()));
+            auto instance = instantiate_command(initializer_load_result.get<sol::protected_function>(), name);
+            if(!instance) {
+                return instance.error();
             }
 
-            result.insert_or_assign(file->GetFileInfo().BaseName(), bytecode.get<std::string>());
+            commands.raw_set(name, instance.value());
+            instances.insert(instance.value().pointer());
         }
     }
 
-    return result;
+    // a global set by an initializer would exist in the imaged state only
+    for(const auto& [key, value] : state.globals()) {
+        if(!internal::same_value(baseline.raw_get<sol::object>(key), value)) {
+            return errors::Error("Initializers change globals");
+        }
+
+        globalCount--;
+    }
+
+    if(globalCount != 0) {
+        return errors::Error("Initializers change globals");
+    }
+
+    // modules are run again by the restored states, instances get the module values of their own state
+    sol::table loaded = state.registry()[internal::LoadedModules];
+
+    for(const auto& [module, value] : loaded) {
+        persist::add_permanent_names(permanents, value, internal::permanent_of_module(module.as<std::string>()));
+    }
+
+    for(const auto& [key, instance] : commands) {
+        auto name = key.as<std::string>();
+        auto self = instance.pointer();
+
+        instances.erase(self);
+        auto blob = persist::dump_instance(instance.as<sol::table>(), permanents, instances);
+        instances.insert(self);
+
+        if(!blob) {
+            return errors::Error(std::format("Command [{}] can not be imaged: {}", name, blob.error().message()));
+        }
+
+        image->instances.emplace(std::move(name), std::move(blob.value()));
+    }
+
+    return SharedImage(std::move(image));
 }
 
-Expected<lua::CommandBox*, errors::Error> lua::make_state_from_cached_bytecode(const BytecodeMap& bytecode_map) {
-    sol::state state;
+Expected<lua::CommandBox*, errors::Error> lua::make_state_from_image(const SharedImage& image, const StateOptions& options)
+{
+    std::unique_ptr<StateAllocator> allocator;
 
-    state.open_libraries(sol::lib::base);
+    if(custom_allocators_supported()) {
+        allocator = std::make_unique<StateAllocator>(options.memoryLimit);
+    }
 
-    sol::table commands = state.create_table();
+    auto state = internal::prepare_state(allocator.get(), options);
 
-    for(const auto& [name, bytecode] : bytecode_map) {
-        sol::load_result initializer_load_result = state.load(bytecode);
-        if(!initializer_load_result.valid()) {
-            sol::error err = initializer_load_result;
-            return errors::Error("Unable to load bytecode from command [" + name + "]: " + err.what());
+    std::vector<std::string> names;
+    internal::image_commands(state, image, "commands", options.budget, names);
+
+    auto box = new CommandBox(std::move(state), "commands", std::move(allocator));
+    box->set_command_names(std::move(names));
+
+    return box;
+}
+
+Expected<SharedBytecode, errors::Error> lua::check_scripts(BytecodeMap bytecode, const StateOptions& options)
+{
+    auto scripts = std::make_shared<ScriptVersion>();
+    scripts->bytecode = std::move(bytecode);
+
+    auto state = internal::prepare_state(nullptr, options);
+    install_require(state, scripts, options.budget);
+
+    sol::table pending = state.create_table();
+    std::vector<std::string> names;
+
+    for(const auto& [name, chunk] : scripts->bytecode) {
+        if(!is_module_key(name)) {
+            pending[name] = chunk;
+            names.push_back(name);
         }
+    }
 
-        sol::function initializer = initializer_load_result.get<sol::function>();
-        auto initializer_result = initializer();
-        if(!initializer_result.valid()) {
-            sol::error err = initializer_load_result;
-            return errors::Error("Unable to call initializer for command [" + name + "]: " + err.what());
+    // the same order every time, so is the error reported
+    std::ranges::sort(names);
+
+    // built through the lazy table as in a session, initializers may look up other commands
+    auto build = internal::chunk_builder(pending);
+    sol::table commands = make_lazy_commands(state, build, options.budget);
+    state["commands"] = commands;
+
+    BudgetScope budget(options.budget, nullptr);
+
+    for(const auto& name : names) {
+        sol::object instance = commands.raw_get<sol::object>(name);
+
+        // called directly instead of looked up, the lookup would only log why a command failed
+        if(instance.get_type() == sol::type::lua_nil) {
+            auto built = build(state, name);
+            if(!built) {
+                return built.error();
+            }
+
+            instance = built.value();
+        }
+
+        if(instance.get_type() != sol::type::table) {
+            return errors::Error("Command [" + name + "] failed to build when another command looked it up, see the log for details");
         }
 
-        sol::table instance = initializer_result.get<sol::table>();
-        commands[name] = instance;
+        commands.raw_set(name, instance);
+
+        // looked up the way sessions do, a handler may come from a metatable
+        if(instance.as<sol::table>()["on_start"].get_type() != sol::type::lua_nil) {
+            scripts->eager.insert(name);
+        }
     }
 
-    state["commands"] = commands;
-    return new CommandBox(std::move(state), "commands");
+    return SharedBytecode(std::move(scripts));
+}
+
+ExpectedErr<> lua::reset_state(CommandBox& box, const SharedBytecode& bytecode, const BudgetSettings& budget)
+{
+    if(box.shared()) {
+        return errors::Error("Only isolated states can be reset");
+    }
+
+    box.restore_globals();
+
+    auto& state = *box._state;
+    auto commands = internal::make_commands(state, bytecode, budget, box._commandNames);
+
+    state[box._prefix] = commands;
+    box._commands = commands;
+
+    // taken again so the snapshot holds nothing of the script version replaced
+    box.snapshot_globals();
+    state.collect_garbage();
+
+    return std::monostate {};
+}
+
+ExpectedErr<> lua::reset_state(CommandBox& box, const SharedImage& image, const BudgetSettings& budget)
+{
+    if(box.shared()) {
+        return errors::Error("Only isolated states can be reset");
+    }
+
+    box.restore_globals();
+
+    auto& state = *box._state;
+    box._commands = internal::image_commands(state, image, box._prefix, budget, box._commandNames);
+
+    box.snapshot_globals();
+    state.collect_garbage();
+
+    return std::monostate {};
 }
 
 Expected<lua::CommandBox*, errors::Error> lua::load_scripts(const std::string& folder)
@@ -135,6 +919,7 @@ Expected<lua::CommandBox*, errors::Error> lua::load_scripts(const std::string& f
     state.open_libraries(sol::lib::base);
 
     sol::table commands = state.create_table();
+    std::vector<std::string> names;
 
     for(const auto& entry : fs::directory_iterator(folder)) {
         if(entry.is_regular_file() && fs::path(entry).extension() == "lua") {
@@ -150,12 +935,17 @@ Expected<lua::CommandBox*, errors::Error> lua::load_scripts(const std::string& f
             sol::function initializer = result.get<sol::function>();
             sol::table instance = initializer();
             commands[command_name] = instance;
+            names.push_back(std::move(command_name));
         }
 
     }
 
     state["commands"] = commands;
-    return new CommandBox(std::move(state), "commands");
+
+    auto box = new CommandBox(std::move(state), "commands");
+    box->set_command_names(std::move(names));
+
+    return box;
 }
 
 
@@ -1,12 +1,21 @@
 #pragma once
 
 #include <filesystem>
+#include <functional>
+#include <memory>
+#include <string_view>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
 
 #include <sol/sol.hpp>
 
 #include "expected.hxx"
 
 #include "error.hxx"
+#include "lua_allocator.hxx"
+#include "lua_budget.hxx"
+#include "lua_bytecode_cache.hxx"
 
 #include "zip2memvfs.hxx"
 
@@ -27,24 +36,192 @@ concept SolBasicType =
 
 using BytecodeMap = std::unordered_map<std::string, std::string>;
 
+// a published script version is never modified, a reload publishes a new one. made by lua::check_scripts
+struct ScriptVersion
+{
+    BytecodeMap bytecode;
+
+    // commands whose instance has on_start. sessions begin by running those, so they are built up front
+    std::unordered_set<std::string> eager;
+};
+
+using SharedBytecode = std::shared_ptr<const ScriptVersion>;
+
 namespace lua {
 
+struct StateImage;
+using SharedImage = std::shared_ptr<const StateImage>;
+
 class CommandBox final
 {
 public:
-    CommandBox(sol::state&& state, std::string prefix);
+    // isolated box, owns a whole interpreter and the allocator it was created with, if any
+    CommandBox(sol::state&& state, std::string prefix, std::unique_ptr<StateAllocator> allocator = nullptr);
+
+    // box living in a state shared with other chats, everything it defines goes to its own environment
+    CommandBox(sol::state_view state, sol::environment environment, sol::thread thread, sol::table commands);
+
+    sol::state_view state();
+    sol::table& commands();
 
-    sol::global_table& commands();
+    // table the scripts of this box see as globals
+    sol::table globals();
+    sol::thread& thread();
+
+    bool shared() const;
+
+    // script version the commands of the box were built from, see StateSource::generation
+    std::uint64_t generation() const;
+    void set_generation(std::uint64_t generation);
+
+    // nullptr for shared boxes and states on the default allocator
+    const StateAllocator* allocator() const;
+
+    // globals the scripts defined on top of what the state was built with, collected into a new table
+    sol::table script_globals();
+
+    // every command of the box, built or not. the commands table only holds the ones used so far
+    const std::vector<std::string>& command_names() const;
+    void set_command_names(std::vector<std::string> names);
 
 private:
-    sol::state _state;
+    friend ExpectedErr<> reset_state(CommandBox& box, const SharedBytecode& bytecode, const BudgetSettings& budget);
+    friend ExpectedErr<> reset_state(CommandBox& box, const SharedImage& image, const BudgetSettings& budget);
+
+    // records the globals of a freshly built state, and the fields of those that are tables
+    void snapshot_globals();
+
+    // brings the globals back to the snapshot: what scripts added goes, what they overwrote or put into
+    // a global table is undone. one level deep, tables nested further are the scripts' own anyway
+    void restore_globals();
+
+    // declared before the state, it must outlive every block the state frees on close
+    std::unique_ptr<StateAllocator> _allocator;
+
+    std::unique_ptr<sol::state> _state;
+    lua_State* _lua;
+
     std::string _prefix;
+    sol::table _commands;
+
+    sol::environment _environment;
+    sol::thread _thread;
+
+    std::uint64_t _generation { 0 };
+
+    std::vector<std::string> _commandNames;
+
+    // globals present once the state was built, everything else was left behind by the scripts
+    std::unordered_set<std::string> _baseline;
+
+    // name -> value of those globals, and table -> shallow copy for the ones holding tables
+    sol::table _baselineValues;
+    sol::table _baselineFields;
+};
+
+// sessions step the collector in idle time on top of its own steps, so less of the work lands in handlers
+struct GcSettings
+{
+    // PUC Lua only, pause and step multiplier do not apply then
+    bool generational { false };
+
+    // percent the heap grows by before the next cycle starts on its own
+    int pause { 200 };
+
+    // speed of the automatic steps relative to allocation, in percent
+    int stepMultiplier { 200 };
+
+    // work of a single idle step, zero disables idle collection
+    std::size_t idleStepKb { 64 };
 };
 
+// how every command state of a project is set up
+struct StateOptions
+{
+    BudgetSettings budget;
+    GcSettings gc;
+
+    // LuaJIT only, budgets turn it off regardless
+    bool jit { true };
+
+    // per isolated state, zero means no cap. shared states have none, the settings refuse one for them
+    std::size_t memoryLimit { DefaultMemoryLimit };
+
+    // states are restored from a heap image of the initialized commands when the scripts allow it, see capture_image
+    bool image { true };
+};
+
+// commands of a script version as they are right after their initializers ran, one image per command so
+// sessions still only build what they use. restoring an instance skips undumping the chunk and rerunning the initializer
+struct StateImage
+{
+    // command name -> persist::dump_instance blob
+    std::unordered_map<std::string, std::string> instances;
+
+    // the script version imaged, restored states require their modules from it
+    SharedBytecode bytecode;
+};
+
+// where sessions take their command states from and give them back to
+class StateSource
+{
+public:
+    virtual ~StateSource() = default;
+
+    virtual Expected<CommandBox*, errors::Error> acquire() = 0;
+    virtual void release(std::unique_ptr<CommandBox> box) = 0;
+
+    // bumped by every script reload, boxes of an older generation should be given back at the next safe point
+    virtual std::uint64_t generation() const = 0;
+};
+
+void configure_gc(sol::state_view state, const GcSettings& settings);
+
+// modules live in the bytecode map next to the commands, under keys no command file name can produce
+constexpr std::string_view ModuleKeyPrefix = "lib/";
+
+// folder of modules inside a scripts folder, the same folder under the scripts of a project archive
+constexpr const char* ModuleFolder = "lib";
+constexpr const char* ModuleArchiveFolder = "/scripts/lib/";
+
+bool is_module_key(std::string_view key);
+std::string module_key(std::string_view module);
+
+// commands are the .lua files next to each other, modules come from the lib folder: lib/text/format.lua is "text.format"
 Expected<BytecodeMap, errors::Error> load_bytecode_map(const std::string& folder);
 Expected<BytecodeMap, errors::Error> load_bytecode_map(const files::IFileSystem& zip_fs);
+Expected<BytecodeMap, errors::Error> load_bytecode_map(const files::IFileSystem& zip_fs, BytecodeCache& cache);
+
+// `require` of a state: modules of the given script version, each run once per state and cached there.
+// replaces what a previous call installed, modules loaded before are forgotten
+void install_require(sol::state_view state, const SharedBytecode& bytecode, const BudgetSettings& budget);
+
+// runs a loaded command chunk and, if it returned a factory, the factory too
+Expected<sol::table, errors::Error> instantiate_command(const sol::protected_function& initializer, const std::string& name);
+
+// builds the command with the given name in the given state, nil for an unknown name
+using CommandBuilder = std::function<Expected<sol::object, errors::Error>(sol::state_view state, const std::string& name)>;
+
+// commands table whose entries are built on first lookup, by scripts and by the session alike.
+// a command that fails to build is logged and reads as nil
+sol::table make_lazy_commands(sol::state_view state, CommandBuilder build, const BudgetSettings& budget);
+
+Expected<CommandBox*, errors::Error> make_state_from_cached_bytecode(const SharedBytecode& bytecode, const StateOptions& options = {});
+
+// runs every initializer once and images the results. initializers only run here then, so scripts whose
+// initializers define globals, or whose instances hold coroutines, userdata or each other, are refused
+Expected<SharedImage, errors::Error> capture_image(const SharedBytecode& bytecode, const StateOptions& options = {});
+
+Expected<CommandBox*, errors::Error> make_state_from_image(const SharedImage& image, const StateOptions& options = {});
+
+// builds every command once in a throwaway state, sessions build them lazily and could only log a failure.
+// scripts go live through here, a broken command rejects the whole version with its actual error.
+// the built instances tell which commands have on_start
+Expected<SharedBytecode, errors::Error> check_scripts(BytecodeMap bytecode, const StateOptions& options = {});
 
-Expected<CommandBox*, errors::Error> make_state_from_cached_bytecode(const BytecodeMap& bytecode_map);
+// brings a used state back to a freshly built one: undoes what scripts did to the globals and starts over with unbuilt commands
+ExpectedErr<> reset_state(CommandBox& box, const SharedBytecode& bytecode, const BudgetSettings& budget);
+ExpectedErr<> reset_state(CommandBox& box, const SharedImage& image, const BudgetSettings& budget);
 
 Expected<CommandBox*, errors::Error> load_scripts(const std::string& folder);
 
@@ -0,0 +1,1013 @@
+#include "lua_persist.hxx"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <format>
+#include <functional>
+#include <limits>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include "lua_runtime.hxx"
+
+namespace lua::persist::internal {
+
+constexpr char Magic[] = { 'L', 'B', 'S', '2' };
+constexpr std::size_t MaxDepth = 128;
+
+enum Tag : std::uint8_t
+{
+    Tag_Nil,
+    Tag_False,
+    Tag_True,
+    Tag_Integer,
+    Tag_Number,
+    Tag_String,
+    Tag_Table,
+    Tag_TableRef,
+    Tag_End
+};
+
+bool is_persistable(sol::type type)
+{
+    return type == sol::type::boolean || type == sol::type::number || type == sol::type::string || type == sol::type::table;
+}
+
+// integers of 5.3+ stay integers, LuaJIT numbers are all doubles and integral ones are simply written shorter
+bool integer_of(const sol::object& object, std::int64_t& integer)
+{
+    auto L = object.lua_state();
+    object.push();
+
+#if LUA_VERSION_NUM >= 503
+    bool isInteger = lua_isinteger(L, -1);
+    integer = isInteger ? lua_tointeger(L, -1) : 0;
+#else
+    auto number = lua_tonumber(L, -1);
+    bool isInteger = std::trunc(number) == number && std::abs(number) < 9007199254740992.0;
+    integer = isInteger ? static_cast<std::int64_t>(number) : 0;
+#endif
+
+    lua_pop(L, 1);
+    return isInteger;
+}
+
+class Writer
+{
+public:
+    void byte(std::uint8_t value)
+    {
+        _buffer.push_back(static_cast<char>(value));
+    }
+
+    void varint(std::uint64_t value)
+    {
+        while(value >= 0x80) {
+            byte(static_cast<std::uint8_t>(value | 0x80));
+            value >>= 7;
+        }
+
+        byte(static_cast<std::uint8_t>(value));
+    }
+
+    void string(std::string_view value)
+    {
+        varint(value.size());
+        _buffer.append(value);
+    }
+
+    void number(double value)
+    {
+        char raw[sizeof(double)];
+        std::memcpy(raw, &value, sizeof(double));
+        _buffer.append(raw, sizeof(double));
+    }
+
+    ExpectedErr<> value(const sol::object& object, std::size_t depth = 0)
+    {
+        switch(object.get_type()) {
+        case sol::type::boolean:
+            byte(object.as<bool>() ? Tag_True : Tag_False);
+            break;
+        case sol::type::number: {
+            std::int64_t integer;
+
+            // zigzag integers keep counters and ids at a byte or two instead of eight
+            if(integer_of(object, integer)) {
+                byte(Tag_Integer);
+                varint((static_cast<std::uint64_t>(integer) << 1) ^ static_cast<std::uint64_t>(integer >> 63));
+            } else {
+                byte(Tag_Number);
+                this->number(object.as<double>());
+            }
+            break;
+        }
+        case sol::type::string:
+            byte(Tag_String);
+            string(object.as<std::string_view>());
+            break;
+        case sol::type::table:
+            return table(object.as<sol::table>(), depth);
+        default:
+            byte(Tag_Nil);
+            break;
+        }
+
+        return std::monostate {};
+    }
+
+    ExpectedErr<> table(const sol::table& table, std::size_t depth)
+    {
+        if(depth > MaxDepth) {
+            return errors::Error("Table nesting is too deep to be persisted");
+        }
+
+        auto [it, inserted] = _tables.try_emplace(table.pointer(), _tables.size());
+
+        if(!inserted) {
+            byte(Tag_TableRef);
+            varint(it->second);
+            return std::monostate {};
+        }
+
+        byte(Tag_Table);
+
+        for(const auto& [key, value] : table) {
+            if(!is_persistable(key.get_type()) || !is_persistable(value.get_type())) {
+                continue;
+            }
+
+            auto keyResult = this->value(key, depth + 1);
+            if(!keyResult) {
+                return keyResult;
+            }
+
+            auto valueResult = this->value(value, depth + 1);
+            if(!valueResult) {
+                return valueResult;
+            }
+        }
+
+        byte(Tag_End);
+        return std::monostate {};
+    }
+
+    std::string& buffer()
+    {
+        return _buffer;
+    }
+
+private:
+    std::string _buffer;
+    std::unordered_map<const void*, std::uint64_t> _tables;
+};
+
+class Reader
+{
+public:
+    Reader(sol::state_view state, std::string_view blob) : _state(state), _blob(blob) { }
+
+    Expected<std::uint8_t> byte()
+    {
+        if(_position >= _blob.size()) {
+            return errors::Error("Unexpected end of session blob");
+        }
+
+        return static_cast<std::uint8_t>(_blob[_position++]);
+    }
+
+    Expected<std::uint64_t> varint()
+    {
+        std::uint64_t result = 0;
+
+        for(std::uint32_t shift = 0; shift < 64; shift += 7) {
+            auto next = byte();
+            if(!next) {
+                return next.error();
+            }
+
+            result |= static_cast<std::uint64_t>(next.value() & 0x7f) << shift;
+
+            if((next.value() & 0x80) == 0) {
+                return result;
+            }
+        }
+
+        return errors::Error("Malformed varint in session blob");
+    }
+
+    Expected<std::string_view> string()
+    {
+        auto size = varint();
+        if(!size) {
+            return size.error();
+        }
+
+        if(size.value() > _blob.size() - _position) {
+            return errors::Error("String length exceeds session blob");
+        }
+
+        auto result = _blob.substr(_position, size.value());
+        _position += size.value();
+
+        return result;
+    }
+
+    Expected<double> number()
+    {
+        if(_blob.size() - _position < sizeof(double)) {
+            return errors::Error("Unexpected end of session blob");
+        }
+
+        double number;
+        std::memcpy(&number, _blob.data() + _position, sizeof(double));
+        _position += sizeof(double);
+
+        return number;
+    }
+
+    bool match(const char* bytes, std::size_t size)
+    {
+        if(_blob.size() - _position < size || std::memcmp(_blob.data() + _position, bytes, size) != 0) {
+            return false;
+        }
+
+        _position += size;
+        return true;
+    }
+
+    // reads one value. tables are filled into `target` when it is a table already, so that functions
+    // the initializer put there survive the restore
+    Expected<sol::object> value(std::uint8_t tag, const sol::object& target, std::size_t depth = 0)
+    {
+        switch(tag) {
+        case Tag_Nil:
+            return sol::object(sol::lua_nil);
+        case Tag_False:
+            return sol::make_object(_state, false);
+        case Tag_True:
+            return sol::make_object(_state, true);
+        case Tag_Integer: {
+            auto encoded = varint();
+            if(!encoded) {
+                return encoded.error();
+            }
+
+            auto integer = static_cast<std::int64_t>(encoded.value() >> 1) ^ -static_cast<std::int64_t>(encoded.value() & 1);
+            return sol::make_object(_state, integer);
+        }
+        case Tag_Number: {
+            auto number = this->number();
+            if(!number) {
+                return number.error();
+            }
+
+            return sol::make_object(_state, number.value());
+        }
+        case Tag_String: {
+            auto string = this->string();
+            if(!string) {
+                return string.error();
+            }
+
+            return sol::make_object(_state, string.value());
+        }
+        case Tag_Table:
+            return table(target, depth);
+        case Tag_TableRef: {
+            auto id = varint();
+            if(!id) {
+                return id.error();
+            }
+
+            if(id.value() >= _tables.size()) {
+                return errors::Error("Dangling table reference in session blob");
+            }
+
+            return sol::object(_tables[id.value()]);
+        }
+        default:
+            return errors::Error(std::format("Unknown tag {} in session blob", tag));
+        }
+    }
+
+    Expected<sol::object> table(const sol::object& target, std::size_t depth)
+    {
+        if(depth > MaxDepth) {
+            return errors::Error("Table nesting is too deep in session blob");
+        }
+
+        sol::table table;
+
+        if(target.get_type() == sol::type::table) {
+            table = target.as<sol::table>();
+
+            // data left by the initializer is replaced as a whole, so fields the script cleared stay cleared
+            std::vector<sol::object> stale;
+            for(const auto& [key, value] : table) {
+                if(is_persistable(key.get_type()) && is_persistable(value.get_type()) && value.get_type() != sol::type::table) {
+                    stale.push_back(key);
+                }
+            }
+
+            for(const auto& key : stale) {
+                table.raw_set(key, sol::lua_nil);
+            }
+        } else {
+            table = _state.create_table();
+        }
+
+        _tables.push_back(table);
+
+        while(true) {
+            auto tag = byte();
+            if(!tag) {
+                return tag.error();
+            }
+
+            if(tag.value() == Tag_End) {
+                break;
+            }
+
+            auto key = value(tag.value(), sol::lua_nil, depth + 1);
+            if(!key) {
+                return key.error();
+            }
+
+            auto valueTag = byte();
+            if(!valueTag) {
+                return valueTag.error();
+            }
+
+            sol::object existing = table.raw_get<sol::object>(key.value());
+            auto value = this->value(valueTag.value(), existing, depth + 1);
+            if(!value) {
+                return value.error();
+            }
+
+            table.raw_set(key.value(), value.value());
+        }
+
+        return sol::object(table);
+    }
+
+    bool finished() const
+    {
+        return _position == _blob.size();
+    }
+
+private:
+    sol::state_view _state;
+    std::string_view _blob;
+    std::size_t _position { 0 };
+
+    std::vector<sol::table> _tables;
+};
+
+constexpr char ImageMagic[] = { 'L', 'B', 'I', '1' };
+constexpr std::size_t PermanentDepth = 4;
+
+enum ImageTag : std::uint8_t
+{
+    Image_Nil,
+    Image_False,
+    Image_True,
+    Image_Integer,
+    Image_Number,
+    Image_String,
+    Image_Table,
+    Image_Function,
+    Image_Ref,
+    Image_Permanent,
+    Image_End,
+    Image_Upvalue,
+    Image_SharedUpvalue
+};
+
+bool is_reference(sol::type type)
+{
+    return type == sol::type::table || type == sol::type::function || type == sol::type::userdata;
+}
+
+// depth first with sorted keys: string hashing is seeded per state, two states built alike must still agree on the paths
+void walk_permanents(const sol::table& table, const std::string& path, std::size_t depth, const std::function<bool(const sol::object&, const std::string&)>& visit)
+{
+    std::vector<std::pair<std::string, sol::object>> entries;
+
+    for(const auto& [key, value] : table) {
+        if(key.get_type() == sol::type::string && is_reference(value.get_type())) {
+            entries.emplace_back(key.as<std::string>(), value);
+        }
+    }
+
+    std::ranges::sort(entries, {}, &std::pair<std::string, sol::object>::first);
+
+    for(const auto& [key, value] : entries) {
+        auto child = path.empty() ? key : path + "." + key;
+
+        if(visit(value, child) && value.get_type() == sol::type::table && depth < PermanentDepth) {
+            walk_permanents(value.as<sol::table>(), child, depth + 1, visit);
+        }
+    }
+}
+
+class ImageWriter
+{
+public:
+    ImageWriter(const PermanentNames& permanents, const std::unordered_set<const void*>& foreign)
+        : _permanents(permanents), _foreign(foreign)
+    {
+    }
+
+    ExpectedErr<> value(const sol::object& object, std::size_t depth)
+    {
+        switch(object.get_type()) {
+        case sol::type::lua_nil:
+        case sol::type::none:
+            _out.byte(Image_Nil);
+            break;
+        case sol::type::boolean:
+            _out.byte(object.as<bool>() ? Image_True : Image_False);
+            break;
+        case sol::type::number: {
+            std::int64_t integer;
+
+            if(integer_of(object, integer)) {
+                _out.byte(Image_Integer);
+                _out.varint((static_cast<std::uint64_t>(integer) << 1) ^ static_cast<std::uint64_t>(integer >> 63));
+            } else {
+                _out.byte(Image_Number);
+                _out.number(object.as<double>());
+            }
+            break;
+        }
+        case sol::type::string:
+            _out.byte(Image_String);
+            _out.string(object.as<std::string_view>());
+            break;
+        default:
+            return reference(object, depth);
+        }
+
+        return std::monostate {};
+    }
+
+    std::string& buffer()
+    {
+        return _out.buffer();
+    }
+
+private:
+    ExpectedErr<> reference(const sol::object& object, std::size_t depth)
+    {
+        auto pointer = object.pointer();
+
+        if(auto permanent = _permanents.find(pointer); permanent != _permanents.end()) {
+            _out.byte(Image_Permanent);
+            _out.string(permanent->second);
+            return std::monostate {};
+        }
+
+        if(auto known = _objects.find(pointer); known != _objects.end()) {
+            _out.byte(Image_Ref);
+            _out.varint(known->second);
+            return std::monostate {};
+        }
+
+        if(_foreign.contains(pointer)) {
+            return errors::Error("Instance refers to another command, commands are imaged one by one");
+        }
+
+        if(depth > MaxDepth) {
+            return errors::Error("Object graph is too deep to be imaged");
+        }
+
+        switch(object.get_type()) {
+        case sol::type::table:
+            return table(object.as<sol::table>(), depth);
+        case sol::type::function:
+            return function(object.as<sol::function>(), depth);
+        default:
+            return errors::Error(std::format("Values of type {} can not be imaged", sol::type_name(object.lua_state(), object.get_type())));
+        }
+    }
+
+    ExpectedErr<> table(const sol::table& table, std::size_t depth)
+    {
+        _objects.emplace(table.pointer(), _objects.size());
+        _out.byte(Image_Table);
+
+        auto L = table.lua_state();
+        table.push();
+
+        sol::object metatable = sol::lua_nil;
+        if(lua_getmetatable(L, -1)) {
+            metatable = sol::object(L, -1);
+            lua_pop(L, 1);
+        }
+
+        lua_pop(L, 1);
+
+        auto result = value(metatable, depth + 1);
+        if(!result) {
+            return result;
+        }
+
+        for(const auto& [key, value] : table) {
+            result = this->value(key, depth + 1);
+            if(!result) {
+                return result;
+            }
+
+            result = this->value(value, depth + 1);
+            if(!result) {
+                return result;
+            }
+        }
+
+        _out.byte(Image_End);
+        return std::monostate {};
+    }
+
+    ExpectedErr<> function(const sol::function& function, std::size_t depth)
+    {
+        auto L = function.lua_state();
+        function.push();
+
+        if(lua_iscfunction(L, -1)) {
+            lua_pop(L, 1);
+            return errors::Error("Instance holds a native function the globals do not lead to");
+        }
+
+        // upvalues are collected first, nothing of the function stays on the stack while values are written
+        std::vector<sol::object> upvalues;
+        std::vector<const void*> ids;
+
+        for(int index = 1; lua_getupvalue(L, -1, index) != nullptr; index++) {
+            upvalues.emplace_back(L, -1);
+            lua_pop(L, 1);
+
+            ids.push_back(lua_upvalueid(L, -1, index));
+        }
+
+        lua_pop(L, 1);
+
+        auto bytecode = runtime::dump(function);
+        if(!bytecode) {
+            return bytecode.error();
+        }
+
+        auto id = _objects.size();
+        _objects.emplace(function.pointer(), id);
+
+        _out.byte(Image_Function);
+        _out.string(bytecode.value());
+        _out.varint(upvalues.size());
+
+        for(std::size_t index = 0; index < upvalues.size(); index++) {
+            // closures sharing a local share it again after the restore
+            if(auto shared = _upvalues.find(ids[index]); shared != _upvalues.end()) {
+                _out.byte(Image_SharedUpvalue);
+                _out.varint(shared->second.first);
+                _out.varint(shared->second.second);
+                continue;
+            }
+
+            _upvalues.emplace(ids[index], std::pair { id, index + 1 });
+            _out.byte(Image_Upvalue);
+
+            auto result = value(upvalues[index], depth + 1);
+            if(!result) {
+                return result;
+            }
+        }
+
+        return std::monostate {};
+    }
+
+    Writer _out;
+
+    const PermanentNames& _permanents;
+    const std::unordered_set<const void*>& _foreign;
+
+    std::unordered_map<const void*, std::uint64_t> _objects;
+
+    // upvalue -> closure that wrote it first and the upvalue index there
+    std::unordered_map<const void*, std::pair<std::uint64_t, std::size_t>> _upvalues;
+};
+
+class ImageReader
+{
+public:
+    ImageReader(sol::state_view state, std::string_view blob, const sol::table& permanents)
+        : _in(state, blob), _state(state), _permanents(permanents)
+    {
+    }
+
+    Expected<sol::object> value(std::size_t depth)
+    {
+        auto tag = _in.byte();
+        if(!tag) {
+            return tag.error();
+        }
+
+        return decode(tag.value(), depth);
+    }
+
+    bool match(const char* bytes, std::size_t size)
+    {
+        return _in.match(bytes, size);
+    }
+
+    bool finished() const
+    {
+        return _in.finished();
+    }
+
+private:
+    Expected<sol::object> decode(std::uint8_t tag, std::size_t depth)
+    {
+        switch(tag) {
+        case Image_Nil:
+            return sol::make_object(_state, sol::lua_nil);
+        case Image_False:
+            return sol::make_object(_state, false);
+        case Image_True:
+            return sol::make_object(_state, true);
+        case Image_Integer: {
+            auto encoded = _in.varint();
+            if(!encoded) {
+                return encoded.error();
+            }
+
+            auto integer = static_cast<std::int64_t>(encoded.value() >> 1) ^ -static_cast<std::int64_t>(encoded.value() & 1);
+            return sol::make_object(_state, integer);
+        }
+        case Image_Number: {
+            auto number = _in.number();
+            if(!number) {
+                return number.error();
+            }
+
+            return sol::make_object(_state, number.value());
+        }
+        case Image_String: {
+            auto string = _in.string();
+            if(!string) {
+                return string.error();
+            }
+
+            return sol::make_object(_state, string.value());
+        }
+        case Image_Table:
+            return table(depth);
+        case Image_Function:
+            return function(depth);
+        case Image_Ref: {
+            auto id = _in.varint();
+            if(!id) {
+                return id.error();
+            }
+
+            if(id.value() >= _objects.size()) {
+                return errors::Error("Dangling reference in heap image");
+            }
+
+            return _objects[id.value()];
+        }
+        case Image_Permanent: {
+            auto path = _in.string();
+            if(!path) {
+                return path.error();
+            }
+
+            // not raw, the table may resolve some names on demand
+            sol::object permanent = _permanents.get<sol::object>(path.value());
+
+            if(permanent.get_type() == sol::type::lua_nil) {
+                return errors::Error(std::format("Heap image refers to {}, the state has no such value", path.value()));
+            }
+
+            return permanent;
+        }
+        default:
+            return errors::Error(std::format("Unknown tag {} in heap image", tag));
+        }
+    }
+
+    Expected<sol::object> table(std::size_t depth)
+    {
+        if(depth > MaxDepth) {
+            return errors::Error("Object graph is too deep in heap image");
+        }
+
+        sol::table table = _state.create_table();
+        _objects.push_back(table);
+
+        auto metatable = value(depth + 1);
+        if(!metatable) {
+            return metatable.error();
+        }
+
+        while(true) {
+            auto tag = _in.byte();
+            if(!tag) {
+                return tag.error();
+            }
+
+            if(tag.value() == Image_End) {
+                break;
+            }
+
+            auto key = decode(tag.value(), depth + 1);
+            if(!key) {
+                return key.error();
+            }
+
+            auto value = this->value(depth + 1);
+            if(!value) {
+                return value.error();
+            }
+
+            table.raw_set(key.value(), value.value());
+        }
+
+        // set last, a metatable guarding writes must not see the fields being filled in
+        if(metatable.value().get_type() == sol::type::table) {
+            table[sol::metatable_key] = metatable.value();
+        }
+
+        return sol::object(table);
+    }
+
+    Expected<sol::object> function(std::size_t depth)
+    {
+        if(depth > MaxDepth) {
+            return errors::Error("Object graph is too deep in heap image");
+        }
+
+        auto bytecode = _in.string();
+        if(!bytecode) {
+            return bytecode.error();
+        }
+
+        sol::load_result loaded = _state.load(bytecode.value(), "=image", sol::load_mode::binary);
+        if(!loaded.valid()) {
+            sol::error err = loaded;
+            return errors::Error(std::format("Unable to load a function of heap image: {}", err.what()));
+        }
+
+        sol::function function = loaded.get<sol::function>();
+        _objects.push_back(function);
+
+        auto count = _in.varint();
+        if(!count) {
+            return count.error();
+        }
+
+        auto L = _state.lua_state();
+
+        for(std::uint64_t index = 1; index <= count.value(); index++) {
+            auto tag = _in.byte();
+            if(!tag) {
+                return tag.error();
+            }
+
+            if(tag.value() == Image_SharedUpvalue) {
+                auto owner = _in.varint();
+                if(!owner) {
+                    return owner.error();
+                }
+
+                auto ownerIndex = _in.varint();
+                if(!ownerIndex) {
+                    return ownerIndex.error();
+                }
+
+                if(owner.value() >= _objects.size() || _objects[owner.value()].get_type() != sol::type::function) {
+                    return errors::Error("Shared upvalue of heap image points at no function");
+                }
+
+                function.push();
+                _objects[owner.value()].push();
+                lua_upvaluejoin(L, -2, static_cast<int>(index), -1, static_cast<int>(ownerIndex.value()));
+                lua_pop(L, 2);
+                continue;
+            }
+
+            if(tag.value() != Image_Upvalue) {
+                return errors::Error(std::format("Unknown upvalue tag {} in heap image", tag.value()));
+            }
+
+            auto value = this->value(depth + 1);
+            if(!value) {
+                return value.error();
+            }
+
+            function.push();
+            value.value().push();
+
+            if(lua_setupvalue(L, -2, static_cast<int>(index)) == nullptr) {
+                lua_pop(L, 2);
+                return errors::Error("Function of heap image has fewer upvalues than written");
+            }
+
+            lua_pop(L, 1);
+        }
+
+        return sol::object(function);
+    }
+
+    Reader _in;
+    sol::state_view _state;
+    const sol::table& _permanents;
+
+    std::vector<sol::object> _objects;
+};
+
+}
+
+Expected<std::string, errors::Error> lua::persist::dump_commands(const sol::table& commands, const sol::table& scriptGlobals)
+{
+    internal::Writer writer;
+    writer.buffer().append(internal::Magic, sizeof(internal::Magic));
+
+    std::vector<std::pair<std::string_view, sol::table>> instances;
+
+    for(const auto& [name, instance] : commands) {
+        if(name.get_type() == sol::type::string && instance.get_type() == sol::type::table) {
+            instances.emplace_back(name.as<std::string_view>(), instance.as<sol::table>());
+        }
+    }
+
+    writer.varint(instances.size());
+
+    for(const auto& [name, instance] : instances) {
+        writer.string(name);
+
+        auto result = writer.table(instance, 0);
+        if(!result) {
+            return errors::Error(std::format("Unable to persist command [{}]: {}", name, result.error().message()));
+        }
+    }
+
+    // after the commands, a global holding a command instance is read back as a reference to the restored one
+    auto result = writer.table(scriptGlobals, 0);
+    if(!result) {
+        return errors::Error(std::format("Unable to persist script globals: {}", result.error().message()));
+    }
+
+    return std::move(writer.buffer());
+}
+
+ExpectedErr<> lua::persist::restore_commands(const sol::table& commands, const sol::table& globals, std::string_view blob)
+{
+    sol::state_view state(commands.lua_state());
+    internal::Reader reader(state, blob);
+
+    if(!reader.match(internal::Magic, sizeof(internal::Magic))) {
+        return errors::Error("Session blob has an unknown format");
+    }
+
+    auto count = reader.varint();
+    if(!count) {
+        return count.error();
+    }
+
+    for(std::uint64_t index = 0; index < count.value(); index++) {
+        auto name = reader.string();
+        if(!name) {
+            return name.error();
+        }
+
+        auto tag = reader.byte();
+        if(!tag) {
+            return tag.error();
+        }
+
+        // only commands used before hibernation have data, looking them up builds them again
+        sol::object instance = commands.get<sol::object>(name.value());
+
+        // a command removed since the session was hibernated is still read through, its data is just not kept
+        auto restored = reader.value(tag.value(), instance);
+        if(!restored) {
+            return errors::Error(std::format("Unable to restore command [{}]: {}", name.value(), restored.error().message()));
+        }
+    }
+
+    auto tag = reader.byte();
+    if(!tag) {
+        return tag.error();
+    }
+
+    // read into a table of its own, filling the globals in place would clear what the state defines itself
+    auto scriptGlobals = reader.value(tag.value(), sol::lua_nil);
+    if(!scriptGlobals) {
+        return errors::Error(std::format("Unable to restore script globals: {}", scriptGlobals.error().message()));
+    }
+
+    if(scriptGlobals.value().get_type() == sol::type::table) {
+        for(const auto& [key, value] : scriptGlobals.value().as<sol::table>()) {
+            globals.raw_set(key, value);
+        }
+    }
+
+    if(!reader.finished()) {
+        return errors::Error("Session blob has trailing data");
+    }
+
+    return std::monostate {};
+}
+
+lua::persist::PermanentNames lua::persist::permanent_names(sol::state_view state)
+{
+    PermanentNames names;
+    names.emplace(state.globals().pointer(), "_G");
+
+    internal::walk_permanents(state.globals(), {}, 0, [&](const sol::object& object, const std::string& path) {
+        return names.emplace(object.pointer(), path).second;
+    });
+
+    return names;
+}
+
+void lua::persist::add_permanent_names(PermanentNames& names, const sol::object& root, const std::string& path)
+{
+    if(!internal::is_reference(root.get_type()) || !names.emplace(root.pointer(), path).second) {
+        return;
+    }
+
+    if(root.get_type() == sol::type::table) {
+        internal::walk_permanents(root.as<sol::table>(), path, 0, [&](const sol::object& object, const std::string& child) {
+            return names.emplace(object.pointer(), child).second;
+        });
+    }
+}
+
+void lua::persist::permanent_values(sol::state_view state, sol::table& values)
+{
+    std::unordered_set<const void*> seen { state.globals().pointer() };
+
+    values["_G"] = state.globals();
+
+    internal::walk_permanents(state.globals(), {}, 0, [&](const sol::object& object, const std::string& path) {
+        if(!seen.insert(object.pointer()).second) {
+            return false;
+        }
+
+        values[path] = object;
+        return true;
+    });
+}
+
+void lua::persist::add_permanent_values(sol::table& values, const sol::object& root, const std::string& path)
+{
+    if(!internal::is_reference(root.get_type())) {
+        return;
+    }
+
+    values.raw_set(path, root);
+
+    // every path is kept, not only the first one to an object: the imaging side may have reached it another way
+    if(root.get_type() == sol::type::table) {
+        internal::walk_permanents(root.as<sol::table>(), path, 0, [&](const sol::object& object, const std::string& child) {
+            values.raw_set(child, object);
+            return true;
+        });
+    }
+}
+
+Expected<std::string, errors::Error> lua::persist::dump_instance(const sol::table& instance, const PermanentNames& permanents, const std::unordered_set<const void*>& foreign)
+{
+    internal::ImageWriter writer(permanents, foreign);
+    writer.buffer().append(internal::ImageMagic, sizeof(internal::ImageMagic));
+
+    auto result = writer.value(instance, 0);
+    if(!result) {
+        return result.error();
+    }
+
+    return std::move(writer.buffer());
+}
+
+Expected<sol::table, errors::Error> lua::persist::restore_instance(sol::state_view state, std::string_view blob, const sol::table& permanents)
+{
+    internal::ImageReader reader(state, blob, permanents);
+
+    if(!reader.match(internal::ImageMagic, sizeof(internal::ImageMagic))) {
+        return errors::Error("Heap image has an unknown format");
+    }
+
+    auto instance = reader.value(0);
+    if(!instance) {
+        return instance.error();
+    }
+
+    if(!reader.finished() || instance.value().get_type() != sol::type::table) {
+        return errors::Error("Heap image does not hold a command instance");
+    }
+
+    return instance.value().as<sol::table>();
+}
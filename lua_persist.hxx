@@ -0,0 +1,44 @@
+#pragma once
+
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <unordered_set>
+
+#include <sol/sol.hpp>
+
+#include "error.hxx"
+#include "expected.hxx"
+
+namespace lua::persist {
+
+// serializes the data of every command instance and the globals the scripts defined: booleans, numbers, strings
+// and tables made of them. functions, userdata and metatables are skipped, they are recreated by the command
+// initializers on restore
+Expected<std::string, errors::Error> dump_commands(const sol::table& commands, const sol::table& scriptGlobals);
+
+// merges a blob made by dump_commands into freshly initialized command instances and sets the script globals
+// again, commands missing from the current set are dropped
+ExpectedErr<> restore_commands(const sol::table& commands, const sol::table& globals, std::string_view blob);
+
+// tables, functions and userdata the globals of a state lead to, by dotted path. states built alike have the same ones,
+// heap images refer to them by name instead of copying them
+using PermanentNames = std::unordered_map<const void*, std::string>;
+
+PermanentNames permanent_names(sol::state_view state);
+
+// adds a value and what it leads to under `path`, for values outside the globals such as required modules
+void add_permanent_names(PermanentNames& names, const sol::object& root, const std::string& path);
+
+// fills `values` with path -> value, what restore_instance resolves names through
+void permanent_values(sol::state_view state, sol::table& values);
+void add_permanent_values(sol::table& values, const sol::object& root, const std::string& path);
+
+// heap image of a freshly initialized command: tables with their metatables and Lua closures with their upvalues,
+// shared upvalues stay shared. reaching a thread, a foreign userdata, a native function outside the permanents
+// or anything in `foreign` fails the dump
+Expected<std::string, errors::Error> dump_instance(const sol::table& instance, const PermanentNames& permanents, const std::unordered_set<const void*>& foreign);
+
+Expected<sol::table, errors::Error> restore_instance(sol::state_view state, std::string_view blob, const sol::table& permanents);
+
+}
@@ -0,0 +1,209 @@
+#include "lua_pool.hxx"
+
+#include "logdef.hxx"
+
+lua::StatePool::StatePool(SharedBytecode bytecode, std::size_t capacity, const StateOptions& options)
+    : _bytecode(std::move(bytecode)), _capacity(capacity), _options(options)
+{
+    _filler = std::jthread([this](const std::stop_token& token) {
+        filler_func(token);
+    });
+}
+
+lua::StatePool::~StatePool()
+{
+    _filler.request_stop();
+    _condition.notify_all();
+
+    if(_filler.joinable()) {
+        _filler.join();
+    }
+}
+
+Expected<lua::CommandBox*, errors::Error> lua::StatePool::acquire()
+{
+    SharedBytecode bytecode;
+    SharedImage image;
+    std::uint64_t generation;
+
+    {
+        std::unique_lock lock(_mutex);
+
+        if(!_ready.empty()) {
+            auto box = std::move(_ready.front());
+            _ready.pop_front();
+
+            lock.unlock();
+            _condition.notify_one();
+
+            return box.release();
+        }
+
+        bytecode = _bytecode;
+        generation = _generation;
+
+        if(_imageGeneration == generation) {
+            image = _image;
+        }
+    }
+
+    _condition.notify_one();
+
+    auto created = image ? make_state_from_image(image, _options) : make_state_from_cached_bytecode(bytecode, _options);
+
+    if(created) {
+        created.value()->set_generation(generation);
+    }
+
+    return created;
+}
+
+void lua::StatePool::release(std::unique_ptr<CommandBox> box)
+{
+    if(!box) {
+        return;
+    }
+
+    {
+        std::unique_lock lock(_mutex);
+
+        if(_ready.size() + _recycled.size() >= _capacity) {
+            return;
+        }
+
+        _recycled.push_back(std::move(box));
+    }
+
+    _condition.notify_one();
+}
+
+void lua::StatePool::reload(SharedBytecode bytecode)
+{
+    {
+        std::unique_lock lock(_mutex);
+
+        _bytecode = std::move(bytecode);
+        _generation++;
+
+        // a reset is much cheaper than building a state, the prewarmed ones are upgraded instead of dropped
+        for(auto& box : _ready) {
+            _recycled.push_back(std::move(box));
+        }
+
+        _ready.clear();
+    }
+
+    _condition.notify_one();
+}
+
+std::uint64_t lua::StatePool::generation() const
+{
+    return _generation;
+}
+
+std::size_t lua::StatePool::ready() const
+{
+    std::unique_lock lock(_mutex);
+    return _ready.size();
+}
+
+void lua::StatePool::filler_func(const std::stop_token& token)
+{
+    // script version the filler gave up on, it sleeps until a reload brings another one
+    std::optional<std::uint64_t> failedGeneration;
+
+    while(!token.stop_requested()) {
+        std::unique_ptr<CommandBox> box;
+        SharedBytecode bytecode;
+        std::uint64_t generation;
+
+        {
+            std::unique_lock lock(_mutex);
+            _condition.wait(lock, token, [this, &failedGeneration] {
+                return _generation != failedGeneration && (!_recycled.empty() || _ready.size() < _capacity);
+            });
+
+            if(token.stop_requested()) {
+                break;
+            }
+
+            if(!_recycled.empty()) {
+                box = std::move(_recycled.front());
+                _recycled.pop_front();
+            }
+
+            bytecode = _bytecode;
+            generation = _generation;
+        }
+
+        auto image = image_of(bytecode, generation);
+
+        if(box) {
+            auto reset = image ? reset_state(*box, image, _options.budget) : reset_state(*box, bytecode, _options.budget);
+
+            if(!reset) {
+                luabot_logWarn("Unable to reset a recycled Lua state, dropping it: {}", reset.error().message());
+                continue;
+            }
+        } else {
+            auto created = image ? make_state_from_image(image, _options) : make_state_from_cached_bytecode(bytecode, _options);
+
+            if(!created) {
+                // the bytecode itself is broken, sessions will report it on acquire, no point to spin here
+                luabot_logErr("Unable to prewarm a Lua state, waiting for the next reload: {}", created.error().message());
+                failedGeneration = generation;
+                continue;
+            }
+
+            box.reset(created.value());
+        }
+
+        box->set_generation(generation);
+
+        std::unique_lock lock(_mutex);
+
+        // scripts were reloaded while this one was built, it goes around once more
+        if(generation != _generation) {
+            _recycled.push_back(std::move(box));
+            continue;
+        }
+
+        if(_ready.size() < _capacity) {
+            _ready.push_back(std::move(box));
+        }
+    }
+}
+
+lua::SharedImage lua::StatePool::image_of(const SharedBytecode& bytecode, std::uint64_t generation)
+{
+    {
+        std::unique_lock lock(_mutex);
+
+        if(_imageGeneration == generation) {
+            return _image;
+        }
+    }
+
+    SharedImage image;
+
+    if(_options.image) {
+        auto captured = capture_image(bytecode, _options);
+
+        if(captured) {
+            image = captured.value();
+            luabot_logInfo("Command states are restored from a heap image of {} commands", image->instances.size());
+        } else {
+            luabot_logInfo("Command states are built from bytecode, scripts can not be imaged: {}", captured.error().message());
+        }
+    }
+
+    std::unique_lock lock(_mutex);
+
+    // a reload in the meantime makes this one stale, the next round captures the new scripts
+    if(generation == _generation) {
+        _image = image;
+        _imageGeneration = generation;
+    }
+
+    return image;
+}
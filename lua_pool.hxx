@@ -0,0 +1,68 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <thread>
+
+#include "lua_load.hxx"
+
+namespace lua {
+
+constexpr std::size_t DefaultPrewarmedStates = 16;
+
+// keeps a number of fully initialized command states ready, so a new chat does not pay for
+// opening libraries and running every initializer before its first message
+class StatePool final : public StateSource
+{
+public:
+    StatePool(SharedBytecode bytecode, std::size_t capacity = DefaultPrewarmedStates, const StateOptions& options = {});
+    ~StatePool();
+
+    StatePool(const StatePool&) = delete;
+    StatePool& operator=(const StatePool&) = delete;
+
+    // takes a prewarmed state, or builds one in place when the pool is drained
+    Expected<CommandBox*, errors::Error> acquire() override;
+
+    // hands a state back, it is reset on the filler thread before anyone can take it again
+    void release(std::unique_ptr<CommandBox> box) override;
+
+    // states handed out from now on run the new scripts. prewarmed states are reset with them on the filler thread,
+    // states given back later are upgraded by the same reset
+    void reload(SharedBytecode bytecode);
+
+    std::uint64_t generation() const override;
+
+    std::size_t ready() const;
+
+private:
+    void filler_func(const std::stop_token& token);
+
+    // the image of the current scripts, captured once per generation on the filler thread
+    SharedImage image_of(const SharedBytecode& bytecode, std::uint64_t generation);
+
+    // written under the mutex, the generation is also read without it by sessions checking for a reload
+    SharedBytecode _bytecode;
+    std::atomic<std::uint64_t> _generation { 0 };
+
+    // nullptr while not captured yet or when the scripts can not be imaged, states are built from bytecode then
+    SharedImage _image;
+    std::optional<std::uint64_t> _imageGeneration;
+
+    std::size_t _capacity;
+    StateOptions _options;
+
+    mutable std::mutex _mutex;
+    std::condition_variable_any _condition;
+
+    std::deque<std::unique_ptr<CommandBox>> _ready;
+    std::deque<std::unique_ptr<CommandBox>> _recycled;
+
+    std::jthread _filler;
+};
+
+}
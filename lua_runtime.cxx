@@ -0,0 +1,109 @@
+#include "lua_runtime.hxx"
+
+#if defined(LUABOT_LUAJIT)
+#include <luajit.h>
+#endif
+
+namespace lua::runtime::internal {
+
+// registry entry of a function returning a closure whose only upvalue holds the given value
+constexpr const char* EnvironmentHolder = "luabot.environment_holder";
+
+int append_chunk(lua_State*, const void* data, std::size_t size, void* target)
+{
+    static_cast<std::string*>(target)->append(static_cast<const char*>(data), size);
+    return 0;
+}
+
+}
+
+std::string_view lua::runtime::name()
+{
+#if defined(LUABOT_LUAJIT)
+    return LUAJIT_VERSION;
+#else
+    return LUA_RELEASE;
+#endif
+}
+
+Expected<std::string, errors::Error> lua::runtime::dump(const sol::function& function)
+{
+    auto L = function.lua_state();
+    std::string bytecode;
+
+    function.push();
+
+#if LUA_VERSION_NUM >= 503
+    // debug info stays, error messages of commands point at their source lines
+    auto status = lua_dump(L, &internal::append_chunk, &bytecode, 0);
+#else
+    auto status = lua_dump(L, &internal::append_chunk, &bytecode);
+#endif
+
+    lua_pop(L, 1);
+
+    if(status != 0 || bytecode.empty()) {
+        return errors::Error("Unable to dump a function to bytecode");
+    }
+
+    return bytecode;
+}
+
+void lua::runtime::bind_environment(const sol::protected_function& chunk, const sol::table& environment)
+{
+    auto L = chunk.lua_state();
+
+#if defined(LUABOT_LUAJIT)
+    chunk.push();
+    environment.push();
+    lua_setfenv(L, -2);
+    lua_pop(L, 1);
+#else
+    sol::state_view lua(L);
+    sol::object maker = lua.registry()[internal::EnvironmentHolder];
+
+    if(maker.get_type() != sol::type::function) {
+        maker = lua.load("local environment = ... return function() return environment end", "=environment").get<sol::function>();
+        lua.registry()[internal::EnvironmentHolder] = maker;
+    }
+
+    sol::function holder = maker.as<sol::function>()(environment);
+
+    // upvalue 1 of a main chunk is always its _ENV
+    chunk.push();
+    holder.push();
+    lua_upvaluejoin(L, -2, 1, -1, 1);
+    lua_pop(L, 2);
+#endif
+}
+
+void lua::runtime::set_jit(sol::state_view state, bool enabled)
+{
+#if defined(LUABOT_LUAJIT)
+    luaJIT_setmode(state.lua_state(), 0, LUAJIT_MODE_ENGINE | (enabled ? LUAJIT_MODE_ON : LUAJIT_MODE_OFF));
+#else
+    (void)state;
+    (void)enabled;
+#endif
+}
+
+void lua::runtime::set_incremental_gc(sol::state_view state, int pause, int stepMultiplier)
+{
+#if LUA_VERSION_NUM >= 504
+    lua_gc(state.lua_state(), LUA_GCINC, pause, stepMultiplier, 0);
+#else
+    lua_gc(state.lua_state(), LUA_GCSETPAUSE, pause);
+    lua_gc(state.lua_state(), LUA_GCSETSTEPMUL, stepMultiplier);
+#endif
+}
+
+bool lua::runtime::set_generational_gc(sol::state_view state)
+{
+#if LUA_VERSION_NUM >= 504
+    lua_gc(state.lua_state(), LUA_GCGEN, 0, 0);
+    return true;
+#else
+    (void)state;
+    return false;
+#endif
+}
@@ -0,0 +1,46 @@
+#pragma once
+
+#include <string>
+#include <string_view>
+
+#include <sol/sol.hpp>
+
+#include "error.hxx"
+#include "expected.hxx"
+
+// the bot builds against LuaJIT (LUABOT_LUAJIT) or PUC Lua 5.4 (LUABOT_PUC_LUA), see LuaRuntime in the project file.
+// everything that differs between the two goes through here, the rest of the code only talks to sol
+namespace lua::runtime {
+
+#if defined(LUABOT_LUAJIT)
+constexpr bool HasJit = true;
+#else
+constexpr bool HasJit = false;
+#endif
+
+// PUC Lua only, LuaJIT has the incremental collector alone
+constexpr bool HasGenerationalGc = !HasJit;
+
+// LuaJIT keeps an environment per function and closures take it from the function creating them. in 5.4 it is
+// the _ENV upvalue, shared by every closure of a loaded chunk, and threads have no environment at all
+constexpr bool HasFunctionEnvironments = HasJit;
+
+// e.g. "LuaJIT 2.1.0-beta3" or "Lua 5.4.6"
+std::string_view name();
+
+// precompiled chunk of the function, loadable by the same runtime only: the two bytecode formats are unrelated
+Expected<std::string, errors::Error> dump(const sol::function& function);
+
+// runs a loaded chunk against the environment from now on, closures it made before keep the one they were made with.
+// 5.4 gets a fresh _ENV upvalue joined in, setting the value of the old one would move every closure sharing it
+void bind_environment(const sol::protected_function& chunk, const sol::table& environment);
+
+// switches the JIT compiler of the whole state, a no-op without one
+void set_jit(sol::state_view state, bool enabled);
+
+void set_incremental_gc(sol::state_view state, int pause, int stepMultiplier);
+
+// false when the runtime has no generational mode, the collector stays incremental then
+bool set_generational_gc(sol::state_view state);
+
+}
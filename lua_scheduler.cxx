@@ -0,0 +1,315 @@
+#include "lua_scheduler.hxx"
+
+#include <algorithm>
+#include <ranges>
+
+#include "lua_api_functions.hxx"
+
+#include "logdef.hxx"
+
+namespace lua::internal {
+
+using api::types::routines::CoroutinePolicy;
+using api::types::routines::CoroutineStep;
+using api::types::routines::InputKind;
+using api::types::routines::InputRequest;
+using api::types::routines::SleepRequest;
+
+}
+
+lua::CoroutineScheduler::CoroutineScheduler(TimerRequest requestTimer, const BudgetSettings& budget)
+    : _requestTimer(std::move(requestTimer)), _budget(budget)
+{
+}
+
+lua::CoroutineScheduler::Coroutine lua::CoroutineScheduler::make_coroutine(const sol::function& func, internal::CoroutinePolicy policy)
+{
+    if(_threads.empty()) {
+        return api::functions::make_coroutine(func, policy);
+    }
+
+    auto thread = std::move(_threads.back());
+    _threads.pop_back();
+
+    return api::functions::make_coroutine_on(std::move(thread), func, policy);
+}
+
+void lua::CoroutineScheduler::spawn(const std::string& owner, Coroutine coroutine)
+{
+    if(!claim(coroutine, owner)) {
+        return;
+    }
+
+    Task task { owner, std::move(coroutine) };
+
+    switch(task.coroutine.policy) {
+    case internal::CoroutinePolicy::SyncExecute: {
+        task.tracked = false;
+
+        // steps run back to back, but a preempted coroutine goes to the ready queue like any other
+        auto outcome = resume(task);
+        while(outcome == Outcome::Ready) {
+            outcome = resume(task);
+        }
+
+        place(std::move(task), outcome);
+        return;
+    }
+    case internal::CoroutinePolicy::RejectNext:
+        if(_active.contains(owner)) {
+            luabot_logInfo("Command {} already runs a coroutine, the new one is rejected", owner);
+            recycle(std::move(task.coroutine));
+            return;
+        }
+        break;
+    case internal::CoroutinePolicy::EnqueueNext:
+        if(_active.contains(owner)) {
+            _queued[owner].push_back(std::move(task));
+            return;
+        }
+        break;
+    }
+
+    _active.insert(owner);
+    _ready.push_back(std::move(task));
+}
+
+void lua::CoroutineScheduler::run_ready()
+{
+    // coroutines stepping again go behind the current round, they run on the next call
+    for(auto count = _ready.size(); count > 0 && !_ready.empty(); count--) {
+        auto task = std::move(_ready.front());
+        _ready.pop_front();
+
+        auto outcome = resume(task);
+        place(std::move(task), outcome);
+    }
+}
+
+void lua::CoroutineScheduler::spawn_after(std::chrono::milliseconds delay, Coroutine coroutine)
+{
+    if(!claim(coroutine, {})) {
+        return;
+    }
+
+    Task task { {}, std::move(coroutine) };
+    task.tracked = false;
+
+    sleep(std::move(task), delay);
+}
+
+void lua::CoroutineScheduler::notify_input()
+{
+    for(auto& task : _waiting) {
+        _ready.push_back(std::move(task));
+    }
+
+    _waiting.clear();
+}
+
+void lua::CoroutineScheduler::notify_timer(std::uint64_t timer)
+{
+    // timers of coroutines dropped by clear still fire, there is nothing left to wake for them
+    auto sleeping = _sleeping.find(timer);
+
+    if(sleeping != _sleeping.end()) {
+        _ready.push_back(std::move(sleeping->second));
+        _sleeping.erase(sleeping);
+        return;
+    }
+
+    // an input wait timed out, the coroutine sees nil instead of the input
+    auto awaiting = std::ranges::find(_awaiting, std::optional { timer }, &Task::timer);
+
+    if(awaiting != _awaiting.end()) {
+        auto task = std::move(*awaiting);
+        _awaiting.erase(awaiting);
+
+        auto outcome = resume(task, sol::lua_nil);
+        place(std::move(task), outcome);
+    }
+}
+
+bool lua::CoroutineScheduler::deliver(api::types::routines::InputKind kind, std::string_view input, std::optional<std::string_view> owner)
+{
+    auto awaiting = std::ranges::find_if(_awaiting, [kind, owner](const Task& task) {
+        return task.awaited == kind && (!owner || task.owner == owner.value());
+    });
+
+    if(awaiting == _awaiting.end()) {
+        return false;
+    }
+
+    auto task = std::move(*awaiting);
+    _awaiting.erase(awaiting);
+
+    auto outcome = resume(task, input);
+    place(std::move(task), outcome);
+
+    return true;
+}
+
+bool lua::CoroutineScheduler::has_ready() const
+{
+    return !_ready.empty();
+}
+
+bool lua::CoroutineScheduler::empty() const
+{
+    return size() == 0;
+}
+
+std::size_t lua::CoroutineScheduler::size() const
+{
+    auto result = _ready.size() + _waiting.size() + _sleeping.size() + _awaiting.size();
+
+    for(const auto& queue : _queued | std::views::values) {
+        result += queue.size();
+    }
+
+    return result;
+}
+
+void lua::CoroutineScheduler::clear()
+{
+    _ready.clear();
+    _waiting.clear();
+    _sleeping.clear();
+    _awaiting.clear();
+    _queued.clear();
+    _active.clear();
+}
+
+void lua::CoroutineScheduler::drop_threads()
+{
+    _threads.clear();
+}
+
+lua::CoroutineScheduler::Outcome lua::CoroutineScheduler::outcome_of(Task& task, const sol::protected_function_result& result)
+{
+    if(!result.valid()) {
+        sol::error err = result;
+        luabot_logErr("Coroutine of command {} failed: {}", task.owner, err.what());
+        return Outcome::Finished;
+    }
+
+    // returned instead of yielding, whatever the value is the coroutine is over
+    if(!task.coroutine.coroutine.runnable()) {
+        return Outcome::Finished;
+    }
+
+    sol::object yielded = result;
+
+    if(yielded.is<internal::SleepRequest>()) {
+        task.delay = yielded.as<internal::SleepRequest>().delay;
+        return Outcome::Sleeping;
+    }
+
+    if(yielded.is<internal::InputRequest>()) {
+        auto request = yielded.as<internal::InputRequest>();
+
+        task.awaited = request.kind;
+        task.delay = request.timeout;
+        return Outcome::Awaiting;
+    }
+
+    if(!yielded.is<internal::CoroutineStep>()) {
+        luabot_logErr("Coroutine of command {} yielded an unsupported value", task.owner);
+        return Outcome::Finished;
+    }
+
+    switch(yielded.as<internal::CoroutineStep>()) {
+    case internal::CoroutineStep::Step:
+        return Outcome::Ready;
+    case internal::CoroutineStep::Wait:
+        return Outcome::Waiting;
+    default:
+        return Outcome::Finished;
+    }
+}
+
+void lua::CoroutineScheduler::place(Task&& task, Outcome outcome)
+{
+    switch(outcome) {
+    case Outcome::Ready:
+    case Outcome::Preempted:
+        _ready.push_back(std::move(task));
+        break;
+    case Outcome::Waiting:
+        _waiting.push_back(std::move(task));
+        break;
+    case Outcome::Sleeping: {
+        auto delay = task.delay;
+        sleep(std::move(task), delay);
+        break;
+    }
+    case Outcome::Awaiting:
+        task.timer.reset();
+
+        if(task.delay.count() > 0) {
+            task.timer = _nextTimer++;
+            _requestTimer(task.timer.value(), task.delay);
+        }
+
+        _awaiting.push_back(std::move(task));
+        break;
+    case Outcome::Finished:
+        finish(task);
+        recycle(std::move(task.coroutine));
+        break;
+    }
+}
+
+void lua::CoroutineScheduler::finish(const Task& task)
+{
+    if(!task.tracked) {
+        return;
+    }
+
+    auto queued = _queued.find(task.owner);
+
+    if(queued == _queued.end() || queued->second.empty()) {
+        _active.erase(task.owner);
+        return;
+    }
+
+    // the slot of the command goes straight to the next queued coroutine
+    _ready.push_back(std::move(queued->second.front()));
+    queued->second.pop_front();
+
+    if(queued->second.empty()) {
+        _queued.erase(queued);
+    }
+}
+
+bool lua::CoroutineScheduler::claim(const Coroutine& coroutine, const std::string& owner)
+{
+    if(*coroutine.started) {
+        luabot_logErr("Coroutine of command {} was already started, it can not run twice", owner);
+        return false;
+    }
+
+    *coroutine.started = true;
+    return true;
+}
+
+void lua::CoroutineScheduler::recycle(Coroutine&& coroutine)
+{
+    auto thread = coroutine.thread.thread_state();
+
+    // only a thread whose function returned is clean, an error or a pending yield leave it unusable
+    if(_threads.size() >= PooledThreads || lua_status(thread) != 0) {
+        return;
+    }
+
+    lua_settop(thread, 0);
+    _threads.push_back(std::move(coroutine.thread));
+}
+
+void lua::CoroutineScheduler::sleep(Task&& task, std::chrono::milliseconds delay)
+{
+    auto timer = _nextTimer++;
+
+    _sleeping.emplace(timer, std::move(task));
+    _requestTimer(timer, delay);
+}
@@ -0,0 +1,142 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include <sol/sol.hpp>
+
+#include "lua_api_types.hxx"
+#include "lua_budget.hxx"
+
+namespace lua {
+
+// coroutines of one session. ready coroutines are resumed once per run_ready, coroutines waiting for input
+// or sleeping are not touched at all until notify_input / notify_timer, so a session with only parked coroutines costs nothing
+class CoroutineScheduler
+{
+public:
+    using Coroutine = api::types::routines::Coroutine;
+
+    // asks the owner to call notify_timer with the given id once the delay has passed
+    using TimerRequest = std::function<void(std::uint64_t timer, std::chrono::milliseconds delay)>;
+
+    CoroutineScheduler(TimerRequest requestTimer, const BudgetSettings& budget);
+
+    // MakeCoroutine of the session, runs the function on a thread left by a finished coroutine when there is one
+    Coroutine make_coroutine(const sol::function& func, api::types::routines::CoroutinePolicy policy);
+
+    // takes a coroutine returned by a handler of the given command and applies its policy:
+    // EnqueueNext waits for the running coroutine of the command, RejectNext is dropped if there is one,
+    // SyncExecute runs right away until it finishes or parks
+    void spawn(const std::string& owner, Coroutine coroutine);
+
+    // resumes every coroutine that was ready when called exactly once
+    void run_ready();
+
+    // starts the coroutine once the delay has passed, outside of any command policy
+    void spawn_after(std::chrono::milliseconds delay, Coroutine coroutine);
+
+    // the chat got new input, parked coroutines become ready again
+    void notify_input();
+    void notify_timer(std::uint64_t timer);
+
+    // resumes the oldest coroutine waiting for this kind of input with it, false when nobody waits.
+    // with an owner only coroutines of that command are considered
+    bool deliver(api::types::routines::InputKind kind, std::string_view input, std::optional<std::string_view> owner = std::nullopt);
+
+    bool has_ready() const;
+    bool empty() const;
+    std::size_t size() const;
+
+    void clear();
+
+    // the pooled threads belong to the current state, they must go before the session gives it back
+    void drop_threads();
+
+private:
+    // finished threads kept for reuse, more than that are left to the collector
+    static constexpr std::size_t PooledThreads = 16;
+
+    enum class Outcome
+    {
+        Ready,
+        // used up its instruction slice, resumed again in the next round
+        Preempted,
+        Waiting,
+        Sleeping,
+        Awaiting,
+        Finished
+    };
+
+    struct Task
+    {
+        std::string owner;
+        Coroutine coroutine;
+
+        // holds the slot of its command, SyncExecute coroutines never do
+        bool tracked { true };
+
+        // set by resume from what the coroutine yielded
+        std::chrono::milliseconds delay { 0 };
+        api::types::routines::InputKind awaited { api::types::routines::InputKind::Message };
+
+        // timeout of an input wait
+        std::optional<std::uint64_t> timer;
+    };
+
+    template<typename... Args>
+    Outcome resume(Task& task, Args&&... args);
+
+    Outcome outcome_of(Task& task, const sol::protected_function_result& result);
+
+    void place(Task&& task, Outcome outcome);
+    void finish(const Task& task);
+    void sleep(Task&& task, std::chrono::milliseconds delay);
+
+    // false for a coroutine that was started before, a script may return the same one twice
+    bool claim(const Coroutine& coroutine, const std::string& owner);
+    void recycle(Coroutine&& coroutine);
+
+    TimerRequest _requestTimer;
+    const BudgetSettings& _budget;
+
+    std::deque<Task> _ready;
+    std::vector<Task> _waiting;
+
+    std::unordered_map<std::uint64_t, Task> _sleeping;
+    std::uint64_t _nextTimer { 0 };
+
+    // in the order they started waiting, input goes to the oldest one
+    std::deque<Task> _awaiting;
+
+    // EnqueueNext coroutines waiting for the running one of their command
+    std::unordered_map<std::string, std::deque<Task>> _queued;
+
+    // commands with a coroutine running
+    std::unordered_set<std::string> _active;
+
+    std::vector<sol::thread> _threads;
+};
+
+template<typename... Args>
+CoroutineScheduler::Outcome CoroutineScheduler::resume(Task& task, Args&&... args)
+{
+    BudgetScope budget(_budget, task.coroutine.thread.thread_state());
+    auto result = task.coroutine(std::forward<Args>(args)...);
+
+    if(budget.preempted() && result.valid()) {
+        return Outcome::Preempted;
+    }
+
+    return outcome_of(task, result);
+}
+
+}
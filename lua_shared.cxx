@@ -0,0 +1,166 @@
+#include "lua_shared.hxx"
+
+#include <ranges>
+#include <unordered_set>
+#include <vector>
+
+#include "lua_api.hxx"
+#include "lua_runtime.hxx"
+
+namespace lua::internal {
+
+Expected<SharedChunks, errors::Error> load_chunks(sol::state& state, const BytecodeMap& bytecode_map)
+{
+    auto chunks = std::make_shared<std::unordered_map<std::string, sol::protected_function>>();
+    chunks->reserve(bytecode_map.size());
+
+    for(const auto& [name, bytecode] : bytecode_map) {
+        if(is_module_key(name)) {
+            continue;
+        }
+
+        sol::load_result chunk = state.load(bytecode);
+        if(!chunk.valid()) {
+            sol::error err = chunk;
+            return errors::Error("Unable to load bytecode from command [" + name + "]: " + err.what());
+        }
+
+        chunks->emplace(name, chunk.get<sol::protected_function>());
+    }
+
+    return SharedChunks(std::move(chunks));
+}
+
+// builds the commands of one chat from the shared chunks. the environment is looked up by key on every build,
+// captured it would be held from the registry by its own commands table and never be collected
+CommandBuilder environment_builder(sol::table environments, std::int64_t key, SharedChunks chunks)
+{
+    // like in isolated states a command is built once, a failed or recursive build reads as nil
+    auto pending = std::make_shared<std::unordered_set<std::string_view>>();
+
+    for(const auto& name : *chunks | std::views::keys) {
+        pending->insert(name);
+    }
+
+    return [environments, key, chunks, pending](sol::state_view caller, const std::string& name) -> Expected<sol::object> {
+        auto chunk = chunks->find(name);
+        sol::object environment = environments.raw_get<sol::object>(key);
+
+        if(chunk == chunks->end() || !pending->erase(name) || environment.get_type() != sol::type::table) {
+            return sol::make_object(caller, sol::lua_nil);
+        }
+
+        // closures made by the chunk keep the environment, so the instance and all of its functions are bound to this chat
+        runtime::bind_environment(chunk->second, environment.as<sol::table>());
+        auto instance = instantiate_command(chunk->second, name);
+
+        // the chunk would keep the last chat it built for alive otherwise
+        runtime::bind_environment(chunk->second, sol::table(caller.globals()));
+
+        if(!instance) {
+            return instance.error();
+        }
+
+        return sol::object(instance.value());
+    };
+}
+
+}
+
+lua::SharedState::SharedState(sol::state&& state, SharedBytecode bytecode, SharedChunks chunks, const BudgetSettings& budget)
+    : _state(std::move(state)), _bytecode(std::move(bytecode)), _chunks(std::move(chunks)), _budget(budget)
+{
+    _environments = _state.create_table();
+    _environments[sol::metatable_key] = _state.create_table_with("__mode", "v");
+}
+
+Expected<lua::CommandBox*, errors::Error> lua::SharedState::acquire()
+{
+    // reads fall through to the shared globals, writes stay in the chat environment
+    sol::environment environment(_state, sol::create, _state.globals());
+
+    auto key = _nextEnvironment++;
+    _environments.raw_set(key, environment);
+
+    // a chat starts with an empty table and only pays for the commands it uses
+    auto commands = make_lazy_commands(_state, internal::environment_builder(_environments, key, _chunks), _budget);
+    environment["commands"] = commands;
+
+    std::vector<std::string> names;
+    names.reserve(_chunks->size());
+
+    for(const auto& name : *_chunks | std::views::keys) {
+        names.push_back(name);
+    }
+
+    for(const auto& name : _bytecode->eager) {
+        commands.get<sol::object>(name);
+    }
+
+    auto thread = sol::thread::create(_state);
+
+    // threads have no environment of their own on 5.4, the closures of the commands already carry it
+    if constexpr(runtime::HasFunctionEnvironments) {
+        sol::set_environment(environment, thread);
+    }
+
+    auto box = new CommandBox(_state, std::move(environment), std::move(thread), std::move(commands));
+    box->set_generation(_generation);
+    box->set_command_names(std::move(names));
+
+    return box;
+}
+
+void lua::SharedState::release(std::unique_ptr<CommandBox> box)
+{
+    box.reset();
+
+    // the chat environment is garbage now, collect a bit of it instead of waiting for the next full cycle.
+    // a verification pass may release thousands of chats in a row, a full collection each would stall the group
+    _state.step_gc(0);
+}
+
+ExpectedErr<> lua::SharedState::reload(const SharedBytecode& bytecode)
+{
+    auto chunks = internal::load_chunks(_state, bytecode->bytecode);
+    if(!chunks) {
+        return chunks.error();
+    }
+
+    // modules are shared by every chat of the state, like the globals they run against
+    install_require(_state, bytecode, _budget);
+
+    _bytecode = bytecode;
+    _chunks = std::move(chunks.value());
+    _generation++;
+
+    return std::monostate {};
+}
+
+std::uint64_t lua::SharedState::generation() const
+{
+    return _generation;
+}
+
+Expected<lua::SharedState*, errors::Error> lua::make_shared_state(const SharedBytecode& bytecode, const StateOptions& options)
+{
+    sol::state state;
+    state.open_libraries(sol::lib::base);
+    api::register_api(state);
+
+    configure_gc(state, options.gc);
+    runtime::set_jit(state, options.jit);
+
+    if(options.budget.enabled()) {
+        install_budget_hook(state);
+    }
+
+    auto chunks = internal::load_chunks(state, bytecode->bytecode);
+    if(!chunks) {
+        return chunks.error();
+    }
+
+    install_require(state, bytecode, options.budget);
+
+    return new SharedState(std::move(state), bytecode, chunks.value(), options.budget);
+}
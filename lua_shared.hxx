@@ -0,0 +1,48 @@
+#pragma once
+
+#include <memory>
+#include <string>
+#include <unordered_map>
+
+#include "lua_load.hxx"
+
+namespace lua {
+
+// command name -> loaded chunk of one script version. chats built from it hold on to it across reloads
+using SharedChunks = std::shared_ptr<const std::unordered_map<std::string, sol::protected_function>>;
+
+// one interpreter serving many chats: command chunks are loaded once, every chat gets an environment, a thread
+// and the commands it uses, built on first lookup. not thread safe, all chats of a shared state must run on the same strand
+class SharedState final : public StateSource
+{
+public:
+    SharedState(sol::state&& state, SharedBytecode bytecode, SharedChunks chunks, const BudgetSettings& budget);
+
+    SharedState(const SharedState&) = delete;
+    SharedState& operator=(const SharedState&) = delete;
+
+    Expected<CommandBox*, errors::Error> acquire() override;
+    void release(std::unique_ptr<CommandBox> box) override;
+
+    // loads the new chunks next to the old ones, chats still running the old commands keep them alive
+    ExpectedErr<> reload(const SharedBytecode& bytecode);
+
+    std::uint64_t generation() const override;
+
+private:
+    sol::state _state;
+
+    // chat key -> environment, weak: lazy commands find their chat here without keeping it alive
+    sol::table _environments;
+    std::int64_t _nextEnvironment { 0 };
+
+    SharedBytecode _bytecode;
+    SharedChunks _chunks;
+    BudgetSettings _budget;
+
+    std::uint64_t _generation { 0 };
+};
+
+Expected<SharedState*, errors::Error> make_shared_state(const SharedBytecode& bytecode, const StateOptions& options = {});
+
+}
@@ -0,0 +1,170 @@
+#pragma once
+
+#include <atomic>
+#include <concepts>
+#include <cstdint>
+#include <memory>
+
+namespace tg {
+
+template<typename Node>
+concept IntrusiveNode = requires(Node node) {
+    { node.next } -> std::same_as<std::atomic<Node*>&>;
+};
+
+// intrusive multi-producer single-consumer queue (D. Vyukov), producers are wait-free and never allocate
+template<IntrusiveNode Node>
+class Mailbox
+{
+public:
+    Mailbox();
+
+    Mailbox(const Mailbox&) = delete;
+    Mailbox& operator=(const Mailbox&) = delete;
+
+    void push(Node* node) noexcept;
+
+    // consumer only. may return nullptr while a producer is between its two stores, even if the box is not empty
+    Node* pop() noexcept;
+
+private:
+    std::atomic<Node*> _head;
+    Node* _tail;
+    Node _stub;
+};
+
+// fixed slab of nodes with a lock-free free list; falls back to the heap only once the slab is exhausted
+template<IntrusiveNode Node>
+class NodePool
+{
+public:
+    explicit NodePool(std::uint32_t capacity);
+
+    NodePool(const NodePool&) = delete;
+    NodePool& operator=(const NodePool&) = delete;
+
+    Node* acquire();
+    void release(Node* node) noexcept;
+
+private:
+    static constexpr std::uint64_t IndexMask = 0xffffffffull;
+
+    bool owns(const Node* node) const noexcept;
+
+    std::unique_ptr<Node[]> _nodes;
+    std::unique_ptr<std::atomic<std::uint32_t>[]> _nextFree;
+    std::uint32_t _capacity;
+
+    // low half is the 1-based index of the first free slot, high half is a tag bumped on every change against ABA
+    std::atomic<std::uint64_t> _free { 0 };
+};
+
+template<IntrusiveNode Node>
+Mailbox<Node>::Mailbox() : _head(&_stub), _tail(&_stub)
+{
+    _stub.next.store(nullptr, std::memory_order_relaxed);
+}
+
+template<IntrusiveNode Node>
+void Mailbox<Node>::push(Node* node) noexcept
+{
+    node->next.store(nullptr, std::memory_order_relaxed);
+    auto prev = _head.exchange(node, std::memory_order_acq_rel);
+    prev->next.store(node, std::memory_order_release);
+}
+
+template<IntrusiveNode Node>
+Node* Mailbox<Node>::pop() noexcept
+{
+    auto tail = _tail;
+    auto next = tail->next.load(std::memory_order_acquire);
+
+    if(tail == &_stub) {
+        if(!next) {
+            return nullptr;
+        }
+
+        _tail = next;
+        tail = next;
+        next = next->next.load(std::memory_order_acquire);
+    }
+
+    if(next) {
+        _tail = next;
+        return tail;
+    }
+
+    if(tail != _head.load(std::memory_order_acquire)) {
+        return nullptr;
+    }
+
+    push(&_stub);
+    next = tail->next.load(std::memory_order_acquire);
+
+    if(next) {
+        _tail = next;
+        return tail;
+    }
+
+    return nullptr;
+}
+
+template<IntrusiveNode Node>
+NodePool<Node>::NodePool(std::uint32_t capacity)
+    : _nodes(std::make_unique<Node[]>(capacity)), _nextFree(std::make_unique<std::atomic<std::uint32_t>[]>(capacity)), _capacity(capacity)
+{
+    for(std::uint32_t i = 0; i < capacity; i++) {
+        _nextFree[i].store(i + 1 < capacity ? i + 2 : 0, std::memory_order_relaxed);
+    }
+
+    _free.store(capacity > 0 ? 1 : 0, std::memory_order_release);
+}
+
+template<IntrusiveNode Node>
+Node* NodePool<Node>::acquire()
+{
+    auto head = _free.load(std::memory_order_acquire);
+
+    while(true) {
+        auto index = static_cast<std::uint32_t>(head & IndexMask);
+
+        if(index == 0) {
+            return new Node();
+        }
+
+        auto next = _nextFree[index - 1].load(std::memory_order_relaxed);
+        auto replacement = ((head >> 32) + 1) << 32 | next;
+
+        if(_free.compare_exchange_weak(head, replacement, std::memory_order_acquire, std::memory_order_acquire)) {
+            return &_nodes[index - 1];
+        }
+    }
+}
+
+template<IntrusiveNode Node>
+void NodePool<Node>::release(Node* node) noexcept
+{
+    if(!owns(node)) {
+        delete node;
+        return;
+    }
+
+    auto index = static_cast<std::uint32_t>(node - _nodes.get()) + 1;
+    auto head = _free.load(std::memory_order_relaxed);
+
+    do {
+        _nextFree[index - 1].store(static_cast<std::uint32_t>(head & IndexMask), std::memory_order_relaxed);
+    } while(!_free.compare_exchange_weak(head, ((head >> 32) + 1) << 32 | index, std::memory_order_release, std::memory_order_relaxed));
+}
+
+template<IntrusiveNode Node>
+bool NodePool<Node>::owns(const Node* node) const noexcept
+{
+    auto address = reinterpret_cast<std::uintptr_t>(node);
+    auto begin = reinterpret_cast<std::uintptr_t>(_nodes.get());
+    auto end = reinterpret_cast<std::uintptr_t>(_nodes.get() + _capacity);
+
+    return address >= begin && address < end;
+}
+
+}
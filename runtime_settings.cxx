@@ -0,0 +1,153 @@
+#include "runtime_settings.hxx"
+
+#include <algorithm>
+
+#include "logdef.hxx"
+
+#include "thirdparty/json/json.hpp"
+
+Expected<tg::RuntimeSettings, errors::Error> tg::parse_runtime_settings(const std::string& json)
+{
+    RuntimeSettings settings;
+
+    try {
+        auto root = nlohmann::json::parse(json);
+
+        if(root.contains("isolation")) {
+            auto isolation = root["isolation"].get<std::string>();
+
+            if(isolation == "isolated") {
+                settings.isolation = StateIsolation::Isolated;
+            } else if(isolation == "shared") {
+                settings.isolation = StateIsolation::Shared;
+            } else {
+                return errors::Error("Unknown isolation mode: " + isolation);
+            }
+        }
+
+        if(root.contains("updates")) {
+            auto updates = root["updates"].get<std::string>();
+
+            if(updates == "polling") {
+                settings.updates = UpdateSource::Polling;
+            } else if(updates == "webhook") {
+                settings.updates = UpdateSource::Webhook;
+            } else {
+                return errors::Error("Unknown update source: " + updates);
+            }
+        }
+
+        if(root.contains("webhook")) {
+            const auto& webhook = root["webhook"];
+
+            settings.webhook.url = webhook.value("url", settings.webhook.url);
+            settings.webhook.port = webhook.value("port", settings.webhook.port);
+            settings.webhook.path = webhook.value("path", settings.webhook.path);
+            settings.webhook.secret = webhook.value("secret", settings.webhook.secret);
+        }
+
+        if(root.contains("prewarmed_states")) {
+            settings.prewarmedStates = root["prewarmed_states"].get<std::size_t>();
+        }
+
+        auto& admission = settings.admission;
+
+        if(root.contains("chat_queue_limit")) {
+            admission.chatQueueLimit = std::max<std::size_t>(root["chat_queue_limit"].get<std::size_t>(), 1);
+        }
+
+        if(root.contains("overflow")) {
+            auto overflow = root["overflow"].get<std::string>();
+
+            if(overflow == "drop_oldest") {
+                admission.overflow = OverflowPolicy::DropOldest;
+            } else if(overflow == "coalesce") {
+                admission.overflow = OverflowPolicy::Coalesce;
+            } else if(overflow == "reject") {
+                admission.overflow = OverflowPolicy::Reject;
+            } else {
+                return errors::Error("Unknown overflow policy: " + overflow);
+            }
+        }
+
+        if(root.contains("max_in_flight")) {
+            admission.maxInFlight = std::max<std::size_t>(root["max_in_flight"].get<std::size_t>(), 1);
+        }
+
+        if(root.contains("max_update_age")) {
+            admission.maxAge = std::chrono::seconds { root["max_update_age"].get<std::int64_t>() };
+        }
+
+        if(root.contains("memory_limit_mb")) {
+            settings.states.memoryLimit = sizes::megabytes(root["memory_limit_mb"].get<std::size_t>());
+        }
+
+        // chats of a shared state allocate from one interpreter, there is no heap of a chat to cap or count
+        if(settings.isolation == StateIsolation::Shared) {
+            if(root.contains("memory_limit_mb") && settings.states.memoryLimit > 0) {
+                return errors::Error("memory_limit_mb applies to isolated states only, shared states have no per chat cap");
+            }
+
+            settings.states.memoryLimit = 0;
+        }
+
+        if(root.contains("gc")) {
+            const auto& gc = root["gc"];
+            auto& target = settings.states.gc;
+
+            target.generational = gc.value("mode", std::string("incremental")) == "generational";
+            target.pause = gc.value("pause", target.pause);
+            target.stepMultiplier = gc.value("step_multiplier", target.stepMultiplier);
+            target.idleStepKb = gc.value("idle_step_kb", target.idleStepKb);
+        }
+
+        if(root.contains("jit")) {
+            settings.states.jit = root["jit"].get<bool>();
+        }
+
+        if(root.contains("heap_image")) {
+            settings.states.image = root["heap_image"].get<bool>();
+        }
+
+        auto& budget = settings.states.budget;
+
+        if(root.contains("instruction_slice")) {
+            budget.slice = root["instruction_slice"].get<std::uint64_t>();
+        }
+
+        if(root.contains("instruction_cap")) {
+            budget.hardCap = root["instruction_cap"].get<std::uint64_t>();
+        }
+
+        if(budget.enabled() && budget.hardCap < budget.slice) {
+            return errors::Error("instruction_cap must not be lower than instruction_slice");
+        }
+    } catch(const nlohmann::json::exception& e) {
+        return errors::Error("JSON error while reading runtime settings: " + std::string(e.what()));
+    }
+
+    return settings;
+}
+
+tg::RuntimeSettings tg::load_runtime_settings(const files::IFileSystem& project)
+{
+    if(!project->IsFileExists(vfspp::FileInfo(RuntimeSettingsFile))) {
+        return {};
+    }
+
+    auto text = files::read_text(project, RuntimeSettingsFile);
+
+    if(!text) {
+        luabot_logWarn("Unable to read {}, using default runtime settings: {}", RuntimeSettingsFile, text.error().message());
+        return {};
+    }
+
+    auto settings = parse_runtime_settings(text.value());
+
+    if(!settings) {
+        luabot_logErr("Invalid {}, using default runtime settings: {}", RuntimeSettingsFile, settings.error().message());
+        return {};
+    }
+
+    return settings.value();
+}
@@ -0,0 +1,49 @@
+#pragma once
+
+#include <string>
+
+#include "admission.hxx"
+#include "error.hxx"
+#include "expected.hxx"
+#include "lua_pool.hxx"
+#include "webhook_listener.hxx"
+#include "zip2memvfs.hxx"
+
+namespace tg {
+
+constexpr const char* RuntimeSettingsFile = "settings.json";
+
+enum class StateIsolation
+{
+    // every chat owns a whole interpreter
+    Isolated,
+    // chats share one interpreter per executor group and only own an environment in it
+    Shared
+};
+
+enum class UpdateSource
+{
+    Polling,
+    // updates are pushed to an embedded listener, see WebhookListener
+    Webhook
+};
+
+struct RuntimeSettings
+{
+    UpdateSource updates { UpdateSource::Polling };
+    WebhookSettings webhook;
+
+    StateIsolation isolation { StateIsolation::Isolated };
+    std::size_t prewarmedStates { lua::DefaultPrewarmedStates };
+
+    AdmissionSettings admission;
+
+    lua::StateOptions states;
+};
+
+Expected<RuntimeSettings, errors::Error> parse_runtime_settings(const std::string& json);
+
+// reads settings.json from the project root, a project without one runs with the defaults
+RuntimeSettings load_runtime_settings(const files::IFileSystem& project);
+
+}
@@ -0,0 +1,353 @@
+#include "send_queue.hxx"
+
+#include <algorithm>
+#include <charconv>
+#include <string_view>
+
+#include "logdef.hxx"
+
+namespace tg::internal {
+
+constexpr double GlobalPerSecond = 30.0;
+constexpr double GlobalBurst = 30.0;
+
+constexpr double PrivateChatPerSecond = 1.0;
+constexpr double PrivateChatBurst = 1.0;
+
+constexpr double GroupChatPerSecond = 20.0 / 60.0;
+constexpr double GroupChatBurst = 3.0;
+
+constexpr std::uint32_t MaxSendAttempts = 3;
+
+// flood control keeps answering 429 when the bot sends more than it may, the message is dropped in the end
+constexpr std::uint32_t MaxFloodRetries = 5;
+
+constexpr std::chrono::seconds PruneInterval { 60 };
+constexpr std::chrono::seconds ChatForgetAfter { 60 };
+
+// used when telegram answers 429 without saying how long to wait
+constexpr std::chrono::seconds DefaultRetryAfter { 5 };
+
+bool is_group(std::int64_t chatId)
+{
+    return chatId < 0;
+}
+
+// telegram reports flood control as "Too Many Requests: retry after N"
+std::optional<std::chrono::seconds> retry_after(std::string_view message)
+{
+    constexpr std::string_view Marker = "retry after ";
+
+    if(message.find("Too Many Requests") == std::string_view::npos) {
+        return std::nullopt;
+    }
+
+    auto position = message.find(Marker);
+
+    if(position == std::string_view::npos) {
+        return DefaultRetryAfter;
+    }
+
+    auto digits = message.substr(position + Marker.size());
+    std::int64_t seconds = 0;
+
+    auto [end, error] = std::from_chars(digits.data(), digits.data() + digits.size(), seconds);
+
+    if(error != std::errc {} || seconds <= 0) {
+        return DefaultRetryAfter;
+    }
+
+    return std::chrono::seconds { seconds };
+}
+
+}
+
+tg::TokenBucket::TokenBucket(double perSecond, double burst) : _perSecond(perSecond), _burst(burst), _tokens(burst), _updated(Clock::now()) { }
+
+tg::TokenBucket::Clock::duration tg::TokenBucket::available_in(Clock::time_point now)
+{
+    refill(now);
+
+    if(_tokens >= 1.0) {
+        return Clock::duration::zero();
+    }
+
+    auto seconds = (1.0 - _tokens) / _perSecond;
+    return std::chrono::ceil<Clock::duration>(std::chrono::duration<double>(seconds));
+}
+
+void tg::TokenBucket::take()
+{
+    _tokens -= 1.0;
+}
+
+bool tg::TokenBucket::full(Clock::time_point now) const
+{
+    auto elapsed = std::chrono::duration<double>(now - _updated).count();
+    return _tokens + elapsed * _perSecond >= _burst;
+}
+
+void tg::TokenBucket::refill(Clock::time_point now)
+{
+    if(now <= _updated) {
+        return;
+    }
+
+    auto elapsed = std::chrono::duration<double>(now - _updated).count();
+
+    _tokens = std::min(_burst, _tokens + elapsed * _perSecond);
+    _updated = now;
+}
+
+tg::SendQueue::SendQueue(const std::shared_ptr<TgBot::Bot>& bot, std::size_t senders)
+    : _bot(bot), _global(internal::GlobalPerSecond, internal::GlobalBurst), _lastPrune(Clock::now())
+{
+    senders = std::max<std::size_t>(senders, 1);
+    _senders.reserve(senders);
+
+    for(std::size_t i = 0; i < senders; i++) {
+        _senders.emplace_back([this](const std::stop_token& token) {
+            sender_func(token);
+        });
+    }
+}
+
+tg::SendQueue::~SendQueue()
+{
+    for(auto& sender : _senders) {
+        sender.request_stop();
+    }
+
+    _condition.notify_all();
+    _senders.clear();
+
+    auto dropped = pending();
+
+    if(dropped > 0) {
+        luabot_logWarn("Send queue stopped with {} unsent messages", dropped);
+    }
+}
+
+void tg::SendQueue::send(std::int64_t chatId, std::string text, SendPriority priority)
+{
+    {
+        std::unique_lock lock(_mutex);
+        enqueue({ chatId, std::move(text), priority }, false);
+        _generation++;
+    }
+
+    _condition.notify_one();
+}
+
+std::size_t tg::SendQueue::pending() const
+{
+    std::unique_lock lock(_mutex);
+    return _pending;
+}
+
+void tg::SendQueue::sender_func(const std::stop_token& token)
+{
+    while(!token.stop_requested()) {
+        std::optional<Message> message;
+
+        {
+            std::unique_lock lock(_mutex);
+
+            while(!token.stop_requested()) {
+                auto now = Clock::now();
+                auto wait = Clock::duration::max();
+
+                message = next(now, wait);
+
+                if(message) {
+                    break;
+                }
+
+                auto seen = _generation;
+                auto changed = [this, seen] {
+                    return _generation != seen;
+                };
+
+                if(wait == Clock::duration::max()) {
+                    _condition.wait(lock, token, changed);
+                } else {
+                    _condition.wait_until(lock, token, now + wait, changed);
+                }
+            }
+        }
+
+        if(!message) {
+            break;
+        }
+
+        std::optional<std::chrono::seconds> retryAfter;
+        bool retry = false;
+
+        try {
+            _bot->getApi().sendMessage(message->chatId, message->text);
+        } catch(const TgBot::TgException& e) {
+            retryAfter = internal::retry_after(e.what());
+
+            if(retryAfter) {
+                retry = message->attempts + 1 < internal::MaxFloodRetries;
+                luabot_logWarn("Flood control hit while sending to chat {}, pausing for {} s{}", message->chatId, retryAfter->count(),
+                    retry ? "" : ", the message is dropped");
+            } else {
+                // blocked by the user, chat not found, bad markup: sending it again changes nothing
+                luabot_logErr("Telegram rejected a message to chat {}: {}", message->chatId, e.what());
+            }
+        } catch(const std::exception& e) {
+            retry = message->attempts + 1 < internal::MaxSendAttempts;
+            luabot_logErr("Unable to send a message to chat {}{}: {}", message->chatId, retry ? ", will retry" : "", e.what());
+        }
+
+        finish(message.value(), retryAfter, retry);
+    }
+}
+
+std::optional<tg::SendQueue::Message> tg::SendQueue::next(Clock::time_point now, Clock::duration& wait)
+{
+    if(now - _lastPrune > internal::PruneInterval) {
+        prune(now);
+    }
+
+    if(now < _globalBlockedUntil) {
+        wait = _globalBlockedUntil - now;
+        return std::nullopt;
+    }
+
+    for(std::size_t priority = 0; priority < _ready.size(); priority++) {
+        auto& ready = _ready[priority];
+
+        for(auto it = ready.begin(); it != ready.end(); ++it) {
+            auto chatId = *it;
+            auto& state = chat(chatId);
+
+            if(state.busy) {
+                continue;
+            }
+
+            if(now < state.blockedUntil) {
+                wait = std::min(wait, state.blockedUntil - now);
+                continue;
+            }
+
+            auto chatWait = state.bucket.available_in(now);
+
+            if(chatWait != Clock::duration::zero()) {
+                wait = std::min(wait, chatWait);
+                continue;
+            }
+
+            // nothing else can go either while the global bucket is empty
+            auto globalWait = _global.available_in(now);
+
+            if(globalWait != Clock::duration::zero()) {
+                wait = std::min(wait, globalWait);
+                return std::nullopt;
+            }
+
+            state.bucket.take();
+            _global.take();
+
+            state.busy = true;
+            state.lastSent = now;
+
+            auto& queued = state.queued[priority];
+            auto message = std::move(queued.front());
+            queued.pop_front();
+            _pending--;
+
+            ready.erase(it);
+
+            if(!queued.empty()) {
+                ready.push_back(chatId);
+            }
+
+            return message;
+        }
+    }
+
+    return std::nullopt;
+}
+
+void tg::SendQueue::enqueue(Message&& message, bool front)
+{
+    auto priority = static_cast<std::size_t>(message.priority);
+    auto chatId = message.chatId;
+    auto& queued = chat(chatId).queued[priority];
+
+    if(queued.empty()) {
+        if(front) {
+            _ready[priority].push_front(chatId);
+        } else {
+            _ready[priority].push_back(chatId);
+        }
+    }
+
+    if(front) {
+        queued.push_front(std::move(message));
+    } else {
+        queued.push_back(std::move(message));
+    }
+
+    _pending++;
+}
+
+void tg::SendQueue::finish(const Message& message, std::optional<std::chrono::seconds> retryAfter, bool retry)
+{
+    {
+        std::unique_lock lock(_mutex);
+
+        auto& state = chat(message.chatId);
+        state.busy = false;
+
+        if(retryAfter) {
+            // flood control is applied to the whole bot, every chat waits
+            auto until = Clock::now() + retryAfter.value();
+
+            state.blockedUntil = until;
+            _globalBlockedUntil = std::max(_globalBlockedUntil, until);
+        }
+
+        if(retry) {
+            auto again = message;
+            again.attempts++;
+
+            // back to the front, it was the oldest message of its chat and must stay so
+            enqueue(std::move(again), true);
+        }
+
+        _generation++;
+    }
+
+    _condition.notify_all();
+}
+
+void tg::SendQueue::prune(Clock::time_point now)
+{
+    _lastPrune = now;
+
+    std::erase_if(_chats, [&](const auto& entry) {
+        const auto& state = entry.second;
+        auto idle = std::ranges::all_of(state.queued, [](const auto& queued) {
+            return queued.empty();
+        });
+        return idle && !state.busy && now - state.lastSent > internal::ChatForgetAfter && now >= state.blockedUntil && state.bucket.full(now);
+    });
+}
+
+tg::SendQueue::ChatState& tg::SendQueue::chat(std::int64_t chatId)
+{
+    auto it = _chats.find(chatId);
+
+    if(it != _chats.end()) {
+        return it->second;
+    }
+
+    auto bucket = internal::is_group(chatId)
+        ? TokenBucket(internal::GroupChatPerSecond, internal::GroupChatBurst)
+        : TokenBucket(internal::PrivateChatPerSecond, internal::PrivateChatBurst);
+
+    return _chats.emplace(chatId, ChatState { bucket }).first->second;
+}
@@ -0,0 +1,126 @@
+#pragma once
+
+#include <array>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include <tgbot/tgbot.h>
+
+namespace tg {
+
+constexpr std::size_t DefaultSenders = 4;
+
+enum class SendPriority
+{
+    // replies to what the user just did
+    Interactive,
+    Normal,
+    // broadcasts and other mass mailing, sent only when nothing else waits
+    Bulk,
+    Count
+};
+
+class TokenBucket
+{
+public:
+    using Clock = std::chrono::steady_clock;
+
+    TokenBucket(double perSecond, double burst);
+
+    // zero when a token is there to take, otherwise how long until the next one is
+    Clock::duration available_in(Clock::time_point now);
+    void take();
+
+    bool full(Clock::time_point now) const;
+
+private:
+    void refill(Clock::time_point now);
+
+    double _perSecond;
+    double _burst;
+    double _tokens;
+
+    Clock::time_point _updated;
+};
+
+// outbound messages of all sessions. Lua handlers only enqueue here, a small pool of senders drains the queue
+// respecting telegram limits: ~30 messages per second overall, one per second in a private chat, 20 per minute in a group
+class SendQueue
+{
+public:
+    using Clock = TokenBucket::Clock;
+
+    SendQueue(const std::shared_ptr<TgBot::Bot>& bot, std::size_t senders = DefaultSenders);
+    ~SendQueue();
+
+    SendQueue(const SendQueue&) = delete;
+    SendQueue& operator=(const SendQueue&) = delete;
+
+    void send(std::int64_t chatId, std::string text, SendPriority priority = SendPriority::Normal);
+
+    std::size_t pending() const;
+
+private:
+    struct Message
+    {
+        std::int64_t chatId;
+        std::string text;
+        SendPriority priority;
+        std::uint32_t attempts { 0 };
+    };
+
+    struct ChatState
+    {
+        TokenBucket bucket;
+        Clock::time_point blockedUntil {};
+        Clock::time_point lastSent {};
+
+        // one message of a chat in flight at a time, so the senders never reorder a conversation
+        bool busy { false };
+
+        std::array<std::deque<Message>, static_cast<std::size_t>(SendPriority::Count)> queued {};
+    };
+
+    void sender_func(const std::stop_token& token);
+
+    // picks the first message allowed to go right now, or tells how long to wait for one.
+    // walks the chats having messages, not the messages: a flooding chat costs one look per call
+    std::optional<Message> next(Clock::time_point now, Clock::duration& wait);
+
+    // adds a message to its chat and the chat to the ready ones of that priority
+    void enqueue(Message&& message, bool front);
+
+    void finish(const Message& message, std::optional<std::chrono::seconds> retryAfter, bool retry);
+    void prune(Clock::time_point now);
+
+    ChatState& chat(std::int64_t chatId);
+
+    std::shared_ptr<TgBot::Bot> _bot;
+
+    mutable std::mutex _mutex;
+    std::condition_variable_any _condition;
+
+    // per priority the chats with messages of it, a chat sent to goes to the back so chats take turns
+    std::array<std::deque<std::int64_t>, static_cast<std::size_t>(SendPriority::Count)> _ready;
+    std::unordered_map<std::int64_t, ChatState> _chats;
+    std::size_t _pending { 0 };
+
+    TokenBucket _global;
+    Clock::time_point _globalBlockedUntil;
+    Clock::time_point _lastPrune;
+
+    // bumped whenever the queue or the limits change, idle senders wake up on it
+    std::uint64_t _generation { 0 };
+
+    std::vector<std::jthread> _senders;
+};
+
+}
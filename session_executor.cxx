@@ -0,0 +1,337 @@
+#include "session_executor.hxx"
+
+#include <algorithm>
+
+#include "logdef.hxx"
+
+namespace tg::internal {
+
+// tasks of one strand executed before it is handed back, so one hot chat can not monopolize a worker
+constexpr std::size_t StrandBatch = 32;
+
+// preallocated task nodes shared by all strands, enqueueing only allocates when all of them are in flight
+constexpr std::uint32_t TaskNodePoolSize = 1 << 16;
+
+struct WorkerContext
+{
+    const SessionExecutor* owner { nullptr };
+    std::size_t index { 0 };
+};
+
+thread_local WorkerContext current_worker;
+
+// chat ids are sequential-ish and group ids are negative, so mix them before taking a modulo
+std::uint64_t mix_chat_id(std::int64_t chatId)
+{
+    auto x = static_cast<std::uint64_t>(chatId);
+
+    x ^= x >> 30;
+    x *= 0xbf58476d1ce4e5b9ull;
+    x ^= x >> 27;
+    x *= 0x94d049bb133111ebull;
+    x ^= x >> 31;
+
+    return x;
+}
+
+}
+
+tg::Strand::Strand(std::int64_t chatId) : _chatId(chatId), _home(internal::mix_chat_id(chatId)) { }
+
+std::int64_t tg::Strand::chat_id() const
+{
+    return _chatId;
+}
+
+tg::SessionExecutor::SessionExecutor(std::size_t workers) : _nodes(internal::TaskNodePoolSize)
+{
+    workers = std::max<std::size_t>(workers, 1);
+    _workers.reserve(workers);
+
+    for(std::size_t i = 0; i < workers; i++) {
+        _workers.push_back(std::make_unique<Worker>());
+    }
+
+    for(std::size_t i = 0; i < workers; i++) {
+        _workers[i]->thread = std::thread(&SessionExecutor::worker_func, this, i);
+    }
+
+    _timerThread = std::thread(&SessionExecutor::timer_func, this);
+
+    luabot_logInfo("Started session executor with {} workers", workers);
+}
+
+tg::SessionExecutor::~SessionExecutor()
+{
+    // pending timers are dropped, their strands are about to go away with the sessions
+    {
+        std::unique_lock lock(_timerMutex);
+        _timersRunning = false;
+    }
+
+    _timerCondition.notify_all();
+
+    if(_timerThread.joinable()) {
+        _timerThread.join();
+    }
+
+    {
+        std::unique_lock lock(_idleMutex);
+        _running = false;
+    }
+
+    _idleCondition.notify_all();
+
+    for(auto& worker : _workers) {
+        if(worker->thread.joinable()) {
+            worker->thread.join();
+        }
+    }
+}
+
+void tg::SessionExecutor::submit(Strand& strand, Task task)
+{
+    auto node = _nodes.acquire();
+    node->task = std::move(task);
+
+    strand._mailbox.push(node);
+
+    // only the producer moving the strand out of idle hands it to a worker, everyone else just leaves the task
+    if(strand._size.fetch_add(1, std::memory_order_acq_rel) == 0) {
+        schedule(strand);
+    }
+}
+
+void tg::SessionExecutor::submit_after(Strand& strand, std::chrono::milliseconds delay, Task task)
+{
+    bool earliest;
+
+    {
+        std::unique_lock lock(_timerMutex);
+
+        auto wakeup = _timers.next_wakeup();
+        auto deadline = TimerWheel<StrandTask>::Clock::now() + delay;
+
+        _timers.schedule(deadline, { &strand, std::move(task) });
+        earliest = !wakeup || deadline < wakeup.value();
+    }
+
+    // the timer thread only needs to know when it would oversleep the new timer
+    if(earliest) {
+        _timerCondition.notify_one();
+    }
+}
+
+void tg::SessionExecutor::submit_when_idle(Strand& strand, Task task)
+{
+    {
+        std::unique_lock lock(_deferredMutex);
+        _deferred.push_back({ &strand, std::move(task) });
+    }
+
+    _deferredCount.fetch_add(1);
+
+    if(_sleeping.load() > 0) {
+        std::unique_lock lock(_idleMutex);
+        _idleCondition.notify_one();
+    }
+}
+
+std::size_t tg::SessionExecutor::workers() const
+{
+    return _workers.size();
+}
+
+void tg::SessionExecutor::worker_func(std::size_t index)
+{
+    internal::current_worker = { this, index };
+
+    while(true) {
+        auto strand = pop_local(index);
+
+        if(!strand) {
+            strand = steal(index);
+        }
+
+        if(strand) {
+            _pending.fetch_sub(1);
+            run(*strand);
+            continue;
+        }
+
+        // the gap before going to sleep is what deferred tasks are waiting for
+        if(_running && release_deferred()) {
+            continue;
+        }
+
+        std::unique_lock lock(_idleMutex);
+
+        if(!_running && _pending.load() == 0) {
+            break;
+        }
+
+        _sleeping.fetch_add(1);
+        _idleCondition.wait(lock, [this] {
+            return _pending.load() > 0 || _deferredCount.load() > 0 || !_running;
+        });
+        _sleeping.fetch_sub(1);
+    }
+}
+
+void tg::SessionExecutor::timer_func()
+{
+    std::vector<StrandTask> expired;
+    std::unique_lock lock(_timerMutex);
+
+    while(_timersRunning) {
+        _timers.advance(TimerWheel<StrandTask>::Clock::now(), expired);
+
+        if(!expired.empty()) {
+            lock.unlock();
+
+            for(auto& timer : expired) {
+                submit(*timer.strand, std::move(timer.task));
+            }
+
+            expired.clear();
+            lock.lock();
+            continue;
+        }
+
+        auto wakeup = _timers.next_wakeup();
+
+        if(wakeup) {
+            _timerCondition.wait_until(lock, wakeup.value());
+        } else {
+            _timerCondition.wait(lock);
+        }
+    }
+}
+
+void tg::SessionExecutor::schedule(Strand& strand)
+{
+    // strands woken up by a worker stay on it for cache locality, the others go to their home worker,
+    // idle workers steal from both anyway
+    std::size_t index = strand._home % _workers.size();
+    bool local = internal::current_worker.owner == this;
+
+    if(local) {
+        index = internal::current_worker.index;
+    }
+
+    push(index, strand, local);
+}
+
+void tg::SessionExecutor::push(std::size_t index, Strand& strand, bool newest)
+{
+    {
+        auto& worker = *_workers[index];
+        std::unique_lock lock(worker.mutex);
+
+        if(newest) {
+            worker.strands.push_back(&strand);
+        } else {
+            worker.strands.push_front(&strand);
+        }
+    }
+
+    _pending.fetch_add(1);
+
+    if(_sleeping.load() > 0) {
+        std::unique_lock lock(_idleMutex);
+        _idleCondition.notify_one();
+    }
+}
+
+tg::Strand* tg::SessionExecutor::pop_local(std::size_t index)
+{
+    auto& worker = *_workers[index];
+    std::unique_lock lock(worker.mutex);
+
+    if(worker.strands.empty()) {
+        return nullptr;
+    }
+
+    auto strand = worker.strands.back();
+    worker.strands.pop_back();
+
+    return strand;
+}
+
+tg::Strand* tg::SessionExecutor::steal(std::size_t thief)
+{
+    for(std::size_t i = 1; i < _workers.size(); i++) {
+        auto& victim = *_workers[(thief + i) % _workers.size()];
+        std::unique_lock lock(victim.mutex, std::try_to_lock);
+
+        if(!lock.owns_lock() || victim.strands.empty()) {
+            continue;
+        }
+
+        // victims keep running their newest strands, thieves take the oldest ones
+        auto strand = victim.strands.front();
+        victim.strands.pop_front();
+
+        return strand;
+    }
+
+    return nullptr;
+}
+
+bool tg::SessionExecutor::release_deferred()
+{
+    if(_deferredCount.load() == 0) {
+        return false;
+    }
+
+    StrandTask deferred;
+
+    {
+        std::unique_lock lock(_deferredMutex);
+
+        if(_deferred.empty()) {
+            return false;
+        }
+
+        deferred = std::move(_deferred.front());
+        _deferred.pop_front();
+    }
+
+    _deferredCount.fetch_sub(1);
+
+    // submitted from a worker, so the strand lands on this very worker which is about to pick it up
+    submit(*deferred.strand, std::move(deferred.task));
+
+    return true;
+}
+
+void tg::SessionExecutor::run(Strand& strand)
+{
+    for(std::size_t executed = 0; executed < internal::StrandBatch; executed++) {
+        auto node = strand._mailbox.pop();
+
+        // the size says a task is there, its producer just has not linked it yet
+        while(!node) {
+            std::this_thread::yield();
+            node = strand._mailbox.pop();
+        }
+
+        try {
+            node->task();
+        } catch(const std::exception& e) {
+            luabot_logErr("Exception in task of chat {}: {}", strand._chatId, e.what());
+        } catch(...) {
+            luabot_logErr("Unknown exception in task of chat {}", strand._chatId);
+        }
+
+        node->task.reset();
+        _nodes.release(node);
+
+        if(strand._size.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+            return;
+        }
+    }
+
+    // batch exhausted with work left: requeue at the stealing end, behind everything already waiting here
+    push(internal::current_worker.index, strand, false);
+}
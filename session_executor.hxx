@@ -0,0 +1,124 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "inline_task.hxx"
+#include "mailbox.hxx"
+#include "timer_wheel.hxx"
+
+#include "globals.hxx"
+
+namespace tg {
+
+class SessionExecutor;
+
+struct TaskNode
+{
+    std::atomic<TaskNode*> next { nullptr };
+    InlineTask task;
+};
+
+// serial execution context of one chat: its tasks never run concurrently and always run in submission order,
+// but the strand itself may be picked up by any worker
+class Strand
+{
+public:
+    using Task = InlineTask;
+
+    explicit Strand(std::int64_t chatId);
+
+    Strand(const Strand&) = delete;
+    Strand& operator=(const Strand&) = delete;
+
+    std::int64_t chat_id() const;
+
+private:
+    friend class SessionExecutor;
+
+    std::int64_t _chatId;
+    std::size_t _home;
+
+    Mailbox<TaskNode> _mailbox;
+
+    // queued tasks not yet finished, the strand is owned by a worker exactly while this is non-zero
+    std::atomic<std::size_t> _size { 0 };
+};
+
+class SessionExecutor
+{
+public:
+    using Task = Strand::Task;
+
+    explicit SessionExecutor(std::size_t workers = globals::MaxThreadedSession);
+    ~SessionExecutor();
+
+    SessionExecutor(const SessionExecutor&) = delete;
+    SessionExecutor& operator=(const SessionExecutor&) = delete;
+
+    void submit(Strand& strand, Task task);
+
+    // runs the task on the strand once the delay has passed, with a timer wheel resolution
+    void submit_after(Strand& strand, std::chrono::milliseconds delay, Task task);
+
+    // runs the task on the strand once some worker has nothing else to do, for housekeeping that must not
+    // delay anybody. deferred tasks still pending at shutdown are dropped
+    void submit_when_idle(Strand& strand, Task task);
+
+    std::size_t workers() const;
+
+private:
+    struct Worker
+    {
+        std::thread thread;
+        std::mutex mutex;
+        std::deque<Strand*> strands;
+    };
+
+    struct StrandTask
+    {
+        Strand* strand;
+        Task task;
+    };
+
+    void worker_func(std::size_t index);
+    void timer_func();
+
+    void schedule(Strand& strand);
+    void push(std::size_t index, Strand& strand, bool newest);
+    Strand* pop_local(std::size_t index);
+    Strand* steal(std::size_t thief);
+
+    void run(Strand& strand);
+
+    // hands the oldest deferred task to its strand, false when there is none
+    bool release_deferred();
+
+    NodePool<TaskNode> _nodes;
+    std::vector<std::unique_ptr<Worker>> _workers;
+
+    std::mutex _idleMutex;
+    std::condition_variable _idleCondition;
+
+    std::atomic<std::size_t> _pending { 0 };
+    std::atomic<std::size_t> _deferredCount { 0 };
+    std::atomic<std::size_t> _sleeping { 0 };
+    std::atomic<bool> _running { true };
+
+    // one wheel for all strands: thousands of sleeping chats cost a slot each and no wakeups
+    std::mutex _timerMutex;
+    std::condition_variable _timerCondition;
+    TimerWheel<StrandTask> _timers;
+    bool _timersRunning { true };
+    std::thread _timerThread;
+
+    std::mutex _deferredMutex;
+    std::deque<StrandTask> _deferred;
+};
+
+}
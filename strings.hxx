@@ -2,11 +2,23 @@
 
 #include <vector>
 #include <string>
+#include <string_view>
 #include <ranges>
 #include <algorithm>
 
 namespace utils {
 
+// lets unordered containers keyed by std::string be searched with a string_view, no key is built for a lookup
+struct StringHash
+{
+    using is_transparent = void;
+
+    std::size_t operator()(std::string_view value) const
+    {
+        return std::hash<std::string_view> {}(value);
+    }
+};
+
 std::vector<std::string> string_split(std::string& source, char sep);
 std::vector<std::string> string_split(std::string& source, const std::string &sep);
 
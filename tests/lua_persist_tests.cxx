@@ -0,0 +1,353 @@
+#include <gtest/gtest.h>
+
+#include <chrono>
+#include <format>
+#include <iostream>
+#include <string>
+#include <unordered_set>
+#include <vector>
+
+#include <sol/sol.hpp>
+
+#include "lua_persist.hxx"
+#include "lua_runtime.hxx"
+
+namespace {
+
+sol::state make_state()
+{
+    sol::state state;
+    state.open_libraries(sol::lib::base, sol::lib::coroutine, sol::lib::math, sol::lib::string, sol::lib::table);
+
+    return state;
+}
+
+bool holds(sol::state& state, const std::string& expression)
+{
+    return state.script("return " + expression).get<bool>();
+}
+
+std::string hibernate(sol::state& state)
+{
+    sol::table commands = state["commands"];
+    sol::table scriptGlobals = state["script"];
+
+    auto blob = lua::persist::dump_commands(commands, scriptGlobals);
+
+    if(!blob) {
+        ADD_FAILURE() << blob.error().message();
+        return {};
+    }
+
+    return blob.value();
+}
+
+// the command set as its initializers leave it in a fresh state
+constexpr const char* FreshCommands = R"(
+    commands = {
+        start = { count = 0, temp = "left by the initializer", run = function(self) return self.count * 2 end },
+        help = { pages = {} },
+    }
+)";
+
+}
+
+TEST(Hibernation, RoundTripsCommandDataAndScriptGlobals)
+{
+    auto before = make_state();
+    before.script(R"(
+        commands = {
+            start = { count = 3, ratio = 0.25, whole = 2.0, name = "alice", flags = { seen = true }, run = function(self) return self.count end },
+            help = { pages = { "one", "two" } },
+        }
+
+        local shared = { hits = 7 }
+        commands.start.shared = shared
+
+        -- what CommandBox::script_globals collects: the globals the scripts defined
+        script = { counter = 41, current = commands.start, shared = shared }
+    )");
+
+    auto blob = hibernate(before);
+    ASSERT_FALSE(blob.empty());
+
+    auto after = make_state();
+    after.script(FreshCommands);
+
+    sol::table commands = after["commands"];
+    auto restored = lua::persist::restore_commands(commands, after.globals(), blob);
+    ASSERT_TRUE(restored) << restored.error().message();
+
+    EXPECT_TRUE(holds(after, "commands.start.count == 3"));
+    EXPECT_TRUE(holds(after, "commands.start.ratio == 0.25"));
+    EXPECT_TRUE(holds(after, "commands.start.whole == 2"));
+    EXPECT_TRUE(holds(after, "commands.start.name == 'alice'"));
+    EXPECT_TRUE(holds(after, "commands.start.flags.seen == true"));
+    EXPECT_TRUE(holds(after, "#commands.help.pages == 2 and commands.help.pages[2] == 'two'"));
+
+    // data is replaced as a whole, functions come from the fresh state
+    EXPECT_TRUE(holds(after, "commands.start.temp == nil"));
+    EXPECT_TRUE(holds(after, "commands.start:run() == 6"));
+
+    // references between commands and globals point at the restored tables again
+    EXPECT_TRUE(holds(after, "counter == 41"));
+    EXPECT_TRUE(holds(after, "rawequal(current, commands.start)"));
+    EXPECT_TRUE(holds(after, "rawequal(shared, commands.start.shared) and shared.hits == 7"));
+
+#if LUA_VERSION_NUM >= 503
+    EXPECT_TRUE(holds(after, "math.type(commands.start.count) == 'integer'"));
+    EXPECT_TRUE(holds(after, "math.type(commands.start.whole) == 'float'"));
+#endif
+}
+
+TEST(Hibernation, DropsCommandsRemovedSinceHibernating)
+{
+    auto before = make_state();
+    before.script(R"(
+        commands = { start = { count = 1 }, gone = { data = "x" } }
+        script = {}
+    )");
+
+    auto blob = hibernate(before);
+    ASSERT_FALSE(blob.empty());
+
+    auto after = make_state();
+    after.script(FreshCommands);
+
+    sol::table commands = after["commands"];
+    auto restored = lua::persist::restore_commands(commands, after.globals(), blob);
+    ASSERT_TRUE(restored) << restored.error().message();
+
+    EXPECT_TRUE(holds(after, "commands.gone == nil"));
+    EXPECT_TRUE(holds(after, "commands.start.count == 1"));
+}
+
+TEST(Hibernation, RejectsBrokenBlobs)
+{
+    auto before = make_state();
+    before.script(R"(
+        commands = { start = { count = 1, name = "bob" } }
+        script = { counter = 2 }
+    )");
+
+    auto blob = hibernate(before);
+    ASSERT_FALSE(blob.empty());
+
+    for(const auto& broken : { "LBS1" + blob.substr(4), blob.substr(0, blob.size() - 1), blob + "x" }) {
+        auto after = make_state();
+        after.script(FreshCommands);
+
+        sol::table commands = after["commands"];
+        EXPECT_FALSE(lua::persist::restore_commands(commands, after.globals(), broken));
+    }
+}
+
+namespace {
+
+// an initializer the way scripts write them: private state in locals, methods through a metatable
+constexpr const char* CounterInitializer = R"(
+    local count = 0
+
+    local Counter = {}
+    Counter.__index = Counter
+
+    function Counter:bump()
+        count = count + 1
+        return count
+    end
+
+    function Counter:describe()
+        return string.format("%s at %d", self.name, count)
+    end
+
+    local instance = setmetatable({ name = "counter", limits = { max = 10 } }, Counter)
+
+    instance.peek = function() return count end
+    instance.format = string.format
+
+    return instance
+)";
+
+// the imaging side, as capture_image does it
+std::string image_of(sol::state& state, const char* initializer)
+{
+    sol::table instance = state.script(initializer);
+    auto blob = lua::persist::dump_instance(instance, lua::persist::permanent_names(state), {});
+
+    if(!blob) {
+        ADD_FAILURE() << blob.error().message();
+        return {};
+    }
+
+    return blob.value();
+}
+
+Expected<sol::table, errors::Error> restore_image(sol::state& state, const std::string& blob)
+{
+    sol::table permanents = state.create_table();
+    lua::persist::permanent_values(state, permanents);
+
+    return lua::persist::restore_instance(state, blob, permanents);
+}
+
+}
+
+TEST(HeapImage, RestoresClosuresUpvaluesAndMetatables)
+{
+    auto imaged = make_state();
+    auto blob = image_of(imaged, CounterInitializer);
+    ASSERT_FALSE(blob.empty());
+
+    auto fresh = make_state();
+    auto restored = restore_image(fresh, blob);
+    ASSERT_TRUE(restored) << restored.error().message();
+
+    fresh["instance"] = restored.value();
+
+    EXPECT_TRUE(holds(fresh, "instance.name == 'counter' and instance.limits.max == 10"));
+    EXPECT_TRUE(holds(fresh, "instance:bump() == 1 and instance:bump() == 2"));
+
+    // the methods and peek shared a local before imaging and still do
+    EXPECT_TRUE(holds(fresh, "instance.peek() == 2"));
+    EXPECT_TRUE(holds(fresh, "instance:describe() == 'counter at 2'"));
+
+    // values the globals lead to are the restoring state's own, not copies
+    EXPECT_TRUE(holds(fresh, "rawequal(instance.format, string.format)"));
+    EXPECT_TRUE(holds(fresh, "rawequal(getmetatable(instance).__index, getmetatable(instance))"));
+}
+
+TEST(HeapImage, GivesEveryRestoreItsOwnObjects)
+{
+    auto imaged = make_state();
+    auto blob = image_of(imaged, CounterInitializer);
+    ASSERT_FALSE(blob.empty());
+
+    auto fresh = make_state();
+    auto first = restore_image(fresh, blob);
+    auto second = restore_image(fresh, blob);
+    ASSERT_TRUE(first && second);
+
+    fresh["first"] = first.value();
+    fresh["second"] = second.value();
+
+    EXPECT_TRUE(holds(fresh, "first:bump() == 1 and first:bump() == 2 and second:bump() == 1"));
+    EXPECT_TRUE(holds(fresh, "not rawequal(getmetatable(first), getmetatable(second))"));
+}
+
+TEST(HeapImage, RefusesWhatItCanNotRebuild)
+{
+    auto state = make_state();
+    auto permanents = lua::persist::permanent_names(state);
+
+    sol::table withThread = state.script("return { worker = coroutine.create(function() end) }");
+    EXPECT_FALSE(lua::persist::dump_instance(withThread, permanents, {}));
+
+    sol::table withNative = state.create_table();
+    withNative.set_function("native", [] {
+        return 1;
+    });
+    EXPECT_FALSE(lua::persist::dump_instance(withNative, permanents, {}));
+
+    // instances of other commands are imaged on their own, a reference to one can not be kept
+    sol::table other = state.create_table();
+    sol::table referring = state.create_table_with("other", other);
+    EXPECT_FALSE(lua::persist::dump_instance(referring, permanents, { other.pointer() }));
+}
+
+TEST(HeapImage, FailsWhenTheStateLacksAValueTheImageNeeds)
+{
+    auto imaged = make_state();
+    auto blob = image_of(imaged, CounterInitializer);
+    ASSERT_FALSE(blob.empty());
+
+    // no string library, so no string.format to refer to
+    sol::state bare;
+    bare.open_libraries(sol::lib::base);
+
+    EXPECT_FALSE(restore_image(bare, blob));
+}
+
+namespace {
+
+constexpr std::size_t BenchmarkCommands = 100;
+constexpr std::size_t BenchmarkSessions = 200;
+
+// an average command: a handler with per-chat state and a table of canned replies built on start
+constexpr const char* CommandInitializer = R"(
+    local usage = {}
+
+    local Command = { name = "command " .. index }
+    Command.__index = Command
+
+    function Command:on_message(chat, text)
+        usage[chat] = (usage[chat] or 0) + 1
+        return string.format("%s: %s (%d)", self.name, text, usage[chat])
+    end
+
+    local replies = {}
+    for i = 1, 50 do
+        replies[i] = "reply " .. i
+    end
+
+    return setmetatable({ replies = replies, settings = { cooldown = 5, enabled = true } }, Command)
+)";
+
+}
+
+// a measurement, not a check: run with --gtest_also_run_disabled_tests --gtest_filter=*Benchmark*.
+// the first half is what a new session costs running cached initializer bytecode, the second restoring the heap image
+TEST(HeapImageBenchmark, DISABLED_InitializersAgainstImage)
+{
+    auto source = make_state();
+
+    std::vector<std::string> bytecode;
+    std::vector<std::string> images;
+
+    for(std::size_t index = 0; index < BenchmarkCommands; index++) {
+        auto code = std::format("local index = {}\n{}", index, CommandInitializer);
+
+        sol::load_result chunk = source.load(code);
+        ASSERT_TRUE(chunk.valid());
+
+        auto dumped = lua::runtime::dump(chunk.get<sol::function>());
+        ASSERT_TRUE(dumped);
+        bytecode.push_back(dumped.value());
+
+        images.push_back(image_of(source, code.c_str()));
+        ASSERT_FALSE(images.back().empty());
+    }
+
+    auto start = std::chrono::steady_clock::now();
+
+    for(std::size_t session = 0; session < BenchmarkSessions; session++) {
+        auto state = make_state();
+        sol::table commands = state.create_table();
+
+        for(std::size_t index = 0; index < BenchmarkCommands; index++) {
+            sol::load_result chunk = state.load(bytecode[index], "=command", sol::load_mode::binary);
+            sol::protected_function initializer = chunk.get<sol::protected_function>();
+
+            commands[index + 1] = initializer().get<sol::table>();
+        }
+    }
+
+    auto initializers = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start);
+    start = std::chrono::steady_clock::now();
+
+    for(std::size_t session = 0; session < BenchmarkSessions; session++) {
+        auto state = make_state();
+        sol::table commands = state.create_table();
+
+        sol::table permanents = state.create_table();
+        lua::persist::permanent_values(state, permanents);
+
+        for(std::size_t index = 0; index < BenchmarkCommands; index++) {
+            commands[index + 1] = lua::persist::restore_instance(state, images[index], permanents).value();
+        }
+    }
+
+    auto restores = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start);
+
+    std::cout << std::format("{}: {} commands per session, initializers {:.3f} ms, image {:.3f} ms per session\n",
+        lua::runtime::name(), BenchmarkCommands, initializers.count() / BenchmarkSessions, restores.count() / BenchmarkSessions);
+}
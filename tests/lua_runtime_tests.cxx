@@ -0,0 +1,120 @@
+#include <gtest/gtest.h>
+
+#include <chrono>
+#include <format>
+#include <iostream>
+
+#include <sol/sol.hpp>
+
+#include "lua_runtime.hxx"
+
+namespace {
+
+sol::state make_state()
+{
+    sol::state state;
+    state.open_libraries(sol::lib::base, sol::lib::math, sol::lib::string, sol::lib::table);
+
+    return state;
+}
+
+}
+
+TEST(LuaRuntime, ReportsTheLinkedRuntime)
+{
+    EXPECT_EQ(lua::runtime::name().starts_with("LuaJIT"), lua::runtime::HasJit);
+}
+
+TEST(LuaRuntime, DumpedFunctionsLoadIntoAnotherState)
+{
+    auto state = make_state();
+    sol::function function = state.script("return function(a, b) return a * b + 1 end");
+
+    auto bytecode = lua::runtime::dump(function);
+    ASSERT_TRUE(bytecode) << bytecode.error().message();
+
+    auto other = make_state();
+    sol::load_result loaded = other.load(bytecode.value(), "=dumped", sol::load_mode::binary);
+    ASSERT_TRUE(loaded.valid());
+
+    sol::protected_function restored = loaded.get<sol::protected_function>();
+    EXPECT_EQ(restored(6, 7).get<int>(), 43);
+}
+
+TEST(LuaRuntime, NativeFunctionsAreNotDumped)
+{
+    auto state = make_state();
+    sol::function print = state["print"];
+
+    EXPECT_FALSE(lua::runtime::dump(print));
+}
+
+namespace {
+
+constexpr std::size_t BenchmarkRuns = 2000;
+
+// the kind of handler our text heavy bots run: tokenizing, counting, formatting and building a reply
+constexpr const char* TextCommand = R"(
+    local text = string.rep("The quick brown fox jumps over the lazy dog. Pack my box with five dozen liquor jugs! ", 100)
+
+    return function()
+        local counts = {}
+
+        for word in text:gmatch("%a+") do
+            word = word:lower()
+            counts[word] = (counts[word] or 0) + 1
+        end
+
+        local parts = {}
+
+        for word, count in pairs(counts) do
+            parts[#parts + 1] = string.format("%s=%d", word, count)
+        end
+
+        table.sort(parts)
+
+        local reply = table.concat(parts, ", "):gsub("o", "0")
+        local checksum = 0
+
+        for i = 1, #reply do
+            checksum = (checksum * 31 + reply:byte(i)) % 1000000007
+        end
+
+        return checksum
+    end
+)";
+
+double milliseconds_per_run(sol::state& state)
+{
+    sol::protected_function command = state.script(TextCommand);
+
+    // the first runs warm the trace compiler up, they do not count
+    for(std::size_t run = 0; run < BenchmarkRuns / 10; run++) {
+        command();
+    }
+
+    auto start = std::chrono::steady_clock::now();
+
+    for(std::size_t run = 0; run < BenchmarkRuns; run++) {
+        command();
+    }
+
+    return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count() / BenchmarkRuns;
+}
+
+}
+
+// a measurement, not a check: run with --gtest_also_run_disabled_tests --gtest_filter=*Benchmark* once from a
+// build with the default LuaRuntime and once from one with /p:LuaRuntime=Lua54, and compare the lines
+TEST(LuaRuntimeBenchmark, DISABLED_TextProcessingCommand)
+{
+    auto state = make_state();
+    std::cout << std::format("{}: {:.4f} ms per run\n", lua::runtime::name(), milliseconds_per_run(state));
+
+    if constexpr(lua::runtime::HasJit) {
+        auto interpreted = make_state();
+        lua::runtime::set_jit(interpreted, false);
+
+        std::cout << std::format("{} without the JIT: {:.4f} ms per run\n", lua::runtime::name(), milliseconds_per_run(interpreted));
+    }
+}
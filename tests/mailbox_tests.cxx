@@ -0,0 +1,166 @@
+#include <gtest/gtest.h>
+
+#include <atomic>
+#include <cstdint>
+#include <thread>
+#include <unordered_set>
+#include <vector>
+
+#include "mailbox.hxx"
+
+namespace {
+
+struct Node
+{
+    std::atomic<Node*> next { nullptr };
+    std::uint32_t producer { 0 };
+    std::uint32_t sequence { 0 };
+
+    std::atomic<bool> taken { false };
+};
+
+constexpr std::uint32_t Producers = 4;
+constexpr std::uint32_t NodesPerProducer = 50000;
+
+}
+
+TEST(Mailbox, StartsEmpty)
+{
+    tg::Mailbox<Node> mailbox;
+    EXPECT_EQ(mailbox.pop(), nullptr);
+}
+
+TEST(Mailbox, PopsInPushOrder)
+{
+    tg::Mailbox<Node> mailbox;
+    std::vector<Node> nodes(16);
+
+    for(std::uint32_t i = 0; i < nodes.size(); i++) {
+        nodes[i].sequence = i;
+        mailbox.push(&nodes[i]);
+    }
+
+    for(std::uint32_t i = 0; i < nodes.size(); i++) {
+        auto node = mailbox.pop();
+
+        ASSERT_NE(node, nullptr);
+        EXPECT_EQ(node->sequence, i);
+    }
+
+    EXPECT_EQ(mailbox.pop(), nullptr);
+}
+
+TEST(Mailbox, KeepsWorkingAfterRunningDry)
+{
+    // the last node is only handed out once the stub went back in behind it
+    tg::Mailbox<Node> mailbox;
+    Node first, second;
+
+    mailbox.push(&first);
+    EXPECT_EQ(mailbox.pop(), &first);
+    EXPECT_EQ(mailbox.pop(), nullptr);
+
+    mailbox.push(&second);
+    mailbox.push(&first);
+    EXPECT_EQ(mailbox.pop(), &second);
+    EXPECT_EQ(mailbox.pop(), &first);
+    EXPECT_EQ(mailbox.pop(), nullptr);
+}
+
+TEST(Mailbox, KeepsOrderOfEveryProducer)
+{
+    tg::Mailbox<Node> mailbox;
+    std::vector<Node> nodes(Producers * NodesPerProducer);
+
+    std::vector<std::jthread> producers;
+
+    for(std::uint32_t producer = 0; producer < Producers; producer++) {
+        producers.emplace_back([&, producer] {
+            for(std::uint32_t i = 0; i < NodesPerProducer; i++) {
+                auto& node = nodes[producer * NodesPerProducer + i];
+
+                node.producer = producer;
+                node.sequence = i;
+                mailbox.push(&node);
+            }
+        });
+    }
+
+    std::vector<std::uint32_t> expected(Producers, 0);
+    std::size_t received = 0;
+
+    while(received < nodes.size()) {
+        auto node = mailbox.pop();
+
+        // empty, or a producer is between its exchange and its link
+        if(!node) {
+            std::this_thread::yield();
+            continue;
+        }
+
+        ASSERT_EQ(node->sequence, expected[node->producer]);
+        expected[node->producer]++;
+        received++;
+    }
+
+    EXPECT_EQ(mailbox.pop(), nullptr);
+}
+
+TEST(NodePool, HandsOutEverySlabNodeOnceThenFallsBackToTheHeap)
+{
+    tg::NodePool<Node> pool(4);
+    std::unordered_set<Node*> taken;
+
+    for(int i = 0; i < 6; i++) {
+        EXPECT_TRUE(taken.insert(pool.acquire()).second);
+    }
+
+    for(auto node : taken) {
+        pool.release(node);
+    }
+
+    // released slab nodes come back, the heap ones were deleted
+    std::unordered_set<Node*> again;
+
+    for(int i = 0; i < 4; i++) {
+        auto node = pool.acquire();
+
+        EXPECT_TRUE(taken.contains(node));
+        EXPECT_TRUE(again.insert(node).second);
+    }
+
+    for(auto node : again) {
+        pool.release(node);
+    }
+}
+
+TEST(NodePool, SurvivesConcurrentAcquireAndRelease)
+{
+    constexpr std::uint32_t Threads = 4;
+    constexpr std::uint32_t Rounds = 100000;
+
+    tg::NodePool<Node> pool(Threads);
+    std::atomic<bool> shared { false };
+
+    {
+        std::vector<std::jthread> threads;
+
+        for(std::uint32_t thread = 0; thread < Threads; thread++) {
+            threads.emplace_back([&] {
+                for(std::uint32_t i = 0; i < Rounds; i++) {
+                    auto node = pool.acquire();
+
+                    // a node given to two threads at once is found taken by one of them
+                    if(node->taken.exchange(true)) {
+                        shared = true;
+                    }
+
+                    node->taken = false;
+                    pool.release(node);
+                }
+            });
+        }
+    }
+
+    EXPECT_FALSE(shared);
+}
@@ -0,0 +1,8 @@
+#include <gtest/gtest.h>
+
+// gtest_main of vcpkg is manual-link only, the runner is spelled out here instead
+int main(int argc, char** argv)
+{
+    testing::InitGoogleTest(&argc, argv);
+    return RUN_ALL_TESTS();
+}
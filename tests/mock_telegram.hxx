@@ -0,0 +1,177 @@
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <format>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include <tgbot/tgbot.h>
+
+namespace tests {
+
+// stands in for the bot API server: answers every request itself and records what was sent and polled
+class MockTelegram : public TgBot::HttpClient
+{
+public:
+    struct Sent
+    {
+        std::int64_t chatId;
+        std::string text;
+
+        bool operator==(const Sent&) const = default;
+    };
+
+    struct Poll
+    {
+        std::int32_t offset;
+        std::int32_t limit;
+    };
+
+    std::string makeRequest(const TgBot::Url& url, const std::vector<TgBot::HttpReqArg>& args) const override
+    {
+        std::unique_lock lock(_mutex);
+
+        if(std::string_view(url.path).ends_with("/getUpdates")) {
+            return answer_poll(args);
+        }
+
+        _held.wait(lock, [this] {
+            return !_holding;
+        });
+
+        std::int64_t chatId = 0;
+        std::string text;
+
+        for(const auto& arg : args) {
+            if(arg.name == "chat_id") {
+                chatId = std::stoll(arg.value);
+            } else if(arg.name == "text") {
+                text = arg.value;
+            }
+        }
+
+        _requests++;
+
+        if(!_failures.empty()) {
+            auto failure = std::move(_failures.front());
+            _failures.pop_front();
+            return failure;
+        }
+
+        _sent.push_back({ chatId, text });
+        _changed.notify_all();
+
+        return std::format(R"({{"ok":true,"result":{{"message_id":{},"date":0,"chat":{{"id":{},"type":"private"}}}}}})", _sent.size(), chatId);
+    }
+
+    // the queue and the poller do their own retrying, the client must not add another layer of it
+    int getRequestMaxRetries() const override
+    {
+        return 0;
+    }
+
+    // the next messages sent are answered with these bodies instead of succeeding
+    void fail_next(std::string response)
+    {
+        std::unique_lock lock(_mutex);
+        _failures.push_back(std::move(response));
+    }
+
+    // the next getUpdates requests are answered with these bodies, an empty batch once they run out
+    void answer_next_poll(std::string response)
+    {
+        std::unique_lock lock(_mutex);
+        _polled.push_back(std::move(response));
+    }
+
+    // requests wait until released, so a test can fill the queue before anything leaves it
+    void hold()
+    {
+        std::unique_lock lock(_mutex);
+        _holding = true;
+    }
+
+    void release()
+    {
+        {
+            std::unique_lock lock(_mutex);
+            _holding = false;
+        }
+
+        _held.notify_all();
+    }
+
+    std::vector<Sent> wait_for_sent(std::size_t count, std::chrono::milliseconds timeout = std::chrono::seconds { 10 }) const
+    {
+        std::unique_lock lock(_mutex);
+
+        _changed.wait_for(lock, timeout, [this, count] {
+            return _sent.size() >= count;
+        });
+
+        return _sent;
+    }
+
+    std::size_t requests() const
+    {
+        std::unique_lock lock(_mutex);
+        return _requests;
+    }
+
+    std::vector<Poll> polls() const
+    {
+        std::unique_lock lock(_mutex);
+        return _polls;
+    }
+
+private:
+    std::string answer_poll(const std::vector<TgBot::HttpReqArg>& args) const
+    {
+        // the api leaves out arguments that have their default value
+        Poll poll { 0, 100 };
+
+        for(const auto& arg : args) {
+            if(arg.name == "offset") {
+                poll.offset = std::stoi(arg.value);
+            } else if(arg.name == "limit") {
+                poll.limit = std::stoi(arg.value);
+            }
+        }
+
+        _polls.push_back(poll);
+
+        if(_polled.empty()) {
+            return R"({"ok":true,"result":[]})";
+        }
+
+        auto response = std::move(_polled.front());
+        _polled.pop_front();
+
+        return response;
+    }
+
+    mutable std::mutex _mutex;
+    mutable std::condition_variable _changed;
+    mutable std::condition_variable _held;
+
+    mutable std::vector<Sent> _sent;
+    mutable std::deque<std::string> _failures;
+    mutable std::size_t _requests { 0 };
+    bool _holding { false };
+
+    mutable std::vector<Poll> _polls;
+    mutable std::deque<std::string> _polled;
+};
+
+inline std::shared_ptr<TgBot::Bot> make_bot(const MockTelegram& telegram)
+{
+    return std::make_shared<TgBot::Bot>("123:test", telegram);
+}
+
+}
@@ -0,0 +1,109 @@
+#include <gtest/gtest.h>
+
+#include <chrono>
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#include "send_queue.hxx"
+
+#include "mock_telegram.hxx"
+
+using namespace std::chrono_literals;
+
+namespace {
+
+using tests::MockTelegram;
+using tests::make_bot;
+
+constexpr std::int64_t Group = -1001;
+
+constexpr std::string_view FloodResponse = R"({"ok":false,"error_code":429,"description":"Too Many Requests: retry after 1","parameters":{"retry_after":1}})";
+constexpr std::string_view RejectedResponse = R"({"ok":false,"error_code":400,"description":"Bad Request: chat not found"})";
+
+}
+
+TEST(SendQueue, KeepsTheOrderOfAChat)
+{
+    MockTelegram telegram;
+    auto bot = make_bot(telegram);
+
+    tg::SendQueue queue(bot);
+
+    // a group may burst three messages, the test does not wait on the per-chat limit
+    queue.send(Group, "one");
+    queue.send(Group, "two");
+    queue.send(Group, "three");
+
+    auto sent = telegram.wait_for_sent(3);
+
+    EXPECT_EQ(sent, (std::vector<MockTelegram::Sent> { { Group, "one" }, { Group, "two" }, { Group, "three" } }));
+    EXPECT_EQ(queue.pending(), 0u);
+}
+
+TEST(SendQueue, SendsHigherPrioritiesFirst)
+{
+    MockTelegram telegram;
+    auto bot = make_bot(telegram);
+
+    tg::SendQueue queue(bot, 1);
+
+    // the only sender gets stuck on the first message while the rest queues up behind it
+    telegram.hold();
+    queue.send(1, "first");
+
+    while(queue.pending() != 0) {
+        std::this_thread::sleep_for(1ms);
+    }
+
+    queue.send(2, "bulk", tg::SendPriority::Bulk);
+    queue.send(3, "normal", tg::SendPriority::Normal);
+    queue.send(4, "interactive", tg::SendPriority::Interactive);
+
+    telegram.release();
+
+    auto sent = telegram.wait_for_sent(4);
+
+    EXPECT_EQ(sent, (std::vector<MockTelegram::Sent> { { 1, "first" }, { 4, "interactive" }, { 3, "normal" }, { 2, "bulk" } }));
+}
+
+TEST(SendQueue, WaitsOutFloodControlAndRetries)
+{
+    MockTelegram telegram;
+    auto bot = make_bot(telegram);
+
+    tg::SendQueue queue(bot, 1);
+
+    telegram.fail_next(std::string(FloodResponse));
+
+    auto start = std::chrono::steady_clock::now();
+    queue.send(Group, "flooded");
+    queue.send(Group + 1, "other chat");
+
+    auto sent = telegram.wait_for_sent(2);
+
+    // flood control holds back the whole bot, not only the chat that hit it
+    EXPECT_GE(std::chrono::steady_clock::now() - start, 1s);
+    EXPECT_EQ(sent, (std::vector<MockTelegram::Sent> { { Group, "flooded" }, { Group + 1, "other chat" } }));
+    EXPECT_EQ(telegram.requests(), 3u);
+}
+
+TEST(SendQueue, DropsMessagesTelegramRejects)
+{
+    MockTelegram telegram;
+    auto bot = make_bot(telegram);
+
+    tg::SendQueue queue(bot);
+
+    telegram.fail_next(std::string(RejectedResponse));
+    queue.send(Group, "to nowhere");
+    queue.send(Group, "after it");
+
+    auto sent = telegram.wait_for_sent(1);
+
+    EXPECT_EQ(sent, (std::vector<MockTelegram::Sent> { { Group, "after it" } }));
+    EXPECT_EQ(telegram.requests(), 2u);
+    EXPECT_EQ(queue.pending(), 0u);
+}
@@ -0,0 +1,261 @@
+#include <gtest/gtest.h>
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <format>
+#include <future>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <thread>
+#include <vector>
+
+#include "session_executor.hxx"
+
+using namespace std::chrono_literals;
+
+namespace {
+
+constexpr std::size_t Workers = 4;
+constexpr std::size_t Producers = 4;
+constexpr std::size_t TasksPerProducer = 20000;
+
+// flags two tasks of one strand running at the same time
+struct Exclusivity
+{
+    std::atomic<int> running { 0 };
+    std::atomic<bool> overlapped { false };
+
+    void enter()
+    {
+        if(running.fetch_add(1) != 0) {
+            overlapped = true;
+        }
+    }
+
+    void leave()
+    {
+        running.fetch_sub(1);
+    }
+};
+
+}
+
+// the executor runs everything already submitted before its destructor returns, which is what the tests wait on
+
+TEST(SessionExecutor, RunsTasksOfAStrandInSubmissionOrder)
+{
+    tg::Strand strand(42);
+    std::vector<std::size_t> order;
+
+    {
+        tg::SessionExecutor executor(Workers);
+
+        for(std::size_t i = 0; i < TasksPerProducer; i++) {
+            executor.submit(strand, [&order, i] {
+                order.push_back(i);
+            });
+        }
+    }
+
+    ASSERT_EQ(order.size(), TasksPerProducer);
+
+    for(std::size_t i = 0; i < order.size(); i++) {
+        ASSERT_EQ(order[i], i);
+    }
+}
+
+TEST(SessionExecutor, KeepsOrderOfEveryProducerAndNeverRunsAStrandTwice)
+{
+    tg::Strand strand(7);
+    Exclusivity exclusivity;
+    std::array<std::vector<std::size_t>, Producers> seen;
+
+    {
+        tg::SessionExecutor executor(Workers);
+        std::vector<std::jthread> producers;
+
+        for(std::size_t producer = 0; producer < Producers; producer++) {
+            producers.emplace_back([&, producer] {
+                for(std::size_t i = 0; i < TasksPerProducer; i++) {
+                    executor.submit(strand, [&exclusivity, &seen, producer, i] {
+                        exclusivity.enter();
+                        seen[producer].push_back(i);
+                        exclusivity.leave();
+                    });
+                }
+            });
+        }
+    }
+
+    EXPECT_FALSE(exclusivity.overlapped);
+
+    for(const auto& order : seen) {
+        ASSERT_EQ(order.size(), TasksPerProducer);
+
+        for(std::size_t i = 0; i < order.size(); i++) {
+            ASSERT_EQ(order[i], i);
+        }
+    }
+}
+
+TEST(SessionExecutor, RunsManyStrandsIndependently)
+{
+    constexpr std::size_t Strands = 64;
+    constexpr std::size_t TasksPerStrand = 500;
+
+    std::vector<std::unique_ptr<tg::Strand>> strands;
+    std::vector<std::vector<std::size_t>> orders(Strands);
+
+    for(std::size_t i = 0; i < Strands; i++) {
+        // negative ids are groups, both kinds end up on some home worker
+        strands.push_back(std::make_unique<tg::Strand>(i % 2 ? -static_cast<std::int64_t>(i) : static_cast<std::int64_t>(i)));
+    }
+
+    {
+        tg::SessionExecutor executor(Workers);
+
+        for(std::size_t task = 0; task < TasksPerStrand; task++) {
+            for(std::size_t i = 0; i < Strands; i++) {
+                executor.submit(*strands[i], [&order = orders[i], task] {
+                    order.push_back(task);
+                });
+            }
+        }
+    }
+
+    for(const auto& order : orders) {
+        ASSERT_EQ(order.size(), TasksPerStrand);
+
+        for(std::size_t i = 0; i < order.size(); i++) {
+            ASSERT_EQ(order[i], i);
+        }
+    }
+}
+
+TEST(SessionExecutor, TasksSubmittedFromATaskRunAfterIt)
+{
+    tg::Strand strand(1);
+    std::vector<int> order;
+
+    {
+        tg::SessionExecutor executor(Workers);
+
+        executor.submit(strand, [&executor, &strand, &order] {
+            executor.submit(strand, [&order] {
+                order.push_back(2);
+            });
+
+            order.push_back(1);
+        });
+    }
+
+    EXPECT_EQ(order, (std::vector<int> { 1, 2 }));
+}
+
+TEST(SessionExecutor, RunsDelayedTasksNoEarlierThanAskedAndInDeadlineOrder)
+{
+    tg::Strand strand(1);
+    std::vector<int> order;
+    std::promise<std::chrono::steady_clock::time_point> done;
+    auto fired = done.get_future();
+
+    tg::SessionExecutor executor(Workers);
+
+    auto start = std::chrono::steady_clock::now();
+
+    executor.submit_after(strand, 80ms, [&order, &done] {
+        order.push_back(2);
+        done.set_value(std::chrono::steady_clock::now());
+    });
+
+    executor.submit_after(strand, 40ms, [&order] {
+        order.push_back(1);
+    });
+
+    ASSERT_EQ(fired.wait_for(5s), std::future_status::ready);
+
+    EXPECT_GE(fired.get() - start, 80ms);
+    EXPECT_EQ(order, (std::vector<int> { 1, 2 }));
+}
+
+TEST(SessionExecutor, RunsIdleTasksOnceNothingElseWaits)
+{
+    tg::Strand strand(1);
+    std::promise<void> done;
+    auto ran = done.get_future();
+
+    tg::SessionExecutor executor(Workers);
+
+    executor.submit_when_idle(strand, [&done] {
+        done.set_value();
+    });
+
+    EXPECT_EQ(ran.wait_for(5s), std::future_status::ready);
+}
+
+namespace {
+
+constexpr std::size_t BenchmarkStrands = 1000;
+constexpr std::size_t BenchmarkTasks = 200000;
+
+// a few microseconds of work, about what a light handler costs
+void handler_work()
+{
+    volatile std::uint64_t sink = 0;
+
+    for(std::uint64_t i = 0; i < 2000; i++) {
+        sink = sink + i;
+    }
+}
+
+std::chrono::duration<double, std::milli> run_load(const std::vector<std::size_t>& targets)
+{
+    std::vector<std::unique_ptr<tg::Strand>> strands;
+
+    for(std::size_t i = 0; i < BenchmarkStrands; i++) {
+        strands.push_back(std::make_unique<tg::Strand>(static_cast<std::int64_t>(i)));
+    }
+
+    auto start = std::chrono::steady_clock::now();
+
+    {
+        tg::SessionExecutor executor;
+
+        for(auto target : targets) {
+            executor.submit(*strands[target], handler_work);
+        }
+    }
+
+    return std::chrono::steady_clock::now() - start;
+}
+
+}
+
+// a measurement, not a check: run with --gtest_also_run_disabled_tests --gtest_filter=*Benchmark*
+// and compare how far the skewed load falls behind the uniform one
+TEST(SessionExecutorBenchmark, DISABLED_SkewedAgainstUniformLoad)
+{
+    std::mt19937 random(1);
+    std::uniform_int_distribution<std::size_t> anyChat(0, BenchmarkStrands - 1);
+    std::uniform_int_distribution<std::size_t> hotChat(0, 9);
+    std::bernoulli_distribution hot(0.9);
+
+    std::vector<std::size_t> uniform;
+    std::vector<std::size_t> skewed;
+
+    for(std::size_t i = 0; i < BenchmarkTasks; i++) {
+        uniform.push_back(anyChat(random));
+
+        // nine updates in ten go to the ten busiest chats
+        skewed.push_back(hot(random) ? hotChat(random) : anyChat(random));
+    }
+
+    auto uniformTime = run_load(uniform);
+    auto skewedTime = run_load(skewed);
+
+    std::cout << std::format("uniform: {:.1f} ms, skewed: {:.1f} ms, {} tasks over {} strands\n",
+        uniformTime.count(), skewedTime.count(), BenchmarkTasks, BenchmarkStrands);
+}
@@ -0,0 +1,180 @@
+#include <gtest/gtest.h>
+
+#include <chrono>
+#include <cstdint>
+#include <random>
+#include <vector>
+
+#include "timer_wheel.hxx"
+
+using namespace std::chrono_literals;
+
+namespace {
+
+using Wheel = tg::TimerWheel<std::uint64_t>;
+using Clock = Wheel::Clock;
+
+constexpr auto Tick = Wheel::Tick;
+
+// the tick a deadline is rounded up to, what the wheel fires it on
+std::uint64_t due_tick(Clock::time_point start, Clock::time_point deadline)
+{
+    return static_cast<std::uint64_t>((deadline - start + Tick - Clock::duration { 1 }) / Tick);
+}
+
+std::uint64_t tick_of(Clock::time_point start, Clock::time_point now)
+{
+    return static_cast<std::uint64_t>((now - start) / Tick);
+}
+
+}
+
+TEST(TimerWheel, StartsEmpty)
+{
+    Wheel wheel;
+
+    EXPECT_EQ(wheel.size(), 0u);
+    EXPECT_FALSE(wheel.next_wakeup());
+}
+
+TEST(TimerWheel, FiresOnTheRoundedUpTickAndNotBefore)
+{
+    auto start = Clock::now();
+    Wheel wheel(start);
+    std::vector<std::uint64_t> expired;
+
+    wheel.schedule(start + 25ms, 1);
+    EXPECT_EQ(wheel.size(), 1u);
+
+    wheel.advance(start + 29ms, expired);
+    EXPECT_TRUE(expired.empty());
+
+    wheel.advance(start + 30ms, expired);
+    EXPECT_EQ(expired, (std::vector<std::uint64_t> { 1 }));
+    EXPECT_EQ(wheel.size(), 0u);
+}
+
+TEST(TimerWheel, PastDeadlinesFireOnTheNextTick)
+{
+    auto start = Clock::now();
+    Wheel wheel(start);
+    std::vector<std::uint64_t> expired;
+
+    wheel.advance(start + 100ms, expired);
+    wheel.schedule(start, 1);
+
+    wheel.advance(start + 105ms, expired);
+    EXPECT_TRUE(expired.empty());
+
+    wheel.advance(start + 110ms, expired);
+    EXPECT_EQ(expired, (std::vector<std::uint64_t> { 1 }));
+}
+
+TEST(TimerWheel, ExpiresInDeadlineOrderWithinOneAdvance)
+{
+    auto start = Clock::now();
+    Wheel wheel(start);
+    std::vector<std::uint64_t> expired;
+
+    wheel.schedule(start + 5s, 3);
+    wheel.schedule(start + 50ms, 1);
+    wheel.schedule(start + 3s, 2);
+
+    wheel.advance(start + 10s, expired);
+    EXPECT_EQ(expired, (std::vector<std::uint64_t> { 1, 2, 3 }));
+}
+
+TEST(TimerWheel, WakeupsLeadExactlyToTheDeadline)
+{
+    // a caller sleeping until next_wakeup each time must neither oversleep a timer nor spin before it
+    auto start = Clock::now();
+
+    for(auto delay : { Clock::duration { 30ms }, Clock::duration { 4s }, Clock::duration { 3min }, Clock::duration { 26h }, Clock::duration { 10 * 24h } }) {
+        Wheel wheel(start);
+        std::vector<std::uint64_t> expired;
+
+        auto deadline = start + delay;
+        auto due = due_tick(start, deadline);
+
+        wheel.schedule(deadline, 1);
+
+        auto now = start;
+        std::size_t wakeups = 0;
+
+        while(expired.empty()) {
+            auto wakeup = wheel.next_wakeup();
+
+            ASSERT_TRUE(wakeup);
+            ASSERT_LE(tick_of(start, wakeup.value()), due);
+
+            now = wakeup.value();
+            wheel.advance(now, expired);
+            wakeups++;
+        }
+
+        EXPECT_EQ(tick_of(start, now), due);
+
+        // at most a rotation per level, empty stretches are skipped whole
+        EXPECT_LT(wakeups, 512u);
+    }
+}
+
+TEST(TimerWheel, NeverFiresEarlyOrLateAcrossAllLevels)
+{
+    constexpr std::size_t Timers = 20000;
+
+    // spread over every level and past the last one, the overflow list starts at 2^26 ticks (~7.7 days)
+    constexpr std::uint64_t MaxTicks = std::uint64_t { 1 } << 28;
+
+    auto start = Clock::now();
+    Wheel wheel(start);
+
+    std::mt19937_64 random(1);
+    std::vector<std::uint64_t> due(Timers);
+
+    for(std::size_t i = 0; i < Timers; i++) {
+        // a quarter close by so the finest levels see plenty of traffic
+        auto range = i % 4 == 0 ? 1024 : MaxTicks;
+        auto offset = std::uniform_int_distribution<std::uint64_t>(1, range * 10)(random);
+
+        auto deadline = start + std::chrono::milliseconds { offset };
+        due[i] = due_tick(start, deadline);
+
+        wheel.schedule(deadline, i);
+    }
+
+    std::vector<bool> fired(Timers, false);
+    std::vector<std::uint64_t> expired;
+
+    auto now = start;
+    std::uint64_t previous = 0;
+    std::size_t count = 0;
+
+    while(count < Timers) {
+        // mostly short steps with the odd jump over whole rotations
+        auto step = random() % 8 == 0
+            ? std::chrono::milliseconds { std::uniform_int_distribution<std::uint64_t>(1, MaxTicks)(random) }
+            : std::chrono::milliseconds { std::uniform_int_distribution<std::uint64_t>(1, 5000)(random) };
+
+        now += step;
+        wheel.advance(now, expired);
+
+        auto current = tick_of(start, now);
+
+        for(auto index : expired) {
+            ASSERT_FALSE(fired[index]);
+            ASSERT_LE(due[index], current) << "timer " << index << " fired early";
+            ASSERT_GT(due[index], previous) << "timer " << index << " fired late";
+
+            fired[index] = true;
+            count++;
+        }
+
+        expired.clear();
+        previous = current;
+
+        ASSERT_EQ(wheel.size(), Timers - count);
+    }
+
+    EXPECT_FALSE(wheel.next_wakeup());
+}
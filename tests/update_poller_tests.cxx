@@ -0,0 +1,264 @@
+#include <gtest/gtest.h>
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <format>
+#include <future>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "session_executor.hxx"
+#include "update_poller.hxx"
+
+#include "mock_telegram.hxx"
+
+using namespace std::chrono_literals;
+
+namespace {
+
+using tests::MockTelegram;
+using tests::make_bot;
+
+constexpr std::string_view BadGateway = R"({"ok":false,"error_code":502,"description":"Bad Gateway"})";
+
+std::string message_update(std::int32_t updateId, std::int64_t chatId)
+{
+    return std::format(R"({{"update_id":{},"message":{{"message_id":{},"date":0,"chat":{{"id":{},"type":"private"}},"text":"hi"}}}})",
+        updateId, updateId, chatId);
+}
+
+std::string callback_update(std::int32_t updateId, std::int64_t chatId)
+{
+    return std::format(R"({{"update_id":{},"callback_query":{{"id":"{}","from":{{"id":{},"is_bot":false,"first_name":"Test"}},)"
+        R"("message":{{"message_id":1,"date":0,"chat":{{"id":{},"type":"private"}}}},"chat_instance":"1","data":"start;go"}}}})",
+        updateId, updateId, chatId, chatId);
+}
+
+std::string batch(const std::vector<std::string>& updates)
+{
+    std::string result;
+
+    for(const auto& update : updates) {
+        result += result.empty() ? update : "," + update;
+    }
+
+    return std::format(R"({{"ok":true,"result":[{}]}})", result);
+}
+
+// hands updates to a strand per chat the way BotRuntime::dispatch hands them to sessions, and records what ran
+class Router
+{
+public:
+    explicit Router(std::size_t workers)
+        : _executor(std::make_unique<tg::SessionExecutor>(workers))
+    {
+    }
+
+    // the first update of a blocked chat waits on the future before it counts as handled
+    void block(std::int64_t chatId, std::shared_future<void> until)
+    {
+        _blocked[chatId] = std::move(until);
+    }
+
+    void route(const TgBot::Update::Ptr& update)
+    {
+        auto chatId = tg::chat_of(update);
+        ASSERT_TRUE(chatId);
+
+        auto& strand = _strands[chatId.value()];
+
+        if(!strand) {
+            strand = std::make_unique<tg::Strand>(chatId.value());
+        }
+
+        std::shared_future<void> until;
+
+        if(auto blocked = _blocked.find(chatId.value()); blocked != _blocked.end()) {
+            until = std::move(blocked->second);
+            _blocked.erase(blocked);
+        }
+
+        _executor->submit(*strand, [this, chatId = chatId.value(), updateId = update->updateId, until] {
+            if(until.valid()) {
+                until.wait();
+            }
+
+            std::unique_lock lock(_mutex);
+            _handled[chatId].push_back(updateId);
+            _count++;
+            _changed.notify_all();
+        });
+    }
+
+    bool wait_for(std::size_t count, std::chrono::milliseconds timeout = 10s)
+    {
+        std::unique_lock lock(_mutex);
+
+        return _changed.wait_for(lock, timeout, [this, count] {
+            return _count >= count;
+        });
+    }
+
+    std::map<std::int64_t, std::vector<std::int32_t>> handled()
+    {
+        std::unique_lock lock(_mutex);
+        return _handled;
+    }
+
+private:
+    std::mutex _mutex;
+    std::condition_variable _changed;
+    std::map<std::int64_t, std::vector<std::int32_t>> _handled;
+    std::size_t _count { 0 };
+
+    std::map<std::int64_t, std::unique_ptr<tg::Strand>> _strands;
+    std::map<std::int64_t, std::shared_future<void>> _blocked;
+
+    // declared last so it is joined before anything its tasks touch is gone
+    std::unique_ptr<tg::SessionExecutor> _executor;
+};
+
+}
+
+TEST(UpdatePoller, AdvancesTheOffsetPastEachBatchBeforeDispatch)
+{
+    MockTelegram telegram;
+    tg::UpdatePoller poller(make_bot(telegram));
+
+    telegram.answer_next_poll(batch({ message_update(7, 1), message_update(5, 2), message_update(6, 1) }));
+    telegram.answer_next_poll(batch({ message_update(8, 3) }));
+
+    // nothing of the batch has been handled yet, a handler that throws or hangs can not get it redelivered
+    auto first = poller.poll();
+    ASSERT_EQ(first.size(), 3u);
+    EXPECT_EQ(poller.offset(), 8);
+
+    auto second = poller.poll();
+    ASSERT_EQ(second.size(), 1u);
+    EXPECT_EQ(poller.offset(), 9);
+
+    poller.poll();
+
+    auto polls = telegram.polls();
+    ASSERT_EQ(polls.size(), 3u);
+    EXPECT_EQ(polls[0].offset, 0);
+    EXPECT_EQ(polls[1].offset, 8);
+    EXPECT_EQ(polls[2].offset, 9);
+}
+
+TEST(UpdatePoller, RoutesFullBatchesByChat)
+{
+    constexpr std::int64_t Chats = 7;
+    constexpr std::int32_t Updates = tg::MaxUpdatesBatch;
+
+    MockTelegram telegram;
+    tg::UpdatePoller poller(make_bot(telegram));
+
+    std::vector<std::string> updates;
+    std::map<std::int64_t, std::vector<std::int32_t>> expected;
+
+    for(std::int32_t updateId = 1; updateId <= Updates; updateId++) {
+        std::int64_t chatId = 100 + updateId % Chats;
+
+        updates.push_back(updateId % 3 == 0 ? callback_update(updateId, chatId) : message_update(updateId, chatId));
+        expected[chatId].push_back(updateId);
+    }
+
+    telegram.answer_next_poll(batch(updates));
+
+    Router router(4);
+
+    for(const auto& update : poller.poll()) {
+        router.route(update);
+    }
+
+    ASSERT_TRUE(router.wait_for(Updates));
+
+    EXPECT_EQ(router.handled(), expected);
+    EXPECT_EQ(telegram.polls().front().limit, tg::MaxUpdatesBatch);
+    EXPECT_EQ(poller.offset(), Updates + 1);
+}
+
+TEST(UpdatePoller, BlockedChatDoesNotStallIntake)
+{
+    MockTelegram telegram;
+    tg::UpdatePoller poller(make_bot(telegram));
+
+    telegram.answer_next_poll(batch({ message_update(1, 1), message_update(2, 2), message_update(3, 1), message_update(4, 3) }));
+    telegram.answer_next_poll(batch({ message_update(5, 2), message_update(6, 1), message_update(7, 3) }));
+
+    // fewer workers than chats, a stuck chat must not hold up the others
+    Router router(2);
+
+    // declared after the router, a failed assertion breaks the promise and lets the executor finish
+    std::promise<void> unblock;
+    router.block(1, unblock.get_future().share());
+
+    for(std::size_t i = 0; i < 2; i++) {
+        for(const auto& update : poller.poll()) {
+            router.route(update);
+        }
+    }
+
+    // both batches were taken in and everything of the other chats ran while chat 1 is still stuck on its first update
+    ASSERT_TRUE(router.wait_for(4));
+    EXPECT_EQ(poller.offset(), 8);
+
+    auto handled = router.handled();
+    EXPECT_FALSE(handled.contains(1));
+    EXPECT_EQ(handled[2], (std::vector<std::int32_t> { 2, 5 }));
+    EXPECT_EQ(handled[3], (std::vector<std::int32_t> { 4, 7 }));
+
+    unblock.set_value();
+
+    ASSERT_TRUE(router.wait_for(7));
+    EXPECT_EQ(router.handled()[1], (std::vector<std::int32_t> { 1, 3, 6 }));
+}
+
+TEST(UpdatePoller, BacksOffAfterErrors)
+{
+    MockTelegram telegram;
+    tg::UpdatePoller poller(make_bot(telegram));
+
+    telegram.answer_next_poll(std::string(BadGateway));
+    telegram.answer_next_poll(std::string(BadGateway));
+    telegram.answer_next_poll(batch({ message_update(1, 1) }));
+    telegram.answer_next_poll(std::string(BadGateway));
+
+    auto timed_poll = [&poller] {
+        auto start = std::chrono::steady_clock::now();
+        auto updates = poller.poll();
+
+        return std::make_pair(updates.size(), std::chrono::steady_clock::now() - start);
+    };
+
+    // the wait doubles with every failure in a row
+    auto [firstCount, firstWait] = timed_poll();
+    EXPECT_EQ(firstCount, 0u);
+    EXPECT_GE(firstWait, 250ms);
+
+    auto [secondCount, secondWait] = timed_poll();
+    EXPECT_EQ(secondCount, 0u);
+    EXPECT_GE(secondWait, 500ms);
+
+    auto [thirdCount, thirdWait] = timed_poll();
+    EXPECT_EQ(thirdCount, 1u);
+    EXPECT_LT(thirdWait, 250ms);
+
+    // and starts over once a request went through
+    auto [fourthCount, fourthWait] = timed_poll();
+    EXPECT_EQ(fourthCount, 0u);
+    EXPECT_GE(fourthWait, 250ms);
+    EXPECT_LT(fourthWait, 500ms);
+
+    // failed requests never move the offset
+    auto polls = telegram.polls();
+    ASSERT_EQ(polls.size(), 4u);
+    EXPECT_EQ(polls[1].offset, 0);
+    EXPECT_EQ(polls[2].offset, 0);
+    EXPECT_EQ(polls[3].offset, 2);
+}
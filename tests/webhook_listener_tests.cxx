@@ -0,0 +1,93 @@
+#include <gtest/gtest.h>
+
+#include <chrono>
+#include <cstdint>
+#include <format>
+#include <future>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "webhook_listener.hxx"
+
+using namespace std::chrono_literals;
+
+namespace {
+
+// recorded telegram deliveries, replayed against a listener on a loopback port
+constexpr std::string_view FirstUpdate =
+    R"({"update_id":10001,"message":{"message_id":7,"date":1700000000,"chat":{"id":42,"type":"private","first_name":"Test"},)"
+    R"("from":{"id":42,"is_bot":false,"first_name":"Test"},"text":"/start"}})";
+
+constexpr std::string_view SecondUpdate =
+    R"({"update_id":10002,"message":{"message_id":8,"date":1700000001,"chat":{"id":42,"type":"private","first_name":"Test"},)"
+    R"("from":{"id":42,"is_bot":false,"first_name":"Test"},"text":"hello"}})";
+
+constexpr std::string_view HookPath = "/hook";
+constexpr std::string_view Secret = "s3cret";
+
+std::string delivery(std::string_view path, std::string_view secret, std::string_view body)
+{
+    return std::format("POST {} HTTP/1.1\r\nHost: localhost\r\nContent-Type: application/json\r\nContent-Length: {}\r\n"
+        "X-Telegram-Bot-Api-Secret-Token: {}\r\n\r\n{}", path, body.size(), secret, body);
+}
+
+// sends the requests one by one over a single connection, like telegram does, and returns the status codes
+std::vector<std::string> replay(std::uint16_t port, std::vector<std::string> requests)
+{
+    boost::asio::io_context io;
+    boost::asio::ip::tcp::socket socket(io);
+    socket.connect({ boost::asio::ip::address_v4::loopback(), port });
+
+    boost::asio::streambuf buffer;
+    std::vector<std::string> statuses;
+
+    for(const auto& request : requests) {
+        boost::asio::write(socket, boost::asio::buffer(request));
+
+        auto size = boost::asio::read_until(socket, buffer, "\r\n\r\n");
+        std::string_view head(static_cast<const char*>(buffer.data().data()), size);
+
+        statuses.emplace_back(head.substr(head.find(' ') + 1, 3));
+        buffer.consume(size);
+    }
+
+    return statuses;
+}
+
+}
+
+TEST(WebhookListener, DeliversReplayedUpdatesInOrder)
+{
+    std::vector<std::int64_t> received;
+
+    tg::WebhookSettings settings;
+    settings.port = 0;
+    settings.path = HookPath;
+    settings.secret = Secret;
+
+    tg::WebhookListener listener(settings, [&received](const TgBot::Update::Ptr& update) {
+        received.push_back(update->updateId);
+    });
+
+    // a wrong secret closes the connection, so it goes last
+    auto client = std::async(std::launch::async, replay, listener.port(), std::vector<std::string> {
+        delivery(HookPath, Secret, FirstUpdate),
+        delivery(HookPath, Secret, SecondUpdate),
+        delivery("/elsewhere", Secret, FirstUpdate),
+        delivery(HookPath, Secret, "not json"),
+        delivery(HookPath, "wrong", SecondUpdate),
+    });
+
+    // the listener delivers on the thread that runs it, the way the runtime intake does
+    auto deadline = std::chrono::steady_clock::now() + 5s;
+
+    while(client.wait_for(0s) != std::future_status::ready && std::chrono::steady_clock::now() < deadline) {
+        listener.run_for(10ms);
+    }
+
+    ASSERT_EQ(client.wait_for(0s), std::future_status::ready);
+
+    EXPECT_EQ(client.get(), (std::vector<std::string> { "200", "200", "404", "400", "401" }));
+    EXPECT_EQ(received, (std::vector<std::int64_t> { 10001, 10002 }));
+}
@@ -0,0 +1,81 @@
+#include <gtest/gtest.h>
+
+#include <string_view>
+
+#include "webhook_request.hxx"
+
+TEST(WebhookRequest, ParsesATelegramDelivery)
+{
+    constexpr std::string_view Head =
+        "POST /hook?token=1 HTTP/1.1\r\n"
+        "Host: bot.example.com\r\n"
+        "Content-Type: application/json\r\n"
+        "Content-Length: 321\r\n"
+        "X-Telegram-Bot-Api-Secret-Token:  s3cret \r\n"
+        "Connection: keep-alive\r\n"
+        "\r\n";
+
+    auto request = tg::parse_request_head(Head);
+
+    ASSERT_TRUE(request);
+    EXPECT_EQ(request->method, "POST");
+    EXPECT_EQ(request->path, "/hook");
+    EXPECT_EQ(request->secret, "s3cret");
+    EXPECT_EQ(request->contentLength, 321u);
+    EXPECT_FALSE(request->close);
+}
+
+TEST(WebhookRequest, MatchesHeaderNamesCaseInsensitively)
+{
+    auto request = tg::parse_request_head("POST / HTTP/1.1\r\ncontent-length: 5\r\nCONNECTION: Close\r\nx-telegram-bot-api-secret-token: abc\r\n\r\n");
+
+    ASSERT_TRUE(request);
+    EXPECT_EQ(request->contentLength, 5u);
+    EXPECT_EQ(request->secret, "abc");
+    EXPECT_TRUE(request->close);
+}
+
+TEST(WebhookRequest, ClosesHttp10UnlessKeptAlive)
+{
+    auto plain = tg::parse_request_head("POST / HTTP/1.0\r\n\r\n");
+    auto keptAlive = tg::parse_request_head("POST / HTTP/1.0\r\nConnection: keep-alive\r\n\r\n");
+
+    ASSERT_TRUE(plain);
+    ASSERT_TRUE(keptAlive);
+    EXPECT_TRUE(plain->close);
+    EXPECT_FALSE(keptAlive->close);
+}
+
+TEST(WebhookRequest, DefaultsToAnEmptyBody)
+{
+    auto request = tg::parse_request_head("GET /health HTTP/1.1\r\nHost: localhost\r\n\r\n");
+
+    ASSERT_TRUE(request);
+    EXPECT_EQ(request->method, "GET");
+    EXPECT_EQ(request->path, "/health");
+    EXPECT_EQ(request->contentLength, 0u);
+    EXPECT_TRUE(request->secret.empty());
+}
+
+TEST(WebhookRequest, SkipsLinesWithoutAColon)
+{
+    auto request = tg::parse_request_head("POST / HTTP/1.1\r\nnonsense\r\nContent-Length: 2\r\n\r\n");
+
+    ASSERT_TRUE(request);
+    EXPECT_EQ(request->contentLength, 2u);
+}
+
+TEST(WebhookRequest, RejectsMalformedRequestLines)
+{
+    EXPECT_FALSE(tg::parse_request_head("GARBAGE\r\n\r\n"));
+    EXPECT_FALSE(tg::parse_request_head("POST /\r\n\r\n"));
+    EXPECT_FALSE(tg::parse_request_head(""));
+}
+
+TEST(WebhookRequest, RejectsMalformedContentLength)
+{
+    EXPECT_FALSE(tg::parse_request_head("POST / HTTP/1.1\r\nContent-Length: abc\r\n\r\n"));
+    EXPECT_FALSE(tg::parse_request_head("POST / HTTP/1.1\r\nContent-Length: 12abc\r\n\r\n"));
+    EXPECT_FALSE(tg::parse_request_head("POST / HTTP/1.1\r\nContent-Length: -1\r\n\r\n"));
+    EXPECT_FALSE(tg::parse_request_head("POST / HTTP/1.1\r\nContent-Length: 99999999999999999999999\r\n\r\n"));
+}
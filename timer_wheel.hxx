@@ -0,0 +1,202 @@
+#pragma once
+
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <optional>
+#include <utility>
+#include <vector>
+
+namespace tg {
+
+// hierarchical timing wheel (Varghese & Lauck): scheduling is O(1), advancing costs O(1) per expired or
+// cascaded timer, and ticks with nothing due are skipped in whole rotations. not thread safe
+template<typename Payload>
+class TimerWheel
+{
+public:
+    using Clock = std::chrono::steady_clock;
+
+    static constexpr Clock::duration Tick = std::chrono::milliseconds { 10 };
+
+    explicit TimerWheel(Clock::time_point start = Clock::now());
+
+    void schedule(Clock::time_point deadline, Payload payload);
+
+    // moves everything due at `now` to `expired`
+    void advance(Clock::time_point now, std::vector<Payload>& expired);
+
+    // when advance can have something to do next, nullopt while the wheel is empty
+    std::optional<Clock::time_point> next_wakeup() const;
+
+    std::size_t size() const;
+
+private:
+    // level 0 has 256 single-tick slots, every next level 64 slots covering a whole rotation of the previous one
+    static constexpr std::size_t Levels = 4;
+    static constexpr std::array<std::uint32_t, Levels> Shift = { 0, 8, 14, 20 };
+    static constexpr std::array<std::uint32_t, Levels> Bits = { 8, 6, 6, 6 };
+
+    // timers past the last level, looked at again once the last level completes a rotation
+    static constexpr std::uint32_t OverflowShift = 26;
+
+    struct Entry
+    {
+        std::uint64_t tick;
+        Payload payload;
+    };
+
+    std::uint64_t to_tick(Clock::time_point time) const;
+
+    void place(Entry&& entry);
+    void cascade(std::vector<Entry>& slot);
+
+    // granularity of the finest level holding anything, in ticks
+    std::uint64_t skip_granularity() const;
+
+    Clock::time_point _start;
+    std::uint64_t _current { 0 };
+
+    std::array<std::vector<std::vector<Entry>>, Levels> _slots;
+    std::array<std::size_t, Levels> _counts {};
+
+    std::vector<Entry> _overflow;
+};
+
+template<typename Payload>
+TimerWheel<Payload>::TimerWheel(Clock::time_point start) : _start(start)
+{
+    for(std::size_t level = 0; level < Levels; level++) {
+        _slots[level].resize(std::size_t { 1 } << Bits[level]);
+    }
+}
+
+template<typename Payload>
+void TimerWheel<Payload>::schedule(Clock::time_point deadline, Payload payload)
+{
+    // deadlines are rounded up so a timer never fires early, and never in the tick it was scheduled in
+    // because the current slot was already expired
+    auto tick = std::max(to_tick(deadline + Tick - Clock::duration { 1 }), _current + 1);
+    place({ tick, std::move(payload) });
+}
+
+template<typename Payload>
+void TimerWheel<Payload>::advance(Clock::time_point now, std::vector<Payload>& expired)
+{
+    auto target = to_tick(now);
+
+    while(_current < target) {
+        auto granularity = skip_granularity();
+        auto next = (_current / granularity + 1) * granularity;
+
+        // nothing can become due before the next boundary of the finest busy level
+        if(next > target) {
+            _current = target;
+            break;
+        }
+
+        _current = next;
+
+        if((_current & ((std::uint64_t { 1 } << OverflowShift) - 1)) == 0) {
+            cascade(_overflow);
+        }
+
+        for(auto level = Levels - 1; level > 0; level--) {
+            if((_current & ((std::uint64_t { 1 } << Shift[level]) - 1)) == 0) {
+                cascade(_slots[level][(_current >> Shift[level]) & ((1u << Bits[level]) - 1)]);
+            }
+        }
+
+        auto& slot = _slots[0][_current & ((1u << Bits[0]) - 1)];
+
+        for(auto& entry : slot) {
+            expired.push_back(std::move(entry.payload));
+        }
+
+        _counts[0] -= slot.size();
+        slot.clear();
+    }
+}
+
+template<typename Payload>
+std::optional<typename TimerWheel<Payload>::Clock::time_point> TimerWheel<Payload>::next_wakeup() const
+{
+    if(size() == 0) {
+        return std::nullopt;
+    }
+
+    auto granularity = skip_granularity();
+    auto next = (_current / granularity + 1) * granularity;
+
+    return _start + Tick * next;
+}
+
+template<typename Payload>
+std::size_t TimerWheel<Payload>::size() const
+{
+    auto result = _overflow.size();
+
+    for(auto count : _counts) {
+        result += count;
+    }
+
+    return result;
+}
+
+template<typename Payload>
+std::uint64_t TimerWheel<Payload>::to_tick(Clock::time_point time) const
+{
+    if(time <= _start) {
+        return 0;
+    }
+
+    return static_cast<std::uint64_t>((time - _start) / Tick);
+}
+
+template<typename Payload>
+void TimerWheel<Payload>::place(Entry&& entry)
+{
+    // a timer goes to the finest level whose current rotation it falls into
+    for(std::size_t level = 0; level < Levels; level++) {
+        auto rotation = Shift[level] + Bits[level];
+
+        if((entry.tick >> rotation) == (_current >> rotation)) {
+            _slots[level][(entry.tick >> Shift[level]) & ((1u << Bits[level]) - 1)].push_back(std::move(entry));
+            _counts[level]++;
+            return;
+        }
+    }
+
+    _overflow.push_back(std::move(entry));
+}
+
+template<typename Payload>
+void TimerWheel<Payload>::cascade(std::vector<Entry>& slot)
+{
+    auto entries = std::move(slot);
+    slot.clear();
+
+    for(std::size_t level = 0; level < Levels; level++) {
+        if(&slot >= _slots[level].data() && &slot < _slots[level].data() + _slots[level].size()) {
+            _counts[level] -= entries.size();
+        }
+    }
+
+    for(auto& entry : entries) {
+        place(std::move(entry));
+    }
+}
+
+template<typename Payload>
+std::uint64_t TimerWheel<Payload>::skip_granularity() const
+{
+    for(std::size_t level = 0; level < Levels; level++) {
+        if(_counts[level] > 0) {
+            return std::uint64_t { 1 } << Shift[level];
+        }
+    }
+
+    return std::uint64_t { 1 } << OverflowShift;
+}
+
+}
@@ -0,0 +1,72 @@
+#include "update_poller.hxx"
+
+#include <algorithm>
+#include <thread>
+
+#include "logdef.hxx"
+
+namespace tg::internal {
+
+constexpr std::chrono::milliseconds MinBackoff { 250 };
+constexpr std::chrono::milliseconds MaxBackoff { 30'000 };
+
+}
+
+TgBot::StringArrayPtr tg::allowed_updates()
+{
+    return std::make_shared<std::vector<std::string>>(std::vector<std::string> { "message", "callback_query" });
+}
+
+std::optional<std::int64_t> tg::chat_of(const TgBot::Update::Ptr& update)
+{
+    if(update->message && update->message->chat) {
+        return update->message->chat->id;
+    }
+
+    if(update->callbackQuery) {
+        if(update->callbackQuery->message && update->callbackQuery->message->chat) {
+            return update->callbackQuery->message->chat->id;
+        }
+
+        if(update->callbackQuery->from) {
+            return update->callbackQuery->from->id;
+        }
+    }
+
+    return std::nullopt;
+}
+
+tg::UpdatePoller::UpdatePoller(const std::shared_ptr<TgBot::Bot>& bot, std::int32_t batchSize, std::chrono::seconds timeout)
+    : _bot(bot), _batchSize(std::clamp(batchSize, 1, MaxUpdatesBatch)), _timeout(static_cast<std::int32_t>(timeout.count()))
+{
+    _allowedUpdates = allowed_updates();
+}
+
+std::vector<TgBot::Update::Ptr> tg::UpdatePoller::poll()
+{
+    std::vector<TgBot::Update::Ptr> updates;
+
+    try {
+        updates = _bot->getApi().getUpdates(_offset, _batchSize, _timeout, _allowedUpdates);
+        _backoff = std::chrono::milliseconds { 0 };
+    } catch(const std::exception& e) {
+        _backoff = std::clamp(_backoff * 2, internal::MinBackoff, internal::MaxBackoff);
+        luabot_logErr("getUpdates failed: {}, retrying in {} ms", e.what(), _backoff.count());
+
+        std::this_thread::sleep_for(_backoff);
+        return {};
+    }
+
+    // offset is advanced before dispatching, so a handler that throws or hangs can never make
+    // telegram redeliver the whole batch on the next request
+    for(const auto& update : updates) {
+        _offset = std::max(_offset, update->updateId + 1);
+    }
+
+    return updates;
+}
+
+std::int32_t tg::UpdatePoller::offset() const
+{
+    return _offset;
+}
@@ -0,0 +1,41 @@
+#pragma once
+
+#include <chrono>
+#include <memory>
+#include <optional>
+#include <vector>
+
+#include <tgbot/tgbot.h>
+
+namespace tg {
+
+constexpr std::int32_t MaxUpdatesBatch = 100;
+constexpr std::chrono::seconds LongPollTimeout { 10 };
+
+// update kinds the runtime handles, requested both by polling and by the webhook registration
+TgBot::StringArrayPtr allowed_updates();
+
+// the chat an update is routed to, its session handles the updates of that chat in order
+std::optional<std::int64_t> chat_of(const TgBot::Update::Ptr& update);
+
+class UpdatePoller
+{
+public:
+    UpdatePoller(const std::shared_ptr<TgBot::Bot>& bot, std::int32_t batchSize = MaxUpdatesBatch, std::chrono::seconds timeout = LongPollTimeout);
+
+    std::vector<TgBot::Update::Ptr> poll();
+
+    std::int32_t offset() const;
+
+private:
+    std::shared_ptr<TgBot::Bot> _bot;
+    TgBot::StringArrayPtr _allowedUpdates;
+
+    std::int32_t _offset { 0 };
+    std::int32_t _batchSize;
+    std::int32_t _timeout;
+
+    std::chrono::milliseconds _backoff { 0 };
+};
+
+}
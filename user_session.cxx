@@ -1,15 +1,37 @@
+#include <algorithm>
 #include <ranges>
 
 #include "user_session.hxx"
 
+#include "lua_api_functions.hxx"
 #include "lua_api_types.hxx"
+#include "lua_persist.hxx"
 
 #include "strings.hxx"
 
 #include "logdef.hxx"
 
-tg::UserSession::UserSession(const std::shared_ptr<TgBot::Bot>& bot, const BytecodeMap& commands) : _bot(bot) {
-    auto commandBoxResult = lua::make_state_from_cached_bytecode(commands);
+namespace tg::internal {
+
+SendPriority send_priority(lua::api::types::messages::SendPriority priority)
+{
+    switch(priority) {
+    case lua::api::types::messages::SendPriority::Normal:
+        return SendPriority::Normal;
+    case lua::api::types::messages::SendPriority::Bulk:
+        return SendPriority::Bulk;
+    default:
+        return SendPriority::Interactive;
+    }
+}
+
+}
+
+tg::UserSession::UserSession(std::int64_t chatId, SessionContext& context, lua::StateSource& states, lua::CoroutineScheduler::TimerRequest timers)
+    : _chatId(chatId), _context(context), _states(states), _scheduler(std::move(timers), context.states.budget),
+      _lastActivity(std::chrono::steady_clock::now())
+{
+    auto commandBoxResult = _states.acquire();
 
     if(!commandBoxResult) {
         auto err = commandBoxResult.error();
@@ -19,67 +41,125 @@ tg::UserSession::UserSession(const std::shared_ptr<TgBot::Bot>& bot, const Bytec
 
     auto commandBox = commandBoxResult.value();
     _commandBox.reset(commandBox);
+
+    bind_api();
+    map_commands();
+    start_commands();
 }
 
 void tg::UserSession::manage_message(const TgBot::Message::Ptr& message)
 {
-    _lastActivity = std::chrono::high_resolution_clock::now();
+    _lastActivity = std::chrono::steady_clock::now();
+
+    follow_reload();
+
+    if(!wake()) {
+        return;
+    }
+
+    _scheduler.notify_input();
+
+    // a dialog waiting for an answer gets it directly, the command table is not involved
+    if(_scheduler.deliver(lua::api::types::routines::InputKind::Message, message->text)) {
+        return;
+    }
+
+    std::string_view text = message->text;
+
+    // "/name rest" switches the chat to the command, everything else goes to the command picked last
+    if(text.starts_with('/')) {
+        auto command = text.substr(1, text.find(' ') - 1);
+        auto name = command.substr(0, command.find('@'));
+
+        if(!_dispatch.contains(name)) {
+            luabot_logInfo("Chat {} asked for unknown command {}", _chatId, name);
+            return;
+        }
+
+        _activeCommand = name;
+    }
+
+    if(_activeCommand.empty()) {
+        return;
+    }
+
+    const auto& handler = resolve(_activeCommand, _dispatch.find(_activeCommand)->second).onMessage;
+
+    if(!handler) {
+        return;
+    }
 
-    return;
+    // a handler cannot be preempted like a coroutine, the budget only stops one that never returns
+    lua::BudgetScope budget(_context.states.budget, nullptr);
+    accept_result(_activeCommand, handler.value()(_chatId, message->text));
 }
 
 void tg::UserSession::manage_callback(const TgBot::CallbackQuery::Ptr& callbackQuery)
 {
-    _lastActivity = std::chrono::high_resolution_clock::now();
-    auto tokens = utils::string_split(callbackQuery->data, ';');
+    _lastActivity = std::chrono::steady_clock::now();
 
-    if(tokens.size() < 2) {
-        luabot_logErr("Invalid callbackQuery data format, expected `function;data`, got {}", callbackQuery->data);
+    follow_reload();
+
+    if(!wake()) {
+        return;
     }
 
-    auto commandName = tokens[0];
-    auto callbackData = tokens[1];
+    _scheduler.notify_input();
 
-    auto command = _commandBox->commands()[commandName]["CallbackQuery"].get<sol::function>();
+    std::string_view data = callbackQuery->data;
+    auto separator = data.find(';');
 
-    if(!command.valid()) {
-        luabot_logFatal("CallbackQuery provided by script {} is not a function!", commandName);
+    if(separator == std::string_view::npos) {
+        luabot_logErr("Invalid callbackQuery data format, expected `command;data`, got {}", callbackQuery->data);
         return;
     }
 
-    auto result = command(callbackData);
+    auto commandName = data.substr(0, separator);
+    auto callbackData = data.substr(separator + 1);
 
-    if(!result.valid()) {
-        luabot_logFatal("CallbackQuery provided by {} called with failure: {}", commandName, result.get<sol::error>().what());
+    // a button belongs to the command that sent it, another command waiting in WaitCallback must not take its press
+    if(_scheduler.deliver(lua::api::types::routines::InputKind::Callback, callbackData, commandName)) {
+        return;
+    }
+
+    auto command = _dispatch.find(commandName);
+
+    if(command == _dispatch.end() || !resolve(command->first, command->second).onCallback) {
+        luabot_logErr("Command {} has no on_callback handler", commandName);
         return;
     }
 
-    // todo: handle if callback query returned coroutine or smth like that;
+    lua::BudgetScope budget(_context.states.budget, nullptr);
+    accept_result(command->first, command->second.onCallback.value()(_chatId, callbackData));
 }
 
 void tg::UserSession::update()
 {
-    for(std::ptrdiff_t i = 0; i < _coroutines.size(); i++) {
-        auto coroutine = _coroutines.front();
-        auto result = coroutine();
-        _coroutines.pop();
+    // nothing can be scheduled in a hibernated session, there is no point to wake it up
+    if(hibernated()) {
+        return;
+    }
 
-        if(!result.valid()) {
-            sol::error err = result;
-            luabot_logErr("Coroutine resume failed: {}", err.what());
-            continue;
-        }
+    _scheduler.run_ready();
+}
 
-        sol::object obj = result;
-        if(obj.is<lua::api::types::routines::CoroutineStep>()) {
-            auto status = obj.as<lua::api::types::routines::CoroutineStep>();
-            if(status == lua::api::types::routines::CoroutineStep::Step) {
-                _coroutines.push(coroutine);
-            }
-        } else {
-            luabot_logErr("Coroutine returned unsupported type");
-        }
+bool tg::UserSession::has_ready_coroutines() const
+{
+    return !hibernated() && _scheduler.has_ready();
+}
+
+void tg::UserSession::notify_timer(std::uint64_t timer)
+{
+    _scheduler.notify_timer(timer);
+}
+
+bool tg::UserSession::collect_garbage(std::size_t stepKb)
+{
+    if(hibernated()) {
+        return true;
     }
+
+    return lua_gc(_commandBox->state().lua_state(), LUA_GCSTEP, static_cast<int>(stepKb)) == 1;
 }
 
 tg::UserSession::TimePoint tg::UserSession::last_activity() const
@@ -87,125 +167,498 @@ tg::UserSession::TimePoint tg::UserSession::last_activity() const
     return _lastActivity;
 }
 
-void tg::UserSession::force_close()
+std::size_t tg::UserSession::memory_used() const
 {
+    if(hibernated() || !_commandBox->allocator()) {
+        return 0;
+    }
+
+    return _commandBox->allocator()->used();
 }
 
-void tg::UserSession::map_commands()
+bool tg::UserSession::force_close()
 {
-    for (const auto& [name, func_object] : _commandBox->commands()) {
-        auto str_name = name.as<std::string>();
-        
-        if(!func_object.is<sol::function>()) {
-            luabot_logErr("Lua object named {} is not a function!", str_name);
-        }
+    if(hibernate()) {
+        return true;
+    }
 
-        auto function = func_object.as<sol::function>();
+    auto idle = std::chrono::steady_clock::now() - _lastActivity;
 
-        _mappedCommands.insert_or_assign(str_name, function);
+    if(_scheduler.empty() || idle < ParkedCoroutineTimeout) {
+        return false;
     }
+
+    luabot_logInfo("Chat {} was idle for {} minutes, its {} coroutines are cancelled", _chatId,
+        std::chrono::duration_cast<std::chrono::minutes>(idle).count(), _scheduler.size());
+
+    _scheduler.clear();
+    return hibernate();
 }
 
-tg::UserSessionThread::UserSessionThread(const std::shared_ptr<TgBot::Bot>& bot, const BytecodeMap& commands)
-    : _session(bot, commands)
+bool tg::UserSession::hibernate()
 {
-    _thread = std::thread(&UserSessionThread::thread_func, this);
-    luabot_logInfo("Started UserSessionThread");
+    if(hibernated()) {
+        return true;
+    }
+
+    if(!_scheduler.empty()) {
+        luabot_logInfo("Session has {} running coroutines, hibernation postponed", _scheduler.size());
+        return false;
+    }
+
+    auto blob = lua::persist::dump_commands(_commandBox->commands(), _commandBox->script_globals());
+
+    if(!blob) {
+        luabot_logErr("Unable to hibernate session: {}", blob.error().message());
+        return false;
+    }
+
+    _hibernatedState = std::move(blob.value());
+    _dispatch.clear();
+    _scheduler.drop_threads();
+    unbind_api();
+    _states.release(std::move(_commandBox));
+
+    return true;
 }
 
-tg::UserSessionThread::~UserSessionThread()
+bool tg::UserSession::hibernated() const
 {
-    {
-        std::unique_lock lock(_mutex);
-        _running = false;
-        _condition.notify_one();
+    return _commandBox == nullptr;
+}
+
+bool tg::UserSession::wake()
+{
+    if(!hibernated()) {
+        return true;
     }
 
-    if(_thread.joinable()) {
-        _thread.join();
+    auto commandBoxResult = _states.acquire();
+
+    if(!commandBoxResult) {
+        luabot_logErr("Unable to wake a hibernated session: {}", commandBoxResult.error().message());
+        return false;
+    }
+
+    _commandBox.reset(commandBoxResult.value());
+    bind_api();
+
+    auto restored = lua::persist::restore_commands(_commandBox->commands(), _commandBox->globals(), _hibernatedState);
+
+    if(!restored) {
+        luabot_logErr("Session state is lost, starting from scratch: {}", restored.error().message());
     }
 
+    map_commands();
 
+    _hibernatedState.clear();
+    _hibernatedState.shrink_to_fit();
+
+    return true;
 }
 
-void tg::UserSessionThread::enqueue_task(NoReturningTask task)
+void tg::UserSession::follow_reload()
 {
-    {
-        std::unique_lock lock(_mutex);
-        _tasks.push(std::move(task));
+    // running coroutines are in the middle of the old scripts, the switch waits for them to end
+    if(hibernated() || _commandBox->generation() == _states.generation() || !_scheduler.empty()) {
+        return;
     }
 
-    _condition.notify_one();
+    luabot_logInfo("Chat {} switches to reloaded scripts", _chatId);
+    hibernate();
 }
 
-void tg::UserSessionThread::manage_message(const TgBot::Message::Ptr& message)
+void tg::UserSession::accept_result(const std::string& command, const sol::protected_function_result& result)
 {
-    enqueue_task([this, message]() {
-        _session.manage_message(message);
+    if(!result.valid()) {
+        sol::error err = result;
+        luabot_logErr("Handler of command {} failed: {}", command, err.what());
+        return;
+    }
+
+    sol::object value = result;
+
+    if(value.is<lua::CoroutineScheduler::Coroutine>()) {
+        _scheduler.spawn(command, value.as<lua::CoroutineScheduler::Coroutine>());
+    }
+}
+
+void tg::UserSession::bind_api()
+{
+    // handlers never wait for telegram, the message goes to the send queue and the handler goes on.
+    // replies are interactive unless the script says otherwise, a broadcast passes SendPriority.Bulk
+    _commandBox->globals().set_function("SendMessage", [this](const std::string& text, sol::optional<lua::api::types::messages::SendPriority> priority) {
+        _context.sendQueue.send(_chatId, text, internal::send_priority(priority.value_or(lua::api::types::messages::SendPriority::Interactive)));
+    });
+
+    // coroutines of the chat reuse the threads of its finished ones
+    _commandBox->globals().set_function("MakeCoroutine", [this](const sol::function& func, lua::api::types::routines::CoroutinePolicy policy) {
+        return _scheduler.make_coroutine(func, policy);
+    });
+
+    // the callback runs as a coroutine of its own, so it may Sleep as well
+    _commandBox->globals().set_function("After", [this](std::int64_t milliseconds, const sol::function& callback) {
+        auto coroutine = _scheduler.make_coroutine(callback, lua::api::types::routines::CoroutinePolicy::SyncExecute);
+        _scheduler.spawn_after(std::chrono::milliseconds { std::max<std::int64_t>(milliseconds, 0) }, std::move(coroutine));
     });
 }
 
+void tg::UserSession::unbind_api()
+{
+    auto globals = _commandBox->globals();
+
+    globals["SendMessage"] = sol::lua_nil;
+    globals["After"] = sol::lua_nil;
+    globals.set_function("MakeCoroutine", &lua::api::functions::make_coroutine);
+}
+
+void tg::UserSession::map_commands()
+{
+    _dispatch.clear();
+
+    for(const auto& name : _commandBox->command_names()) {
+        auto& handlers = _dispatch[name];
+
+        // commands built with the state or restored from hibernation are taken right away, the rest on first use
+        if(_commandBox->commands().raw_get<sol::object>(name).get_type() != sol::type::lua_nil) {
+            resolve(name, handlers);
+        }
+    }
+
+    // a reload may have removed the command the chat was talking to
+    if(!_activeCommand.empty() && !_dispatch.contains(_activeCommand)) {
+        _activeCommand.clear();
+    }
+}
+
+void tg::UserSession::start_commands()
+{
+    lua::BudgetScope budget(_context.states.budget, nullptr);
+
+    // check_scripts recorded every command having on_start, those are built with the state
+    for(const auto& [name, handlers] : _dispatch) {
+        if(handlers.onStart) {
+            accept_result(name, handlers.onStart.value()());
+        }
+    }
+}
+
+tg::UserSession::CommandHandlers& tg::UserSession::resolve(const std::string& name, CommandHandlers& handlers)
+{
+    if(handlers.resolved) {
+        return handlers;
+    }
+
+    handlers.resolved = true;
+
+    sol::object command = _commandBox->commands()[name];
+
+    if(command.get_type() != sol::type::table) {
+        luabot_logErr("Command {} is not a table", name);
+        return handlers;
+    }
+
+    auto table = command.as<sol::table>();
+
+    handlers.onStart = table["on_start"].get<sol::optional<sol::protected_function>>();
+    handlers.onMessage = table["on_message"].get<sol::optional<sol::protected_function>>();
+    handlers.onCallback = table["on_callback"].get<sol::optional<sol::protected_function>>();
+
+    return handlers;
+}
+
+tg::UserSessionThread::UserSessionThread(SessionContext& context, std::int64_t chatId, lua::StateSource& states, Strand* sharedStrand)
+    : _context(context), _chatId(chatId),
+      _ownStrand(sharedStrand ? nullptr : std::make_unique<Strand>(chatId)), _strand(sharedStrand ? *sharedStrand : *_ownStrand),
+      _states(states), _lastActivity(std::chrono::steady_clock::now())
+{
+}
+
+void tg::UserSessionThread::manage_message(const TgBot::Message::Ptr& message)
+{
+    _lastActivity = std::chrono::steady_clock::now();
+    _closing = false;
+
+    // telegram keeps updates for a day, after a downtime the backlog is mostly noise
+    auto age = std::chrono::system_clock::now() - std::chrono::system_clock::from_time_t(message->date);
+
+    if(age > _context.admission.settings().maxAge) {
+        _context.admission.count(AdmissionEvent::Stale);
+        return;
+    }
+
+    admit({ message, nullptr, _lastActivity });
+}
+
 void tg::UserSessionThread::manage_message(const TgBot::CallbackQuery::Ptr& callbackQuery)
 {
-    enqueue_task([this, callbackQuery]() {
-        _session.manage_callback(callbackQuery);
-    });
+    _lastActivity = std::chrono::steady_clock::now();
+    _closing = false;
+
+    admit({ nullptr, callbackQuery, _lastActivity });
 }
 
 tg::UserSession::TimePoint tg::UserSessionThread::last_activity() const
 {
-    return _session.last_activity();
+    return _lastActivity;
+}
+
+bool tg::UserSessionThread::closing() const
+{
+    return _closing;
+}
+
+std::size_t tg::UserSessionThread::memory_used() const
+{
+    return _memoryUsed.load(std::memory_order_relaxed);
 }
 
 void tg::UserSessionThread::force_close()
 {
+    _closing = true;
+
     enqueue_task([this]() {
-        _session.force_close();
+        // running coroutines postpone it, the next verification pass tries again
+        if(!_session->force_close()) {
+            _closing = false;
+        }
+
+        account_memory();
+    });
+}
+
+void tg::UserSessionThread::request_timer(std::uint64_t timer, std::chrono::milliseconds delay)
+{
+    _context.executor.submit_after(_strand, delay, [this, timer]() {
+        _session->notify_timer(timer);
+        schedule_coroutines();
     });
 }
 
 void tg::UserSessionThread::update()
 {
     enqueue_task([this]() {
-        try {
-            _session.update();
-        } catch(const std::exception& e) {
-            luabot_logErr("Exception in manual UserSession update: {}", e.what());
-        }
+        schedule_coroutines();
     });
+}
 
-    _condition.notify_one();
+bool tg::UserSessionThread::Incoming::same_content(const Incoming& other) const
+{
+    if(message && other.message) {
+        return message->text == other.message->text;
+    }
+
+    if(callbackQuery && other.callbackQuery) {
+        return callbackQuery->data == other.callbackQuery->data;
+    }
+
+    return false;
 }
 
-void tg::UserSessionThread::thread_func()
+void tg::UserSessionThread::admit(Incoming&& incoming)
 {
-    while(true) {
-        NoReturningTask task;
+    const auto& settings = _context.admission.settings();
 
-        {
-            std::unique_lock lock(_mutex);
-            _condition.wait(lock, [this] {
-                return !_running || !_tasks.empty();
+    std::unique_lock lock(_inboxMutex);
+
+    if(_inbox.size() >= settings.chatQueueLimit) {
+        if(settings.overflow == OverflowPolicy::Reject) {
+            _context.admission.count(AdmissionEvent::Rejected);
+            return;
+        }
+
+        auto dropped = _inbox.begin();
+        auto event = AdmissionEvent::DroppedOldest;
+
+        if(settings.overflow == OverflowPolicy::Coalesce) {
+            auto same = std::ranges::find_if(_inbox, [&](const Incoming& pending) {
+                return pending.same_content(incoming);
             });
 
-            if(!_running && _tasks.empty()) {
-                break;
+            if(same != _inbox.end()) {
+                dropped = same;
+                event = AdmissionEvent::Coalesced;
             }
+        }
+
+        // the new update takes over the slot of the dropped one, so it is admitted whatever the global load
+        _inbox.erase(dropped);
+        _context.admission.count(event);
+        _context.admission.enter_replacing();
+    } else if(!_context.admission.try_enter()) {
+        return;
+    }
 
-            if(!_tasks.empty()) {
-                task = std::move(_tasks.front());
-                _tasks.pop();
+    _inbox.push_back(std::move(incoming));
+
+    if(_draining) {
+        return;
+    }
+
+    _draining = true;
+    lock.unlock();
+
+    _context.executor.submit(_strand, [this]() {
+        drain();
+    });
+}
+
+void tg::UserSessionThread::drain()
+{
+    auto ready = ensure_session();
+
+    // one inbox worth of updates per task, a chat that keeps flooding still yields the worker in between
+    for(std::size_t handled = 0;; handled++) {
+        Incoming incoming;
+
+        {
+            std::unique_lock lock(_inboxMutex);
+
+            if(_inbox.empty()) {
+                _draining = false;
+                lock.unlock();
+
+                account_memory();
+                schedule_idle_gc();
+                return;
             }
+
+            if(handled == _context.admission.settings().chatQueueLimit) {
+                lock.unlock();
+
+                _context.executor.submit(_strand, [this]() {
+                    drain();
+                });
+
+                account_memory();
+                return;
+            }
+
+            incoming = std::move(_inbox.front());
+            _inbox.pop_front();
+        }
+
+        // the slot is given back first, a throwing handler must not leak it
+        _context.admission.leave();
+
+        // the reason was logged by ensure_session, the update is only counted
+        if(!ready) {
+            _context.admission.count(AdmissionEvent::Unhandled);
+            continue;
+        }
+
+        if(std::chrono::steady_clock::now() - incoming.received > _context.admission.settings().maxAge) {
+            _context.admission.count(AdmissionEvent::Stale);
+            continue;
         }
 
-        if(task) {
-            try {
-                task();
-            } catch(const std::exception& e) {
-                luabot_logErr("Exception in UserSessionThread task: {}", e.what());
-            } catch(...) {
-                luabot_logErr("Unknown exception in UserSessionThread task");
+        try {
+            if(incoming.message) {
+                _session->manage_message(incoming.message);
+            } else if(incoming.callbackQuery) {
+                _session->manage_callback(incoming.callbackQuery);
             }
+        } catch(const std::exception& e) {
+            luabot_logErr("Exception while handling an update of chat {}: {}", _chatId, e.what());
+        }
+
+        schedule_coroutines();
+    }
+}
+
+void tg::UserSessionThread::schedule_coroutines()
+{
+    if(_coroutinesScheduled || !_session || !_session->has_ready_coroutines()) {
+        return;
+    }
+
+    _coroutinesScheduled = true;
+
+    _context.executor.submit(_strand, [this]() {
+        run_coroutines();
+    });
+}
+
+void tg::UserSessionThread::run_coroutines()
+{
+    _coroutinesScheduled = false;
+
+    try {
+        _session->update();
+    } catch(const std::exception& e) {
+        luabot_logErr("Exception while resuming coroutines of chat {}: {}", _chatId, e.what());
+    }
+
+    account_memory();
+
+    // stepping coroutines get the next round behind whatever the chat queued meanwhile
+    schedule_coroutines();
+
+    if(!_coroutinesScheduled) {
+        schedule_idle_gc();
+    }
+}
+
+void tg::UserSessionThread::schedule_idle_gc()
+{
+    if(_gcScheduled || !_session || _context.states.gc.idleStepKb == 0) {
+        return;
+    }
+
+    _gcScheduled = true;
+
+    _context.executor.submit_when_idle(_strand, [this]() {
+        collect_idle();
+    });
+}
+
+void tg::UserSessionThread::collect_idle()
+{
+    _gcScheduled = false;
+
+    // the chat got busy again meanwhile, whatever runs next schedules the step again once it is done
+    if(_coroutinesScheduled) {
+        return;
+    }
+
+    {
+        std::unique_lock lock(_inboxMutex);
+
+        if(!_inbox.empty()) {
+            return;
+        }
+    }
+
+    try {
+        if(!_session->collect_garbage(_context.states.gc.idleStepKb)) {
+            schedule_idle_gc();
         }
+    } catch(const std::exception& e) {
+        luabot_logErr("Exception while collecting garbage of chat {}: {}", _chatId, e.what());
     }
+
+    account_memory();
+}
+
+void tg::UserSessionThread::account_memory()
+{
+    _memoryUsed.store(_session ? _session->memory_used() : 0, std::memory_order_relaxed);
+}
+
+bool tg::UserSessionThread::ensure_session()
+{
+    if(_session) {
+        return true;
+    }
+
+    try {
+        _session = std::make_unique<UserSession>(_chatId, _context, _states, [this](std::uint64_t timer, std::chrono::milliseconds delay) {
+            request_timer(timer, delay);
+        });
+    } catch(const std::exception& e) {
+        luabot_logErr("Unable to create a user session for chat {}: {}", _chatId, e.what());
+        return false;
+    }
+
+    return true;
 }
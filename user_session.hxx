@@ -1,74 +1,211 @@
 #pragma once
 
+#include <atomic>
 #include <chrono>
-#include <queue>
+#include <deque>
+#include <mutex>
 #include <string>
 #include <unordered_map>
 
 #include <tgbot/tgbot.h>
 
+#include "admission.hxx"
 #include "lua_load.hxx"
+#include "lua_pool.hxx"
+#include "lua_scheduler.hxx"
+#include "send_queue.hxx"
+#include "session_executor.hxx"
+#include "strings.hxx"
 
 namespace tg {
 
+// a session idle for this long gives up its parked coroutines, a WaitMessage without a timeout would keep it in memory for good
+constexpr std::chrono::minutes ParkedCoroutineTimeout { 30 };
+
+// runtime parts every session works with, owned by BotRuntime and alive as long as any session
+struct SessionContext
+{
+    SessionExecutor& executor;
+    std::shared_ptr<TgBot::Bot> bot;
+    SendQueue& sendQueue;
+    AdmissionControl& admission;
+
+    lua::StateOptions states;
+};
+
 class UserSession
 {
 public:
     using TimePoint = std::chrono::time_point<std::chrono::steady_clock>;
 
-    UserSession(const std::shared_ptr<TgBot::Bot>& bot, const BytecodeMap& commands);
+    UserSession(std::int64_t chatId, SessionContext& context, lua::StateSource& states, lua::CoroutineScheduler::TimerRequest timers);
 
     void manage_message(const TgBot::Message::Ptr& message);
     void manage_callback(const TgBot::CallbackQuery::Ptr& callbackQuery);
 
+    // resumes ready coroutines once
     void update();
+    bool has_ready_coroutines() const;
+
+    void notify_timer(std::uint64_t timer);
+
+    // one incremental collector step, true once it completed a cycle
+    bool collect_garbage(std::size_t stepKb);
 
     TimePoint last_activity() const;
 
-    void force_close();
+    // bytes held by the Lua state of the session, zero while hibernated or when not accounted
+    std::size_t memory_used() const;
+
+    // hibernates, cancelling coroutines parked past ParkedCoroutineTimeout. false while others still run
+    bool force_close();
+
+    bool hibernate();
+    bool hibernated() const;
 
 private:
+    bool wake();
+
+    // gives back a box built from replaced scripts, the next wake takes one of the current generation
+    void follow_reload();
+
+    // handlers of one command, looked up once per state instead of on every update
+    struct CommandHandlers
+    {
+        // commands are built on first use, their handlers are looked up then
+        bool resolved { false };
+
+        sol::optional<sol::protected_function> onStart;
+        sol::optional<sol::protected_function> onMessage;
+        sol::optional<sol::protected_function> onCallback;
+    };
+
+    // a handler may hand back a coroutine, it goes to the scheduler of the session
+    void accept_result(const std::string& command, const sol::protected_function_result& result);
+
+    // functions bound to this chat, set again on every state the session gets
+    void bind_api();
+
+    // the box may go to another session next, nothing bound to this one may stay in it
+    void unbind_api();
+
+    // fills the dispatch table from the commands of the current state
     void map_commands();
+    void start_commands();
+
+    // builds the command if nothing did yet and takes its handlers
+    CommandHandlers& resolve(const std::string& name, CommandHandlers& handlers);
+
+    std::int64_t _chatId;
 
-    std::shared_ptr<TgBot::Bot> _bot;
+    SessionContext& _context;
+    lua::StateSource& _states;
 
-    std::queue<sol::coroutine> _coroutines;
     std::unique_ptr<lua::CommandBox> _commandBox;
-    std::unordered_map<std::string, sol::function> _mappedCommands;
+
+    // declared after the box, its coroutines must be released while their state is still alive
+    lua::CoroutineScheduler _scheduler;
+
+    // command picked by the last "/name" message, plain messages go to it
+    std::string _activeCommand;
+
+    // declared after the box as well, holds references into its state
+    std::unordered_map<std::string, CommandHandlers, utils::StringHash, std::equal_to<>> _dispatch;
+
+    // script data of a hibernated session, the Lua state is rebuilt from bytecode and this blob on the next update
+    std::string _hibernatedState;
 
     TimePoint _lastActivity;
 };
 
+// a logical session thread: tasks of one chat run in submission order on its executor strand.
+// updates wait in a bounded inbox first, so a flooding chat costs at most chatQueueLimit updates of memory
 class UserSessionThread
 {
 public:
-    using NoReturningTask = std::function<void()>;
-
-    UserSessionThread(const std::shared_ptr<TgBot::Bot>& bot, const BytecodeMap& commands);
-    ~UserSessionThread();
+    // sessions sharing a Lua state pass the strand of that state, the others get a strand of their own
+    UserSessionThread(SessionContext& context, std::int64_t chatId, lua::StateSource& states, Strand* sharedStrand = nullptr);
 
-    void enqueue_task(NoReturningTask task);
+    template<std::invocable Task>
+    void enqueue_task(Task&& task);
 
     void manage_message(const TgBot::Message::Ptr& message);
     void manage_message(const TgBot::CallbackQuery::Ptr& callbackQuery);
 
     UserSession::TimePoint last_activity() const;
+    bool closing() const;
+
+    // as of the last task that ran on the strand, safe to read from any thread
+    std::size_t memory_used() const;
+
     void force_close();
 
     void update();
 
 private:
-    void thread_func();
+    struct Incoming
+    {
+        TgBot::Message::Ptr message;
+        TgBot::CallbackQuery::Ptr callbackQuery;
+
+        UserSession::TimePoint received;
+
+        bool same_content(const Incoming& other) const;
+    };
+
+    void admit(Incoming&& incoming);
+    void drain();
+
+    // keeps the strand busy while the session has ready coroutines, idle sessions are never resumed
+    void schedule_coroutines();
+    void run_coroutines();
+
+    void request_timer(std::uint64_t timer, std::chrono::milliseconds delay);
+
+    void account_memory();
 
-    bool _running { true };
+    // collector steps run in the gaps between updates, until a whole cycle is done
+    void schedule_idle_gc();
+    void collect_idle();
 
-    std::thread _thread;
-    std::mutex _mutex;
+    bool ensure_session();
 
-    std::condition_variable _condition;
-    std::queue<NoReturningTask> _tasks;
+    SessionContext& _context;
+    std::int64_t _chatId;
 
-    UserSession _session;
+    std::unique_ptr<Strand> _ownStrand;
+    Strand& _strand;
+
+    lua::StateSource& _states;
+
+    std::mutex _inboxMutex;
+    std::deque<Incoming> _inbox;
+    bool _draining { false };
+
+    // touched on the strand only
+    bool _coroutinesScheduled { false };
+    bool _gcScheduled { false };
+
+    std::atomic<std::size_t> _memoryUsed { 0 };
+
+    // created by the first task on the strand, building a Lua state must not block the update intake
+    std::unique_ptr<UserSession> _session;
+
+    // touched by the intake thread only
+    UserSession::TimePoint _lastActivity;
+
+    // set by the intake thread, cleared by the strand again when the session refused to close
+    std::atomic<bool> _closing { false };
 };
 
+template<std::invocable Task>
+void UserSessionThread::enqueue_task(Task&& task)
+{
+    _context.executor.submit(_strand, [this, task = std::forward<Task>(task)]() mutable {
+        if(ensure_session()) {
+            task();
+        }
+    });
+}
+
 }
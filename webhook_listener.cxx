@@ -0,0 +1,208 @@
+#include "webhook_listener.hxx"
+
+#include <format>
+#include <memory>
+#include <string_view>
+
+#include "logdef.hxx"
+#include "webhook_request.hxx"
+
+namespace tg::internal {
+
+constexpr std::size_t MaxHeaderSize = 16 * 1024;
+constexpr std::size_t MaxBodySize = 1024 * 1024;
+
+// telegram keeps its connections open between updates, anything silent for this long is closed
+constexpr std::chrono::seconds IdleTimeout { 60 };
+
+}
+
+class tg::WebhookListener::Connection : public std::enable_shared_from_this<Connection>
+{
+public:
+    Connection(WebhookListener& listener, boost::asio::ip::tcp::socket socket)
+        : _listener(listener), _socket(std::move(socket)), _timer(_socket.get_executor()),
+          _buffer(internal::MaxHeaderSize + internal::MaxBodySize)
+    {
+    }
+
+    void read_head()
+    {
+        arm_timer();
+
+        boost::asio::async_read_until(_socket, _buffer, "\r\n\r\n", [self = shared_from_this()](const boost::system::error_code& error, std::size_t size) {
+            if(error) {
+                self->close();
+                return;
+            }
+
+            std::string_view head(static_cast<const char*>(self->_buffer.data().data()), size);
+            auto request = parse_request_head(head);
+
+            if(!request) {
+                self->respond("400 Bad Request", true);
+                return;
+            }
+
+            self->_method = request->method;
+            self->_path = request->path;
+            self->_secret = request->secret;
+            self->_close = request->close;
+
+            self->_buffer.consume(size);
+
+            if(request->contentLength > internal::MaxBodySize) {
+                self->respond("413 Payload Too Large", true);
+                return;
+            }
+
+            self->read_body(request->contentLength);
+        });
+    }
+
+private:
+    void read_body(std::size_t length)
+    {
+        if(_buffer.size() >= length) {
+            handle(length);
+            return;
+        }
+
+        boost::asio::async_read(_socket, _buffer, boost::asio::transfer_exactly(length - _buffer.size()),
+            [self = shared_from_this(), length](const boost::system::error_code& error, std::size_t) {
+                if(error) {
+                    self->close();
+                    return;
+                }
+
+                self->handle(length);
+            });
+    }
+
+    void handle(std::size_t length)
+    {
+        const auto& settings = _listener._settings;
+
+        // TgTypeParser only parses from a std::string, the body is copied out of the receive buffer once
+        std::string body(static_cast<const char*>(_buffer.data().data()), length);
+        _buffer.consume(length);
+
+        if(_method != "POST" || _path != settings.path) {
+            respond("404 Not Found", _close);
+            return;
+        }
+
+        if(!settings.secret.empty() && _secret != settings.secret) {
+            luabot_logWarn("Webhook request with a wrong secret token rejected");
+            respond("401 Unauthorized", true);
+            return;
+        }
+
+        TgBot::Update::Ptr update;
+
+        try {
+            update = _listener._parser.parseJsonAndGetUpdate(_listener._parser.parseJson(body));
+        } catch(const std::exception& e) {
+            luabot_logErr("Unable to parse a webhook update: {}", e.what());
+            respond("400 Bad Request", _close);
+            return;
+        }
+
+        // the handler only enqueues, telegram gets its answer right after
+        _listener._handler(update);
+        respond("200 OK", _close);
+    }
+
+    void respond(std::string_view status, bool close)
+    {
+        _response = std::format("HTTP/1.1 {}\r\nContent-Length: 0\r\nConnection: {}\r\n\r\n", status, close ? "close" : "keep-alive");
+
+        boost::asio::async_write(_socket, boost::asio::buffer(_response), [self = shared_from_this(), close](const boost::system::error_code& error, std::size_t) {
+            if(error || close) {
+                self->close();
+                return;
+            }
+
+            self->read_head();
+        });
+    }
+
+    void arm_timer()
+    {
+        _timer.expires_after(internal::IdleTimeout);
+        _timer.async_wait([weak = weak_from_this()](const boost::system::error_code& error) {
+            auto self = weak.lock();
+
+            if(!error && self) {
+                self->close();
+            }
+        });
+    }
+
+    void close()
+    {
+        boost::system::error_code ignored;
+
+        _timer.cancel();
+        _socket.shutdown(boost::asio::ip::tcp::socket::shutdown_both, ignored);
+        _socket.close(ignored);
+    }
+
+    WebhookListener& _listener;
+
+    boost::asio::ip::tcp::socket _socket;
+    boost::asio::steady_timer _timer;
+    boost::asio::streambuf _buffer;
+
+    std::string _method;
+    std::string _path;
+    std::string _secret;
+    bool _close { false };
+
+    std::string _response;
+};
+
+tg::WebhookListener::WebhookListener(const WebhookSettings& settings, Handler handler)
+    : _settings(settings), _handler(std::move(handler)), _acceptor(_io, { boost::asio::ip::tcp::v4(), settings.port })
+{
+    luabot_logInfo("Webhook listener bound to port {}, path {}", port(), _settings.path);
+    accept();
+}
+
+tg::WebhookListener::~WebhookListener()
+{
+    boost::system::error_code ignored;
+    _acceptor.close(ignored);
+}
+
+void tg::WebhookListener::run_for(std::chrono::milliseconds duration)
+{
+    _io.run_for(duration);
+
+    // run_for leaves the context stopped once it ran out of work, the next call must find it ready
+    if(_io.stopped()) {
+        _io.restart();
+    }
+}
+
+std::uint16_t tg::WebhookListener::port() const
+{
+    return _acceptor.local_endpoint().port();
+}
+
+void tg::WebhookListener::accept()
+{
+    _acceptor.async_accept([this](const boost::system::error_code& error, boost::asio::ip::tcp::socket socket) {
+        if(error == boost::asio::error::operation_aborted) {
+            return;
+        }
+
+        if(error) {
+            luabot_logErr("Webhook accept failed: {}", error.message());
+        } else {
+            std::make_shared<Connection>(*this, std::move(socket))->read_head();
+        }
+
+        accept();
+    });
+}
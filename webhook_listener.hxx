@@ -0,0 +1,58 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <string>
+
+#include <boost/asio.hpp>
+#include <tgbot/tgbot.h>
+
+namespace tg {
+
+constexpr std::uint16_t DefaultWebhookPort = 8443;
+
+struct WebhookSettings
+{
+    // public address telegram posts to, left empty when the webhook is registered by someone else (e.g. a proxy in front of several runtimes)
+    std::string url;
+
+    std::uint16_t port { DefaultWebhookPort };
+    std::string path { "/" };
+
+    // compared against X-Telegram-Bot-Api-Secret-Token when not empty
+    std::string secret;
+};
+
+// minimal HTTP/1.1 endpoint for telegram webhooks. it owns no threads: whoever calls run_for gets the updates
+// delivered on its own thread, so the runtime intake stays single threaded exactly like with polling
+class WebhookListener
+{
+public:
+    using Handler = std::function<void(const TgBot::Update::Ptr&)>;
+
+    WebhookListener(const WebhookSettings& settings, Handler handler);
+    ~WebhookListener();
+
+    WebhookListener(const WebhookListener&) = delete;
+    WebhookListener& operator=(const WebhookListener&) = delete;
+
+    void run_for(std::chrono::milliseconds duration);
+
+    std::uint16_t port() const;
+
+private:
+    class Connection;
+
+    void accept();
+
+    WebhookSettings _settings;
+    Handler _handler;
+
+    TgBot::TgTypeParser _parser;
+
+    boost::asio::io_context _io;
+    boost::asio::ip::tcp::acceptor _acceptor;
+};
+
+}
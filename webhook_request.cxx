@@ -0,0 +1,85 @@
+#include "webhook_request.hxx"
+
+#include <cctype>
+#include <charconv>
+
+namespace tg::internal {
+
+std::string_view trim(std::string_view text)
+{
+    while(!text.empty() && (text.front() == ' ' || text.front() == '\t')) {
+        text.remove_prefix(1);
+    }
+
+    while(!text.empty() && (text.back() == ' ' || text.back() == '\t' || text.back() == '\r')) {
+        text.remove_suffix(1);
+    }
+
+    return text;
+}
+
+bool iequals(std::string_view a, std::string_view b)
+{
+    if(a.size() != b.size()) {
+        return false;
+    }
+
+    for(std::size_t i = 0; i < a.size(); i++) {
+        if(std::tolower(static_cast<unsigned char>(a[i])) != std::tolower(static_cast<unsigned char>(b[i]))) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+}
+
+std::optional<tg::WebhookRequestHead> tg::parse_request_head(std::string_view head)
+{
+    WebhookRequestHead result;
+
+    auto lineEnd = head.find("\r\n");
+    auto requestLine = head.substr(0, lineEnd);
+
+    auto methodEnd = requestLine.find(' ');
+    auto targetEnd = requestLine.find(' ', methodEnd + 1);
+
+    if(methodEnd == std::string_view::npos || targetEnd == std::string_view::npos) {
+        return std::nullopt;
+    }
+
+    result.method = requestLine.substr(0, methodEnd);
+    result.path = requestLine.substr(methodEnd + 1, targetEnd - methodEnd - 1);
+    result.path = result.path.substr(0, result.path.find('?'));
+    result.close = requestLine.substr(targetEnd + 1) == "HTTP/1.0";
+
+    while(lineEnd != std::string_view::npos) {
+        auto begin = lineEnd + 2;
+        lineEnd = head.find("\r\n", begin);
+
+        auto line = head.substr(begin, lineEnd == std::string_view::npos ? std::string_view::npos : lineEnd - begin);
+        auto colon = line.find(':');
+
+        if(colon == std::string_view::npos) {
+            continue;
+        }
+
+        auto name = internal::trim(line.substr(0, colon));
+        auto value = internal::trim(line.substr(colon + 1));
+
+        if(internal::iequals(name, "Content-Length")) {
+            auto [end, error] = std::from_chars(value.data(), value.data() + value.size(), result.contentLength);
+
+            if(error != std::errc {} || end != value.data() + value.size()) {
+                return std::nullopt;
+            }
+        } else if(internal::iequals(name, "Connection")) {
+            result.close = internal::iequals(value, "close");
+        } else if(internal::iequals(name, "X-Telegram-Bot-Api-Secret-Token")) {
+            result.secret = value;
+        }
+    }
+
+    return result;
+}
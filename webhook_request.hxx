@@ -0,0 +1,24 @@
+#pragma once
+
+#include <cstddef>
+#include <optional>
+#include <string_view>
+
+namespace tg {
+
+// the parts of a request head the webhook listener acts on, views into the parsed text
+struct WebhookRequestHead
+{
+    std::string_view method;
+    std::string_view path;
+    std::string_view secret;
+
+    std::size_t contentLength { 0 };
+    bool close { false };
+};
+
+// takes everything up to the empty line. the query is cut off the path, nullopt when the request line
+// or Content-Length is malformed
+std::optional<WebhookRequestHead> parse_request_head(std::string_view head);
+
+}
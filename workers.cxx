@@ -1,9 +1,12 @@
 #include "workers.hxx"
 
+#include <algorithm>
+#include <atomic>
 #include <mutex>
 #include <queue>
 #include <thread>
 #include <utility>
+#include <vector>
 
 namespace workers::internal
 {
@@ -97,5 +100,30 @@ void execute(Task task, Callback on_success, Callback on_fail)
     internal::data::queue_condition.notify_all();
 }
 
+std::size_t parallelism()
+{
+    return std::max<std::size_t>(std::thread::hardware_concurrency(), 1);
 }
 
+void parallel_for(std::size_t count, const std::function<void(std::size_t index, std::size_t worker)>& body)
+{
+    std::atomic<std::size_t> next { 0 };
+
+    // indices are taken one by one, uneven items do not leave a thread idle with its share done
+    auto run = [&](std::size_t worker) {
+        for(auto index = next++; index < count; index = next++) {
+            body(index, worker);
+        }
+    };
+
+    auto helpers = std::min(parallelism(), count);
+    std::vector<std::jthread> threads;
+
+    for(std::size_t worker = 1; worker < helpers; worker++) {
+        threads.emplace_back(run, worker);
+    }
+
+    run(0);
+}
+
+}
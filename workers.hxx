@@ -42,6 +42,13 @@ void shutdown();
 
 void execute(Task task, Callback on_success = default_success_handler, Callback on_fail = default_fail_handler);
 
+// threads parallel_for runs on, the calling one included
+std::size_t parallelism();
+
+// calls body for every index in [0, count) and returns once all calls are done. `worker` is below parallelism()
+// and no two concurrent calls share it, so it can pick per thread scratch data. bodies must not throw
+void parallel_for(std::size_t count, const std::function<void(std::size_t index, std::size_t worker)>& body);
+
 }
 
 